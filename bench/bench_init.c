@@ -0,0 +1,79 @@
+/* Pool startup benchmark: init + a small job + destroy, eager versus lazy
+ * worker creation.
+ * usage: bench_init [threads] [tasks] [rounds] > /dev/null
+ *
+ * Every round creates a pool of `threads` workers, submits `tasks` empty
+ * tasks, waits for them, stops and destroys the pool. Results go to
+ * stderr, the pool's debug output to stdout.
+ */
+#if defined(__GNUC__)
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include "../hthpool.h"
+
+static hthpool pool;
+static long done;
+
+static void* count(void* arg) {
+    __atomic_add_fetch (&done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void* stop(void* arg) {
+    hthpool_hard_stop (pool);
+    return NULL;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void run(int lazy, int threads, long tasks, int rounds) {
+    hthpool_attr attr;
+    work_item task = { count, NULL }, halt = { stop, NULL };
+    double t0, t_init = 0, t_job = 0, t_destroy = 0;
+    long i;
+    int r;
+
+    hthpoolattr_init (&attr);
+    hthpoolattr_setlazy (&attr, lazy);
+    for (r = 0; r < rounds; r++) {
+        done = 0;
+        t0 = now ();
+        pool = hthpool_init_attr (threads, &attr);
+        t_init += now () - t0;
+
+        t0 = now ();
+        for (i = 0; i < tasks; i++)
+            hthpool_submit (pool, task);
+        while (__atomic_load_n (&done, __ATOMIC_ACQUIRE) < tasks)
+            sched_yield ();
+        t_job += now () - t0;
+
+        t0 = now ();
+        hthpool_submit (pool, halt);
+        hthpool_wait (pool);
+        hthpool_destroy (pool);
+        t_destroy += now () - t0;
+    }
+    fprintf (stderr, "%-6s init %8.1fus  job %8.1fus  stop+destroy %8.1fus\n",
+             lazy ? "lazy" : "eager", t_init / rounds * 1e6,
+             t_job / rounds * 1e6, t_destroy / rounds * 1e6);
+}
+
+int main(int argc, char** argv) {
+    int threads = argc > 1 ? atoi (argv[1]) : 64;
+    long tasks  = argc > 2 ? atol (argv[2]) : 16;
+    int rounds  = argc > 3 ? atoi (argv[3]) : 100;
+    fprintf (stderr, "%d threads, %ld tasks, %d rounds\n",
+             threads, tasks, rounds);
+    run (0, threads, tasks, rounds);
+    run (1, threads, tasks, rounds);
+    return 0;
+}
@@ -0,0 +1,153 @@
+/* MultiQueue benchmark: rank error versus throughput for a range of
+ * relaxation factors.
+ * usage: bench_multiqueue [threads] [items]
+ *
+ * throughput  every thread alternates push(random key) and pop on a queue
+ *             prefilled with `items` keys
+ * rank error  `items` distinct keys are pushed, then all threads pop until
+ *             the queue is empty; pops are ordered by a global ticket and
+ *             replayed against the set of remaining keys, the rank error of
+ *             a pop is the number of smaller keys still queued
+ * Use at most one thread per core: a thread preempted between its pop and
+ * its ticket shows up as a huge rank error.
+ */
+#if defined(__GNUC__)
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../worklist.h"
+
+#define OPS_PER_THREAD 1000000
+
+static worklist_t wl;
+static size_t nthreads, nitems;
+static long*  pops;
+static size_t ticket;
+
+static void* dry(void* arg) {
+    return NULL;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned long long next_rand(unsigned long long* x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+static void* mixed(void* arg) {
+    unsigned long long rng = (size_t) arg * 0x9e3779b97f4a7c15ULL + 1;
+    work_item item = { dry, NULL };
+    long i;
+    for (i = 0; i < OPS_PER_THREAD; i++) {
+        worklist_add_prio (&wl, item, next_rand (&rng) % (nitems * 4));
+        worklist_trytake (&wl, &item);
+    }
+    return NULL;
+}
+
+static void* fill(void* arg) {
+    size_t id = (size_t) arg, k;
+    work_item item = { dry, NULL };
+    /* keys are a permutation of 0..nitems-1 */
+    for (k = id; k < nitems; k += nthreads) {
+        item.arg = (void*) (long) ((k * 7919) % nitems);
+        worklist_add_prio (&wl, item, (long) item.arg);
+    }
+    return NULL;
+}
+
+static void* drain(void* arg) {
+    work_item item;
+    while (worklist_trytake (&wl, &item) == STAT_OK)
+        pops[__atomic_fetch_add (&ticket, 1, __ATOMIC_SEQ_CST)] =
+            (long) item.arg;
+    return NULL;
+}
+
+static void run(void* (*fn)(void*)) {
+    pthread_t* tids = (pthread_t*) malloc (nthreads * sizeof(pthread_t));
+    size_t i;
+    for (i = 0; i < nthreads; i++)
+        pthread_create (tids + i, NULL, fn, (void*) i);
+    for (i = 0; i < nthreads; i++)
+        pthread_join (tids[i], NULL);
+    free (tids);
+}
+
+/* Fenwick tree over the key space counts the keys still queued */
+static void rank_error(double* mean, long* max) {
+    long* tree = (long*) calloc (nitems + 1, sizeof(long));
+    size_t s, i;
+    long smaller, sum = 0;
+    *max = 0;
+    for (i = 1; i <= nitems; i++) {
+        tree[i]++;
+        if (i + (i & -i) <= nitems)
+            tree[i + (i & -i)] += tree[i];
+    }
+    for (s = 0; s < nitems; s++) {
+        for (smaller = 0, i = pops[s]; i > 0; i -= i & -i)
+            smaller += tree[i];
+        for (i = pops[s] + 1; i <= nitems; i += i & -i)
+            tree[i]--;
+        sum += smaller;
+        if (smaller > *max)
+            *max = smaller;
+    }
+    *mean = (double) sum / nitems;
+    free (tree);
+}
+
+int main(int argc, char** argv) {
+    static const size_t factors[] = { 1, 2, 4, 8, 16 };
+    worklist_attr attr;
+    double t, mean;
+    long max;
+    size_t f;
+
+    nthreads = argc > 1 ? strtoul (argv[1], NULL, 10) : 4;
+    nitems   = argc > 2 ? strtoul (argv[2], NULL, 10) : 1000000;
+    pops = (long*) malloc (nitems * sizeof(long));
+    printf ("threads %zu, items %zu\n", nthreads, nitems);
+    if (nthreads > (size_t) sysconf (_SC_NPROCESSORS_ONLN))
+        printf ("warning: more threads than cores, rank errors are inflated\n");
+    printf ("%8s %14s %16s %16s\n",
+            "factor", "Mops/s", "mean rank err", "max rank err");
+    for (f = 0; f < sizeof(factors) / sizeof(factors[0]); f++) {
+        worklistattr_init (&attr);
+        worklistattr_setconcurrency (&attr, nthreads);
+        worklistattr_settype (&attr, WL_MULTIQUEUE);
+        worklistattr_setfactor (&attr, factors[f]);
+        if (worklist_init (&wl, 0, &attr)) {
+            fprintf (stderr, "cannot create worklist\n");
+            return EXIT_FAILURE;
+        }
+
+        run (fill);
+        t = now ();
+        run (mixed);
+        t = now () - t;
+        worklist_reset (&wl);
+
+        run (fill);
+        ticket = 0;
+        run (drain);
+        rank_error (&mean, &max);
+        printf ("%8zu %14.2f %16.2f %16ld\n", factors[f],
+                2.0 * OPS_PER_THREAD * nthreads / t / 1e6, mean, max);
+        worklist_destroy (&wl);
+    }
+    free (pops);
+    return 0;
+}
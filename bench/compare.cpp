@@ -0,0 +1,589 @@
+/* Comparative benchmark: the same workloads on hthpool, a std::thread pool
+ * and, when the Makefile finds them, OpenMP tasks and TBB.
+ * usage: compare [max threads] [scale] > /dev/null
+ *
+ * empty   `scale` * 100000 empty tasks submitted from the main thread
+ * fib     fib(30 + log2 scale), one task per call down to fib(10); a call
+ *         spawns its two children and the last child to finish completes
+ *         the parent, so no task ever blocks
+ * pfor    `scale` * 4M doubles updated in chunks of 16K elements
+ * matrix  a 384 x 384 (times sqrt scale) matrix product, one task per
+ *         48 x 48 tile of the result
+ * mixed   `scale` * 20000 tasks spinning 2us, every tenth spins 200us;
+ *         latencies are those of the short tasks
+ *
+ * Every backend runs every workload with 1, 2, 4, ... `max threads`
+ * threads (default: all CPUs); a workload is run once to warm up and then
+ * three times, the best time counts. Latency is from submit to the task
+ * starting, over all three runs. Speedup is against 1 thread of the same
+ * backend. The report goes to stderr, the pool's debug output to stdout.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <sched.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef HAVE_OPENMP
+#include <omp.h>
+#endif
+#ifdef HAVE_TBB
+#include <tbb/global_control.h>
+#include <tbb/task_group.h>
+#endif
+#include "compare.h"
+
+#define REPS 3
+
+static long long now(void) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds> (
+        std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+}
+
+static void spin(long long ns) {
+    long long end = now () + ns;
+    while (now () < end)
+        ;
+}
+
+/* -----------------------------------------------------------------------
+ * Backends. `spawn` may be called by the body and by running tasks,
+ * `run` returns once the body and every task it spawned have finished.
+ * -----------------------------------------------------------------------
+ */
+static std::atomic<long> outstanding;
+
+static void execute(cmp_task* t) {
+    t->t_start = now ();
+    t->fn (t);
+    outstanding.fetch_sub (1, std::memory_order_release);
+}
+
+static void quiesce(void) {
+    while (outstanding.load (std::memory_order_acquire) != 0)
+        sched_yield ();
+}
+
+struct backend {
+    const char* name;
+    explicit backend(const char* n) : name (n) {}
+    virtual ~backend() {}
+    virtual void start(int threads) = 0;
+    virtual void stop() = 0;
+    virtual void submit(cmp_task* t) = 0;
+    virtual void run(void (*body)(void*), void* ctx) {
+        body (ctx);
+        quiesce ();
+    }
+};
+
+static backend* cur;
+
+static void spawn(cmp_task* t) {
+    outstanding.fetch_add (1, std::memory_order_relaxed);
+    t->t_submit = now ();
+    cur->submit (t);
+}
+
+struct hthpool_backend : backend {
+    hthpool_backend() : backend ("hthpool") {}
+    void start(int threads) { cmp_hthpool_start (threads, execute); }
+    void stop() { cmp_hthpool_stop (); }
+    void submit(cmp_task* t) { cmp_hthpool_spawn (t); }
+};
+
+/* The baseline: one locked deque and a condition variable */
+struct thread_backend : backend {
+    std::vector<std::thread> workers;
+    std::deque<cmp_task*>    queue;
+    std::mutex               lock;
+    std::condition_variable  cond;
+    bool                     close;
+
+    thread_backend() : backend ("std::thread"), close (false) {}
+    void start(int threads) {
+        close = false;
+        for (int i = 0; i < threads; i++)
+            workers.emplace_back (&thread_backend::loop, this);
+    }
+    void stop() {
+        {
+            std::lock_guard<std::mutex> g (lock);
+            close = true;
+        }
+        cond.notify_all ();
+        for (size_t i = 0; i < workers.size (); i++)
+            workers[i].join ();
+        workers.clear ();
+    }
+    void submit(cmp_task* t) {
+        {
+            std::lock_guard<std::mutex> g (lock);
+            queue.push_back (t);
+        }
+        cond.notify_one ();
+    }
+    void loop() {
+        cmp_task* t;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> g (lock);
+                while (queue.empty () && !close)
+                    cond.wait (g);
+                if (queue.empty ())
+                    return;
+                t = queue.front ();
+                queue.pop_front ();
+            }
+            execute (t);
+        }
+    }
+};
+
+#ifdef HAVE_OPENMP
+/* The body runs in a single construct, tasks are explicit tasks; the
+ * barrier closing the parallel region waits for all of them.
+ */
+struct openmp_backend : backend {
+    int threads;
+    openmp_backend() : backend ("openmp"), threads (1) {}
+    void start(int n) { threads = n; }
+    void stop() {}
+    void submit(cmp_task* t) {
+        #pragma omp task firstprivate(t)
+        execute (t);
+    }
+    void run(void (*body)(void*), void* ctx) {
+        #pragma omp parallel num_threads(threads)
+        #pragma omp single
+        body (ctx);
+    }
+};
+#endif
+
+#ifdef HAVE_TBB
+struct tbb_backend : backend {
+    tbb::global_control* limit;
+    tbb::task_group*     group;
+    tbb_backend() : backend ("tbb"), limit (NULL), group (NULL) {}
+    void start(int threads) {
+        limit = new tbb::global_control (
+            tbb::global_control::max_allowed_parallelism, threads);
+        group = new tbb::task_group;
+    }
+    void stop() {
+        delete group;
+        delete limit;
+        group = NULL;
+        limit = NULL;
+    }
+    void submit(cmp_task* t) {
+        group->run ([t] { execute (t); });
+    }
+    void run(void (*body)(void*), void* ctx) {
+        body (ctx);
+        group->wait ();
+    }
+};
+#endif
+
+/* -----------------------------------------------------------------------
+ * Workloads
+ * -----------------------------------------------------------------------
+ */
+struct result {
+    double              secs;       /* best of REPS */
+    double              units;      /* work per run, see `workload.unit` */
+    std::vector<double> lat;        /* submit to start, us */
+};
+
+static int scale = 1;
+
+/* empty */
+static std::vector<cmp_task> empty_tasks;
+
+static void empty_fn(cmp_task* t) {}
+
+static void empty_body(void* ctx) {
+    for (size_t i = 0; i < empty_tasks.size (); i++)
+        spawn (&empty_tasks[i]);
+}
+
+static void empty_setup(void) {
+    cmp_task t = { empty_fn, 0, 0 };
+    empty_tasks.assign ((size_t) scale * 100000, t);
+}
+
+static double empty_units(void) {
+    return (double) empty_tasks.size ();
+}
+
+static void empty_lat(std::vector<double>& lat) {
+    for (size_t i = 0; i < empty_tasks.size (); i++)
+        lat.push_back ((empty_tasks[i].t_start - empty_tasks[i].t_submit) / 1e3);
+}
+
+/* fib: continuation passing, the last child to finish completes its parent */
+#define FIB_CUTOFF 10
+
+struct fib_node {
+    cmp_task           t;
+    int                n;
+    std::atomic<long>  sum;
+    std::atomic<int>   pending;
+    fib_node*          parent;
+};
+
+static int      fib_n;
+static fib_node fib_root;
+
+static long fib_serial(int n) {
+    return n < 2 ? n : fib_serial (n - 1) + fib_serial (n - 2);
+}
+
+static double fib_calls(int n) {
+    return n < FIB_CUTOFF ? 1 : 1 + fib_calls (n - 1) + fib_calls (n - 2);
+}
+
+static void fib_finish(fib_node* node) {
+    fib_node* parent;
+    while ((parent = node->parent) != NULL) {
+        parent->sum.fetch_add (node->sum.load (std::memory_order_relaxed),
+                               std::memory_order_relaxed);
+        delete node;
+        if (parent->pending.fetch_sub (1, std::memory_order_acq_rel) != 1)
+            return;
+        node = parent;
+    }
+}
+
+static void fib_fn(cmp_task* t);
+
+static fib_node* fib_child(fib_node* parent, int n) {
+    fib_node* node = new fib_node;
+    node->t.fn = fib_fn;
+    node->n = n;
+    node->sum.store (0, std::memory_order_relaxed);
+    node->parent = parent;
+    return node;
+}
+
+static void fib_fn(cmp_task* t) {
+    fib_node* node = (fib_node*) t;
+    if (node->n < FIB_CUTOFF) {
+        node->sum.store (fib_serial (node->n), std::memory_order_relaxed);
+        fib_finish (node);
+        return;
+    }
+    node->pending.store (2, std::memory_order_relaxed);
+    spawn (&fib_child (node, node->n - 1)->t);
+    spawn (&fib_child (node, node->n - 2)->t);
+}
+
+static void fib_body(void* ctx) {
+    fib_root.t.fn = fib_fn;
+    fib_root.n = fib_n;
+    fib_root.sum.store (0, std::memory_order_relaxed);
+    fib_root.parent = NULL;
+    spawn (&fib_root.t);
+}
+
+static void fib_setup(void) {
+    fib_n = 30;
+    for (int s = scale; s > 1; s >>= 1)
+        fib_n++;
+}
+
+static double fib_units(void) {
+    if (fib_root.sum.load () != fib_serial (fib_n)) {
+        fprintf (stderr, "fib(%d): wrong result %ld\n", fib_n,
+                 fib_root.sum.load ());
+        exit (1);
+    }
+    return fib_calls (fib_n);
+}
+
+/* pfor */
+#define PFOR_GRAIN 16384
+
+struct pfor_chunk {
+    cmp_task t;
+    double*  a;
+    size_t   n;
+};
+
+static std::vector<double>     pfor_data;
+static std::vector<pfor_chunk> pfor_chunks;
+
+static void pfor_fn(cmp_task* t) {
+    pfor_chunk* c = (pfor_chunk*) t;
+    for (size_t i = 0; i < c->n; i++)
+        c->a[i] = c->a[i] * 0.999 + 1.0;
+}
+
+static void pfor_body(void* ctx) {
+    for (size_t i = 0; i < pfor_chunks.size (); i++)
+        spawn (&pfor_chunks[i].t);
+}
+
+static void pfor_setup(void) {
+    size_t n = (size_t) scale << 22, i;
+    pfor_data.assign (n, 1.0);
+    pfor_chunks.clear ();
+    for (i = 0; i < n; i += PFOR_GRAIN) {
+        pfor_chunk c = { { pfor_fn, 0, 0 }, &pfor_data[i],
+                         std::min ((size_t) PFOR_GRAIN, n - i) };
+        pfor_chunks.push_back (c);
+    }
+}
+
+static double pfor_units(void) {
+    return (double) pfor_data.size ();
+}
+
+static void pfor_lat(std::vector<double>& lat) {
+    for (size_t i = 0; i < pfor_chunks.size (); i++)
+        lat.push_back ((pfor_chunks[i].t.t_start - pfor_chunks[i].t.t_submit)
+                       / 1e3);
+}
+
+/* matrix */
+#define TILE 48
+
+struct mat_tile {
+    cmp_task t;
+    int      i, j;
+};
+
+static int                   mat_n;
+static std::vector<double>   mat_a, mat_b, mat_c;
+static std::vector<mat_tile> mat_tiles;
+
+static void mat_fn(cmp_task* t) {
+    mat_tile* tile = (mat_tile*) t;
+    int i, j, k, n = mat_n;
+    for (i = tile->i; i < tile->i + TILE; i++) {
+        double* c = &mat_c[(size_t) i * n];
+        for (j = tile->j; j < tile->j + TILE; j++)
+            c[j] = 0;
+        for (k = 0; k < n; k++) {
+            double a = mat_a[(size_t) i * n + k];
+            const double* b = &mat_b[(size_t) k * n];
+            for (j = tile->j; j < tile->j + TILE; j++)
+                c[j] += a * b[j];
+        }
+    }
+}
+
+static void mat_body(void* ctx) {
+    for (size_t i = 0; i < mat_tiles.size (); i++)
+        spawn (&mat_tiles[i].t);
+}
+
+static void mat_setup(void) {
+    int i, j;
+    mat_n = (int) (384 * sqrt ((double) scale)) / TILE * TILE;
+    mat_a.assign ((size_t) mat_n * mat_n, 1.0);
+    mat_b.assign ((size_t) mat_n * mat_n, 0.5);
+    mat_c.assign ((size_t) mat_n * mat_n, 0.0);
+    mat_tiles.clear ();
+    for (i = 0; i < mat_n; i += TILE)
+        for (j = 0; j < mat_n; j += TILE) {
+            mat_tile tile = { { mat_fn, 0, 0 }, i, j };
+            mat_tiles.push_back (tile);
+        }
+}
+
+static double mat_units(void) {
+    return 2.0 * mat_n * mat_n * mat_n;
+}
+
+static void mat_lat(std::vector<double>& lat) {
+    for (size_t i = 0; i < mat_tiles.size (); i++)
+        lat.push_back ((mat_tiles[i].t.t_start - mat_tiles[i].t.t_submit)
+                       / 1e3);
+}
+
+/* mixed */
+static std::vector<cmp_task> mixed_tasks;
+
+static void short_fn(cmp_task* t) {
+    spin (2000);
+}
+
+static void long_fn(cmp_task* t) {
+    spin (200000);
+}
+
+static void mixed_body(void* ctx) {
+    for (size_t i = 0; i < mixed_tasks.size (); i++)
+        spawn (&mixed_tasks[i]);
+}
+
+static void mixed_setup(void) {
+    size_t i;
+    mixed_tasks.resize ((size_t) scale * 20000);
+    for (i = 0; i < mixed_tasks.size (); i++)
+        mixed_tasks[i].fn = i % 10 == 9 ? long_fn : short_fn;
+}
+
+static double mixed_units(void) {
+    return (double) mixed_tasks.size ();
+}
+
+static void mixed_lat(std::vector<double>& lat) {
+    for (size_t i = 0; i < mixed_tasks.size (); i++)
+        if (mixed_tasks[i].fn == short_fn)
+            lat.push_back ((mixed_tasks[i].t_start - mixed_tasks[i].t_submit)
+                           / 1e3);
+}
+
+struct workload {
+    const char* name;
+    const char* unit;               /* of throughput */
+    double      per_unit;           /* units per throughput unit */
+    void        (*setup)(void);
+    void        (*body)(void* ctx);
+    double      (*units)(void);     /* after a run, may check the result */
+    void        (*lat)(std::vector<double>& lat);   /* NULL: not measured */
+};
+
+static const workload workloads[] = {
+    { "empty",  "Mtask/s", 1e6, empty_setup, empty_body, empty_units, empty_lat },
+    { "fib",    "Mtask/s", 1e6, fib_setup,   fib_body,   fib_units,   NULL },
+    { "pfor",   "Melem/s", 1e6, pfor_setup,  pfor_body,  pfor_units,  pfor_lat },
+    { "matrix", "GFLOP/s", 1e9, mat_setup,   mat_body,   mat_units,   mat_lat },
+    { "mixed",  "Mtask/s", 1e6, mixed_setup, mixed_body, mixed_units, mixed_lat },
+};
+#define NWORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+static result measure(const workload* w) {
+    result r;
+    long long t0;
+    double secs;
+    int rep;
+
+    r.secs = 0;
+    w->setup ();
+    for (rep = 0; rep <= REPS; rep++) {
+        t0 = now ();
+        cur->run (w->body, NULL);
+        secs = (now () - t0) / 1e9;
+        r.units = w->units ();
+        if (rep == 0)
+            continue;
+        if (r.secs == 0 || secs < r.secs)
+            r.secs = secs;
+        if (w->lat != NULL)
+            w->lat (r.lat);
+    }
+    return r;
+}
+
+/* -----------------------------------------------------------------------
+ * Report
+ * -----------------------------------------------------------------------
+ */
+struct row {
+    size_t      wl;
+    std::string backend;
+    int         threads;
+    double      secs, tput, speedup;
+    double      p50, p99, p999;
+};
+
+static double percentile(std::vector<double>& v, double p) {
+    size_t k;
+    if (v.empty ())
+        return -1;
+    k = (size_t) (p * (v.size () - 1));
+    std::nth_element (v.begin (), v.begin () + k, v.end ());
+    return v[k];
+}
+
+static void print_lat(double us) {
+    if (us < 0)
+        fprintf (stderr, " %9s", "-");
+    else
+        fprintf (stderr, " %9.1f", us);
+}
+
+int main(int argc, char** argv) {
+    int maxthreads = argc > 1 ? atoi (argv[1]) : 0;
+    std::vector<backend*> backends;
+    std::vector<int> counts;
+    std::vector<row> rows;
+    size_t b, i, w;
+    int n;
+
+    if (maxthreads <= 0)
+        maxthreads = (int) std::max (1u, std::thread::hardware_concurrency ());
+    if (argc > 2)
+        scale = std::max (1, atoi (argv[2]));
+    for (n = 1; n < maxthreads; n *= 2)
+        counts.push_back (n);
+    counts.push_back (maxthreads);
+
+    backends.push_back (new hthpool_backend);
+    backends.push_back (new thread_backend);
+#ifdef HAVE_OPENMP
+    backends.push_back (new openmp_backend);
+#endif
+#ifdef HAVE_TBB
+    backends.push_back (new tbb_backend);
+#endif
+
+    for (b = 0; b < backends.size (); b++) {
+        cur = backends[b];
+        for (i = 0; i < counts.size (); i++) {
+            cur->start (counts[i]);
+            for (w = 0; w < NWORKLOADS; w++) {
+                result r = measure (&workloads[w]);
+                row x;
+                x.wl = w;
+                x.backend = cur->name;
+                x.threads = counts[i];
+                x.secs = r.secs;
+                x.tput = r.units / r.secs / workloads[w].per_unit;
+                x.speedup = i == 0 ? 1 : x.tput / rows[rows.size ()
+                                                       - i * NWORKLOADS].tput;
+                x.p50 = percentile (r.lat, 0.5);
+                x.p99 = percentile (r.lat, 0.99);
+                x.p999 = percentile (r.lat, 0.999);
+                rows.push_back (x);
+            }
+            cur->stop ();
+        }
+    }
+
+    fprintf (stderr, "max threads %d, scale %d; latency is submit to start\n",
+             maxthreads, scale);
+    for (w = 0; w < NWORKLOADS; w++) {
+        fprintf (stderr, "\n%s\n%-12s %7s %10s %12s %8s %9s %9s %9s\n",
+                 workloads[w].name, "backend", "threads", "time(ms)",
+                 workloads[w].unit, "speedup", "p50(us)", "p99(us)",
+                 "p99.9(us)");
+        for (i = 0; i < rows.size (); i++) {
+            const row& x = rows[i];
+            if (x.wl != w)
+                continue;
+            fprintf (stderr, "%-12s %7d %10.2f %12.3f %8.2f", x.backend.c_str (),
+                     x.threads, x.secs * 1e3, x.tput, x.speedup);
+            print_lat (x.p50);
+            print_lat (x.p99);
+            print_lat (x.p999);
+            fprintf (stderr, "\n");
+        }
+    }
+
+    for (b = 0; b < backends.size (); b++)
+        delete backends[b];
+    return 0;
+}
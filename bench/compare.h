@@ -0,0 +1,28 @@
+#ifndef COMPARE_H_
+#define COMPARE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A benchmark task: `fn` is the work, the timestamps (ns) are filled in by
+ * the driver around it.
+ */
+typedef struct cmp_task {
+    void      (*fn)(struct cmp_task* t);
+    long long t_submit, t_start;
+} cmp_task;
+
+/* runs one task on a worker, provided by the driver */
+typedef void (*cmp_run)(cmp_task* t);
+
+/* hthpool backend, see `compare_hthpool.c` */
+extern void cmp_hthpool_start (int threads, cmp_run run);
+extern void cmp_hthpool_spawn (cmp_task* t);
+extern void cmp_hthpool_stop (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,50 @@
+/* hthpool side of `compare`: hthpool.h is C only, so the C++ driver reaches
+ * the pool through these three calls, see `compare.h`.
+ */
+#if defined(__GNUC__)
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include "../hthpool.h"
+#include "compare.h"
+
+static hthpool pool;
+static cmp_run run_task;
+
+static void* trampoline(void* arg) {
+    run_task ((cmp_task*) arg);
+    return NULL;
+}
+
+static void* stop(void* arg) {
+    hthpool_hard_stop (pool);
+    return NULL;
+}
+
+/* The ring is sized so that fib never finds it full: a worker blocked on a
+ * full ring cannot drain it.
+ */
+void cmp_hthpool_start(int threads, cmp_run run) {
+    hthpool_attr attr;
+    run_task = run;
+    hthpoolattr_init (&attr);
+    hthpoolattr_setworklist (&attr, WL_FIFO, 1 << 20);
+    pool = hthpool_init_attr (threads, &attr);
+    if (pool == NULL) {
+        perror ("hthpool_init_attr");
+        exit (1);
+    }
+}
+
+void cmp_hthpool_spawn(cmp_task* t) {
+    work_item item = { trampoline, t };
+    hthpool_submit (pool, item);
+}
+
+void cmp_hthpool_stop(void) {
+    work_item halt = { stop, NULL };
+    hthpool_submit (pool, halt);
+    hthpool_wait (pool);
+    hthpool_destroy (pool);
+}
@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "channel.h"
+#include "fence.h"
+
+/* -----------------------------------------------------------------------
+ * SPSC channel.
+ * Indices grow without bound and are masked into `slots`, so full is
+ * tail - head == capacity and empty is tail == head.
+ * For a summary of declarations, see `channel.h`
+ * -----------------------------------------------------------------------
+ */
+int channel_init(channel_t* ch, size_t capacity) {
+    size_t cap = 1;
+    while (cap < capacity)
+        cap <<= 1;
+    ch->slots = (void**) malloc (cap * sizeof(void*));
+    if (ch->slots == NULL)
+        return STAT_ALLOC;
+    ch->capacity = cap;
+    ch->closed = 0;
+    ch->tail = ch->head_cache = 0;
+    ch->head = ch->tail_cache = 0;
+    ch->sleepers = 0;
+    if (pthread_mutex_init (&ch->lock, NULL)) {
+        free (ch->slots);
+        return STAT_SYNC;
+    }
+    if (pthread_cond_init (&ch->cond, NULL)) {
+        pthread_mutex_destroy (&ch->lock);
+        free (ch->slots);
+        return STAT_SYNC;
+    }
+    return STAT_OK;
+}
+
+void channel_destroy(channel_t* ch) {
+    pthread_mutex_destroy (&ch->lock);
+    pthread_cond_destroy (&ch->cond);
+    free (ch->slots);
+    ch->slots = NULL;
+}
+
+/* wake the other side if it announced that it sleeps */
+static void channel_wake(channel_t* ch) {
+    if (FENCED_LOAD (&ch->sleepers)) {
+        pthread_mutex_lock (&ch->lock);
+        pthread_cond_broadcast (&ch->cond);
+        pthread_mutex_unlock (&ch->lock);
+    }
+}
+
+int channel_trysend(channel_t* ch, void* msg) {
+    size_t tail = ch->tail;
+    if (__atomic_load_n (&ch->closed, __ATOMIC_RELAXED))
+        return STAT_TERM;
+    if (tail - ch->head_cache == ch->capacity) {
+        ch->head_cache = __atomic_load_n (&ch->head, __ATOMIC_ACQUIRE);
+        if (tail - ch->head_cache == ch->capacity)
+            return STAT_FULL;
+    }
+    ch->slots[tail & (ch->capacity - 1)] = msg;
+    __atomic_store_n (&ch->tail, tail + 1, __ATOMIC_RELEASE);
+    channel_wake (ch);
+    return STAT_OK;
+}
+
+int channel_tryrecv(channel_t* ch, void** msg) {
+    size_t head = ch->head;
+    if (head == ch->tail_cache) {
+        ch->tail_cache = __atomic_load_n (&ch->tail, __ATOMIC_ACQUIRE);
+        if (head == ch->tail_cache)
+            return __atomic_load_n (&ch->closed, __ATOMIC_ACQUIRE) &&
+                   head == __atomic_load_n (&ch->tail, __ATOMIC_ACQUIRE)
+                   ? STAT_TERM : STAT_EMPTY;
+    }
+    *msg = ch->slots[head & (ch->capacity - 1)];
+    __atomic_store_n (&ch->head, head + 1, __ATOMIC_RELEASE);
+    channel_wake (ch);
+    return STAT_OK;
+}
+
+int channel_send(channel_t* ch, void* msg) {
+    int ret;
+    while ((ret = channel_trysend (ch, msg)) == STAT_FULL) {
+        pthread_mutex_lock (&ch->lock);
+        __atomic_add_fetch (&ch->sleepers, 1, __ATOMIC_SEQ_CST);
+        while (ch->tail - __atomic_load_n (&ch->head, __ATOMIC_SEQ_CST) ==
+               ch->capacity && !__atomic_load_n (&ch->closed, __ATOMIC_SEQ_CST))
+            pthread_cond_wait (&ch->cond, &ch->lock);
+        __atomic_sub_fetch (&ch->sleepers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock (&ch->lock);
+    }
+    return ret;
+}
+
+int channel_recv(channel_t* ch, void** msg) {
+    int ret;
+    while ((ret = channel_tryrecv (ch, msg)) == STAT_EMPTY) {
+        pthread_mutex_lock (&ch->lock);
+        __atomic_add_fetch (&ch->sleepers, 1, __ATOMIC_SEQ_CST);
+        while (ch->head == __atomic_load_n (&ch->tail, __ATOMIC_SEQ_CST) &&
+               !__atomic_load_n (&ch->closed, __ATOMIC_SEQ_CST))
+            pthread_cond_wait (&ch->cond, &ch->lock);
+        __atomic_sub_fetch (&ch->sleepers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock (&ch->lock);
+    }
+    return ret;
+}
+
+void channel_close(channel_t* ch) {
+    pthread_mutex_lock (&ch->lock);
+    __atomic_store_n (&ch->closed, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast (&ch->cond);
+    pthread_mutex_unlock (&ch->lock);
+}
@@ -0,0 +1,68 @@
+#ifndef CHANNEL_H_
+#define CHANNEL_H_
+#include <stddef.h>
+#include <pthread.h>
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHANNEL_CACHELINE 64
+
+/* Bounded single-producer single-consumer channel of pointers, for
+ * handing work from one pipeline stage to the next. The sender only writes
+ * `tail` and the receiver only writes `head`; each keeps a cached copy of
+ * the other index and reloads it (acquire) only when the cache says full or
+ * empty. The two sides live on separate cache lines. Sleeping uses mutex
+ * `lock` and is announced in `sleepers`, so neither side locks while the
+ * other is awake.
+ */
+typedef struct channel {
+    void**          slots;
+    size_t          capacity;               /* a power of two */
+    int             closed;
+    char            pad0[CHANNEL_CACHELINE];
+    size_t          tail, head_cache;       /* sender */
+    char            pad1[CHANNEL_CACHELINE];
+    size_t          head, tail_cache;       /* receiver */
+    char            pad2[CHANNEL_CACHELINE];
+    int             sleepers;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} channel_t;
+
+/* init a channel holding at least `capacity` messages, rounded up to a
+ * power of two. return STAT_OK, STAT_ALLOC or STAT_SYNC
+ */
+extern int  channel_init (channel_t* ch, size_t capacity);
+
+/* release the channel, no thread may be using it */
+extern void channel_destroy (channel_t* ch);
+
+/* Sender only: send `msg`, waiting while the channel is full.
+ * return STAT_OK, or STAT_TERM if the channel is closed
+ */
+extern int  channel_send (channel_t* ch, void* msg);
+
+/* Sender only: STAT_OK, STAT_FULL or STAT_TERM, never waits */
+extern int  channel_trysend (channel_t* ch, void* msg);
+
+/* Receiver only: receive into *msg, waiting while the channel is empty.
+ * return STAT_OK, or STAT_TERM once the channel is closed and drained
+ */
+extern int  channel_recv (channel_t* ch, void** msg);
+
+/* Receiver only: STAT_OK, STAT_EMPTY or STAT_TERM, never waits */
+extern int  channel_tryrecv (channel_t* ch, void** msg);
+
+/* Either side: no more messages will be sent, wake the other side.
+ * Messages already sent can still be received.
+ */
+extern void channel_close (channel_t* ch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -9,6 +9,22 @@ extern "C" {
 #define STAT_SYNC -1
 #define STAT_ALLOC -2
 #define STAT_TERM -3
+#define STAT_EMPTY -4
+#define STAT_FULL -5
+#define STAT_AGAIN -6
+
+/* worklist scheduling policies */
+#define WL_FIFO 0       /* bounded ring, strict FIFO */
+#define WL_OBIM 1       /* ordered by integer metric, approximate priority */
+#define WL_CHUNKED 2    /* per-thread chunked FIFO, approximate FIFO */
+#define WL_MULTIQUEUE 3 /* locked heaps, pop-min of two random choices */
+#define WL_EDF 4        /* earliest deadline first */
+
+/* WL_FIFO ring storage flags */
+#define WL_MEM_HUGETLB  0x1 /* explicit huge pages, falls back to 4K pages */
+#define WL_MEM_THP      0x2 /* ask for transparent huge pages */
+#define WL_MEM_PREFAULT 0x4 /* fault every page in at init */
+#define WL_MEM_LOCK     0x8 /* mlock, the ring is never swapped out */
 
 /* NOTE: In both ANSI-C and C99, it's undefined behavior to include
  * a function type in an aggregate type. 
@@ -0,0 +1,57 @@
+#ifndef FENCE_H_
+#define FENCE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Memory fences of the library. Internal to the library.
+ * ThreadSanitizer does not model `atomic_thread_fence` (gcc warns with
+ * -Wtsan), so under it each fence is replaced by read-modify-writes that
+ * order the same way; other builds keep the cheaper fences.
+ */
+#if defined(__SANITIZE_THREAD__)
+# define FENCE_TSAN 1
+#elif defined(__has_feature)
+# if __has_feature(thread_sanitizer)
+#  define FENCE_TSAN 1
+# endif
+#endif
+
+/* Reading half of a store-then-load handshake: everything stored before
+ * is visible to a thread that updates `*p` (seq_cst) before it loads,
+ * or this load sees that update. E.g. publish an item, then look for
+ * sleepers registered in `*p`.
+ */
+#ifdef FENCE_TSAN
+# define FENCED_LOAD(p)     __atomic_fetch_add ((p), 0, __ATOMIC_SEQ_CST)
+#else
+# define FENCED_LOAD(p)     (__atomic_thread_fence (__ATOMIC_SEQ_CST),     \
+                             __atomic_load_n ((p), __ATOMIC_SEQ_CST))
+#endif
+
+/* Sequence lock over relaxed atomic fields, guarded by a counter `*seq`
+ * that is 0 while the writer changes them.
+ * SEQ_WRITE_BEGIN: set `*seq` to 0 before the fields are stored.
+ * SEQ_READ_RETRY: after the fields were loaded, 1 if `*seq` is no longer
+ * `seen`, the value loaded (acquire) before them.
+ */
+#ifdef FENCE_TSAN
+# define SEQ_WRITE_BEGIN(seq)                                           \
+    ((void) __atomic_exchange_n ((seq), 0, __ATOMIC_ACQ_REL))
+# define SEQ_READ_RETRY(seq, seen)                                      \
+    (__atomic_fetch_add ((seq), 0, __ATOMIC_ACQ_REL) != (seen))
+#else
+# define SEQ_WRITE_BEGIN(seq)                                           \
+    (__atomic_store_n ((seq), 0, __ATOMIC_RELAXED),                     \
+     __atomic_thread_fence (__ATOMIC_RELEASE))
+# define SEQ_READ_RETRY(seq, seen)                                      \
+    (__atomic_thread_fence (__ATOMIC_ACQUIRE),                          \
+     __atomic_load_n ((seq), __ATOMIC_RELAXED) != (seen))
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef HEAP_H_
+#define HEAP_H_
+#include <stdlib.h>
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Binary min-heap of work items keyed by a 64-bit integer.
+ * Internal to the library, not thread-safe: callers hold their own lock.
+ */
+struct heap_node {
+    long long key;
+    work_item item;
+};
+
+struct heap {
+    struct heap_node* nodes;
+    size_t size, capacity;
+};
+
+static inline void heap_init(struct heap* h) {
+    h->nodes = NULL;
+    h->size = h->capacity = 0;
+}
+
+static inline void heap_destroy(struct heap* h) {
+    free (h->nodes);
+    heap_init (h);
+}
+
+/* give the node array back once the heap is empty, it grows again on push */
+static inline void heap_trim(struct heap* h) {
+    if (h->size == 0)
+        heap_destroy (h);
+}
+
+/* return: STAT_OK, or STAT_ALLOC if the heap cannot grow */
+static inline int heap_push(struct heap* h, long long key, work_item item) {
+    struct heap_node* nodes;
+    size_t i, parent;
+    if (h->size == h->capacity) {
+        nodes = (struct heap_node*) realloc (h->nodes,
+                (h->capacity ? 2 * h->capacity : 64) * sizeof(*nodes));
+        if (nodes == NULL)
+            return STAT_ALLOC;
+        h->nodes = nodes;
+        h->capacity = h->capacity ? 2 * h->capacity : 64;
+    }
+    for (i = h->size++; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (h->nodes[parent].key <= key)
+            break;
+        h->nodes[i] = h->nodes[parent];
+    }
+    h->nodes[i].key = key;
+    h->nodes[i].item = item;
+    return STAT_OK;
+}
+
+/* remove the minimum into *min, the heap must not be empty */
+static inline void heap_pop(struct heap* h, struct heap_node* min) {
+    struct heap_node last;
+    size_t i = 0, child;
+    *min = h->nodes[0];
+    last = h->nodes[--h->size];
+    while ((child = 2 * i + 1) < h->size) {
+        if (child + 1 < h->size && h->nodes[child + 1].key < h->nodes[child].key)
+            child++;
+        if (last.key <= h->nodes[child].key)
+            break;
+        h->nodes[i] = h->nodes[child];
+        i = child;
+    }
+    if (h->size > 0)
+        h->nodes[i] = last;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
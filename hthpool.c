@@ -12,9 +12,24 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <errno.h>
 #include <sys/types.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #include "common.h"
+#include "hthpool.h"
 #include "worklist.h"
+#include "tenant.h"
+#include "timer.h"
+#include "fence.h"
+#include "ratelimit.h"
+#include "ring.h"
+#include "replay.h"
+#include "lockstat.h"
+#include "topo.h"
 #define HTHPOOL_DEBUG
 
 #ifdef HTHPOOL_DEBUG
@@ -45,28 +60,478 @@ typedef union {
  *  - dynamicly allocate new space for worklist when it's (almost) full
  */
 
-#define DEFAULT_SIZE 65533
-struct status {
-    int stop;
-    int adding;
-    int taking;
-};
-typedef struct status status_t;
 typedef struct worklist _hthp_worklist;
 
 #define WL_SIZE 4094
+
+/* Bulk-synchronous state, lives on the stack of `hthpool_bsp_run`.
+ * `wl[cur]` is the frontier of the running round, tasks push into
+ * `wl[!cur]`. Rounds end at a sense-reversing barrier: the last worker to
+ * arrive swaps the frontiers and runs the step hook, then flips `sense`.
+ */
+#define BSP_SPIN 1024
+struct hthpool_bsp {
+    _hthp_worklist    wl[2];
+    int               cur;
+    int               nthreads, count, sense;
+    int               done, exited;
+    size_t            round;
+    hthpool_bsp_step  step;
+    pthread_mutex_t   mutex_done;
+    pthread_cond_t    cond_done;
+};
+
+/* Task class with a concurrency limit. Items wait in `queue`, the pool's
+ * worklist holds one dispatch item per queued item. A dispatch finding the
+ * class at its limit parks (`parked`) instead of blocking its worker; every
+ * finished item of the class resubmits one parked dispatch.
+ */
+struct hthpool_class {
+    struct hthpool*       pool;
+    pthread_mutex_t       lock;
+    lockstat              ls;
+    struct ring           queue;
+    int                   limit, running, parked;
+    struct hthpool_class* next;
+};
+
+/* Logical pool, a tenant of the shared pool with its own stop/wait.
+ * `pending` counts items submitted and not finished yet.
+ */
+struct hthpool_sub {
+    struct hthpool*     pool;
+    tenant_t*           tenant;
+    pthread_mutex_t     lock;
+    lockstat            ls;
+    pthread_cond_t      cond_idle;
+    long                pending;
+    int                 stopped;
+    struct hthpool_sub* next;
+};
+
+/* Submission buffer of one producer thread. `lock` is only contended
+ * when the timer thread flushes an expired buffer, so taking it stays on
+ * the uncontended fast path; `armed` is set while
+ * such a flush is scheduled. A destroyed producer with a flush pending is
+ * `closed` and freed by that flush.
+ */
+struct hthpool_producer {
+    struct hthpool*      pool;
+    pthread_mutex_t      lock;
+    lockstat             ls;
+    work_item*           items;
+    size_t               n, batch;
+    long long            delay;
+    int                  armed, closed;
+    struct hthpool_producer *prev, *next;
+};
+
+/* Retry state of a task submitted with `hthpool_submit_retry`. Jobs are
+ * linked in the pool until they succeed or give up, so that jobs dropped
+ * from the worklist or the timer by `hthpool_continue` are freed.
+ */
+struct hthpool_retry {
+    struct hthpool*       pool;
+    work_item             item;
+    hthpool_retryattr     attr;
+    int                   attempts;
+    long long             backoff;
+    struct hthpool_retry  *prev, *next;
+};
+
+/* A task submitted with an id while recording, see `traced_run` */
+struct hthpool_traced {
+    struct hthpool*   pool;
+    work_item         item;
+    unsigned long     task;
+};
+
+/* Replay in progress. `next` is the sequence number of the next dequeue
+ * of the trace; the worker it belongs to takes its task once submitted
+ * and moves `next` on before running it. Workers leave only after all
+ * have `entered`, so none can take a second replay task.
+ */
+struct hthpool_replay {
+    const trace*      tr;
+    replay_table      table;
+    size_t            next;
+    int               nthreads, entered, exited;
+    pthread_mutex_t   mutex_done;
+    pthread_cond_t    cond_done;
+};
+
+/* Per-worker state. `start` doubles as a sequence number for `item`:
+ * the worker sets it to 0, writes `item`, then stores the start time, so a
+ * reader seeing the same nonzero `start` before and after reading `item`
+ * got a consistent snapshot.
+ */
+struct hthpool_worker {
+    struct hthpool*   pool;
+    int               id;
+    long long         start;    /* ns the current task started, 0 if idle */
+    work_item         item;
+    void*             data[HTHPOOL_WORKER_SLOTS];
+};
+
+/* Mailbox of a worker, see `hthpool_submit_to`. `bound` items run on
+ * this worker only; `hinted` ones also have a steal item in the worklist
+ * and run on whichever worker gets to them first. `n` counts both, so
+ * an empty mailbox is checked without the lock. `asleep` is set while the
+ * worker sleeps in the worklist; mail then kicks it awake. Bound items
+ * over the pool's rate limit wait in `deferred`, see `rate_admit`.
+ */
+#define MAIL_CACHELINE 64
+struct hthpool_mailbox {
+    struct hthpool*   pool;
+    int               id;
+    pthread_mutex_t   lock;
+    lockstat          ls;
+    struct ring       bound, hinted, deferred;
+    size_t            n;
+    int               asleep;
+} __attribute__ ((aligned (MAIL_CACHELINE)));
+
+/* where `mail_take` found an item */
+#define MAIL_NONE       0
+#define MAIL_BOUND      1
+#define MAIL_HINTED     2
+
+/* Watchdog thread, see `hthpool_watchdog`. `sem` wakes it up early for
+ * `hthpool_dump_async` and on destroy.
+ */
+struct hthpool_watchdog {
+    pthread_t           thread;
+    sem_t               sem;
+    long long           threshold;
+    hthpool_watchdog_cb cb;
+    void*               ctx;
+    int                 started, close, dump;
+};
+
 struct hthpool {
     _hthp_worklist* wl;
     pthread_t* pool;
+    struct hthpool_worker* workers;
+    struct hthpool_mailbox* mail;
+    size_t hints_stolen;
     int thread_num;
+    /* lazy pools start workers on demand: `nstarted` of `thread_num`
+     * exist, `idle` of them wait for work or are about to
+     */
+    int lazy, nstarted, idle, barrier_count;
+    /* idle ladder, see `pool_take`; `deep` and `idle_trims` under
+     * `mutex_stop_continue`
+     */
+    long long idle_spin, idle_deep;
+    int deep;
+    size_t idle_trims;
+    /* `hthpoolattr_settopology`: CPU, L3 group and package of each worker,
+     * `topo.n` is 0 when off
+     */
+    topo topo;
     int stopped_threads, blocked_threads;
     int stop, close;
     work_item empty_event, full_event;
     pthread_mutex_t      mutex_stop_continue;
     pthread_cond_t       cond_all_stopped, cond_allow_go;
     pthread_barrier_t    barrier_continue;
+    struct hthpool_bsp*  bsp;
+    tenant_sched         tenants;
+    timerq               timers;
+    pthread_mutex_t      mutex_rate;
+    struct ratelimit     rate;
+    struct ring          deferred;  /* over the limit, in token order */
+    int                  rate_limited;
+    struct hthpool_class* classes;
+    struct hthpool_watchdog watchdog;
+    pthread_mutex_t      mutex_retry;
+    struct hthpool_retry* retries;
+    /* queue watermark: `wm_above` is set by the worklist, `wm_delivered`
+     * is owned by the timer thread
+     */
+    hthpool_watermark_cb wm_cb;
+    void*                wm_ctx;
+    int                  wm_above, wm_delivered;
+    long                 wm_depth;
+    struct hthpool_sub*  subs;
+    pthread_mutex_t      mutex_producers;
+    struct hthpool_producer* producers;
+    size_t               producer_dropped;
+    hthpool_worker_cb    on_worker_start, on_worker_exit;
+    void*                worker_ctx;
+    /* lock contention, see `lockstat.h`. Counters of destroyed producers
+     * are added to `ls_producer`, under `mutex_producers`
+     */
+    lockstat             ls_stop_continue, ls_rate, ls_retry;
+    lockstat             ls_producers, ls_producer;
+    /* dequeue trace being recorded, replay being run */
+    trace*               recording;
+    struct hthpool_replay* replay;
+    /* fork handling, pools with a mode are linked in `fork_pools` */
+    int                  fork_mode;
+    struct hthpool*      fork_next;
 };
 
+static int rate_admit(struct hthpool* pool_state, work_item item,
+                      struct hthpool_mailbox* mb);
+static void* rate_run_bound(void* arg);
+static void* daemon_run(void* arg);
+
+/* Start one more worker, `mutex_stop_continue` held */
+static void pool_spawn(struct hthpool* pool_state) {
+    struct hthpool_worker* w = pool_state->workers + pool_state->nstarted;
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+    w->pool = pool_state;
+    w->id = pool_state->nstarted;
+    /* the empty event of a lazy pool waits for the workers that exist */
+    if (pool_state->lazy)
+        worklist_setconcurrency (pool_state->wl, w->id + 1);
+    if (pthread_attr_init (&attr)) {
+        perror ("Create threads");
+        exit (EXIT_FAILURE);
+    }
+    if (pool_state->topo.n) {
+        CPU_ZERO (&cpus);
+        CPU_SET (pool_state->topo.cpu[w->id], &cpus);
+        pthread_attr_setaffinity_np (&attr, sizeof(cpu_set_t), &cpus);
+    }
+    if (pthread_create (pool_state->pool + w->id, &attr, daemon_run, w)) {
+        perror ("Create threads");
+        exit (EXIT_FAILURE);
+    }
+    pthread_attr_destroy (&attr);
+    __atomic_store_n (&pool_state->nstarted, pool_state->nstarted + 1,
+                      __ATOMIC_RELAXED);
+    __atomic_add_fetch (&pool_state->idle, 1, __ATOMIC_RELAXED);
+}
+
+/* `hthpoolattr_settopology`: give worker `i` the `i % n`-th usable CPU in
+ * cache order, so neighbouring workers share an L3. Without usable
+ * topology (no affinity mask) the pool runs unpinned.
+ */
+static void pool_topology(struct hthpool* pool_state, int num) {
+    topo all;
+    cpu_set_t allowed;
+    int i, ret;
+    if (num == 0 || sched_getaffinity (0, sizeof(cpu_set_t), &allowed))
+        return;
+    ret = topo_discover (&all, TOPO_SYSFS, &allowed);
+    if (ret == STAT_EMPTY)
+        return;
+    pool_state->topo.cpu = (int*) malloc (num * sizeof(int));
+    pool_state->topo.group = (int*) malloc (num * sizeof(int));
+    pool_state->topo.package = (int*) malloc (num * sizeof(int));
+    if (ret != STAT_OK || pool_state->topo.cpu == NULL ||
+        pool_state->topo.group == NULL || pool_state->topo.package == NULL)
+        exit (EXIT_FAILURE);
+    for (i = 0; i < num; i++) {
+        pool_state->topo.cpu[i] = all.cpu[i % all.n];
+        pool_state->topo.group[i] = all.group[i % all.n];
+        pool_state->topo.package[i] = all.package[i % all.n];
+    }
+    pool_state->topo.n = num;
+    pool_state->topo.ngroups = all.ngroups;
+    topo_free (&all);
+}
+
+/* Lazy pools: work was just submitted, start a worker if none is idle */
+static void pool_demand(struct hthpool* pool_state) {
+    if (!pool_state->lazy ||
+        __atomic_load_n (&pool_state->idle, __ATOMIC_RELAXED) > 0 ||
+        __atomic_load_n (&pool_state->nstarted, __ATOMIC_RELAXED) ==
+        pool_state->thread_num)
+        return;
+    LS_MUTEX_LOCK (&pool_state->mutex_stop_continue,
+                   &pool_state->ls_stop_continue);
+    if (pool_state->nstarted < pool_state->thread_num && !pool_state->close &&
+        __atomic_load_n (&pool_state->idle, __ATOMIC_RELAXED) == 0)
+        pool_spawn (pool_state);
+    pthread_mutex_unlock (&pool_state->mutex_stop_continue);
+}
+
+/* worker state of the calling thread, NULL outside the pool */
+static __thread struct hthpool_worker* self_worker;
+
+/* outcome of the running task, see `hthpool_task_fail` */
+static __thread struct {
+    int   failed;
+    int   status;
+    void* error;
+} task_result;
+
+/* Run a task, recording it as the current task of the calling worker.
+ * Dispatch items call it again for the task they pick, so the watchdog
+ * sees that task rather than the dispatcher.
+ */
+static void run_item(work_item item) {
+    struct hthpool_worker* w = self_worker;
+    if (w == NULL) {
+        item.run (item.arg);
+        return;
+    }
+    SEQ_WRITE_BEGIN (&w->start);
+    __atomic_store_n (&w->item.run, item.run, __ATOMIC_RELAXED);
+    __atomic_store_n (&w->item.arg, item.arg, __ATOMIC_RELAXED);
+    __atomic_store_n (&w->start, timerq_now (), __ATOMIC_RELEASE);
+    item.run (item.arg);
+    __atomic_store_n (&w->start, 0, __ATOMIC_RELEASE);
+}
+
+/* Snapshot the current task of `w`
+ * return: its start time, or 0 if the worker is idle
+ */
+static long long worker_current(struct hthpool_worker* w, work_item* item) {
+    long long start = __atomic_load_n (&w->start, __ATOMIC_ACQUIRE);
+    if (start == 0)
+        return 0;
+    item->run = __atomic_load_n (&w->item.run, __ATOMIC_RELAXED);
+    item->arg = __atomic_load_n (&w->item.arg, __ATOMIC_RELAXED);
+    if (SEQ_READ_RETRY (&w->start, start))
+        return 0;
+    return start;
+}
+
+/* Give back what an idle pool does not need */
+static void pool_trim(struct hthpool* pool_state) {
+    worklist_trim (pool_state->wl);
+#ifdef __GLIBC__
+    malloc_trim (0);
+#endif
+}
+
+/* Take the oldest item of a mailbox, bound ones first unless `hinted`
+ * return: MAIL_BOUND or MAIL_HINTED if an item was taken, else MAIL_NONE
+ */
+static int mail_take(struct hthpool_mailbox* mb, work_item* item,
+                     int hinted) {
+    int found;
+    if (__atomic_load_n (&mb->n, __ATOMIC_SEQ_CST) == 0)
+        return MAIL_NONE;
+    LS_MUTEX_LOCK (&mb->lock, &mb->ls);
+    found = !hinted && ring_pop (&mb->bound, item) ? MAIL_BOUND
+          : ring_pop (&mb->hinted, item)           ? MAIL_HINTED
+          : MAIL_NONE;
+    if (found)
+        __atomic_store_n (&mb->n, mb->n - 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock (&mb->lock);
+    return found;
+}
+
+/* Steal item of a hinted item, runs the oldest hinted item of the mailbox
+ * unless its worker took them all already
+ */
+static void* mail_steal(void* arg) {
+    struct hthpool_mailbox* mb = (struct hthpool_mailbox*) arg;
+    work_item item;
+    if (!mail_take (mb, &item, 1))
+        return NULL;
+    if (self_worker == NULL || self_worker->id != mb->id)
+        __atomic_add_fetch (&mb->pool->hints_stolen, 1, __ATOMIC_RELAXED);
+    if (rate_admit (mb->pool, item, NULL))
+        run_item (item);
+    return NULL;
+}
+
+/* Poll the mailbox and the worklist for `idle_spin`, `*from` tells
+ * which mailbox ring the item came from (MAIL_NONE: the worklist)
+ * return: STAT_OK, STAT_TERM once stopped or STAT_EMPTY
+ */
+static int pool_spin(struct hthpool* pool_state, struct hthpool_mailbox* mb,
+                     work_item* item, int* from) {
+    long long until = timerq_now () + pool_state->idle_spin;
+    do {
+        if ((*from = mail_take (mb, item, 0)) ||
+            (!worklist_empty (pool_state->wl) &&
+             worklist_trytake (pool_state->wl, item) == STAT_OK))
+            return STAT_OK;
+        if (__atomic_load_n (&pool_state->stop, __ATOMIC_ACQUIRE))
+            return STAT_TERM;
+    } while (timerq_now () < until);
+    return STAT_EMPTY;
+}
+
+/* Next item of a worker, its mailbox before the worklist. See
+ * `hthpoolattr_setidle`: poll for `idle_spin`, then sleep, timed if
+ * `idle_deep` is set; the last worker to time out trims and the others
+ * sleep on untimed. A stop ends any stage with the empty item, mail
+ * for a sleeping worker kicks it and it starts over. `*bound` is set if
+ * the item is bound to this worker.
+ */
+static work_item pool_take(struct hthpool_worker* self, int* bound) {
+    struct hthpool* pool_state = self->pool;
+    struct hthpool_mailbox* mb = pool_state->mail + self->id;
+    struct timespec ts, *abstime;
+    work_item item;
+    long long until;
+    size_t kicks;
+    int ret, trim, from = MAIL_NONE, deep = 0;
+    for (;;) {
+        if (pool_state->idle_spin > 0 && !deep &&
+            (ret = pool_spin (pool_state, mb, &item, &from)) != STAT_EMPTY)
+            break;
+        abstime = NULL;
+        if (pool_state->idle_deep > 0 && !deep) {
+            until = timerq_now () + pool_state->idle_deep;
+            ts.tv_sec  = until / 1000000000LL;
+            ts.tv_nsec = until % 1000000000LL;
+            abstime = &ts;
+        }
+        /* pairs with the submitter's store of `n` in `mail_put` */
+        kicks = worklist_kicks (pool_state->wl);
+        __atomic_store_n (&mb->asleep, 1, __ATOMIC_SEQ_CST);
+        ret = (from = mail_take (mb, &item, 0)) ? STAT_OK
+            : worklist_take_intr (pool_state->wl, &item, abstime, kicks);
+        __atomic_store_n (&mb->asleep, 0, __ATOMIC_RELAXED);
+        if (ret == STAT_EMPTY) {
+            deep = 1;
+            LS_MUTEX_LOCK (&pool_state->mutex_stop_continue,
+                           &pool_state->ls_stop_continue);
+            trim = ++pool_state->deep == pool_state->nstarted;
+            if (trim)
+                pool_state->idle_trims++;
+            pthread_mutex_unlock (&pool_state->mutex_stop_continue);
+            if (trim)
+                pool_trim (pool_state);
+        } else if (ret != STAT_AGAIN) {
+            break;
+        }
+    }
+    if (deep) {
+        LS_MUTEX_LOCK (&pool_state->mutex_stop_continue,
+                       &pool_state->ls_stop_continue);
+        pool_state->deep--;
+        pthread_mutex_unlock (&pool_state->mutex_stop_continue);
+    }
+    *bound = ret == STAT_OK && from == MAIL_BOUND;
+    return ret == STAT_OK ? item : WL_EMPTYITEM;
+}
+
+/* Queue `item` in the mailbox of `worker`, which exists, and wake it if it
+ * sleeps; a hinted item also gets a steal item if it does not
+ */
+static int mail_put(struct hthpool* pool_state, int worker, work_item item,
+                    int hinted) {
+    struct hthpool_mailbox* mb = pool_state->mail + worker;
+    work_item steal = { (task) mail_steal, mb };
+    int ret;
+    LS_MUTEX_LOCK (&mb->lock, &mb->ls);
+    ret = ring_push (hinted ? &mb->hinted : &mb->bound, item);
+    if (ret == STAT_OK)
+        __atomic_store_n (&mb->n, mb->n + 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock (&mb->lock);
+    if (ret != STAT_OK)
+        return ret;
+    /* the worker stores `asleep` before its last look at `n` */
+    if (__atomic_load_n (&mb->asleep, __ATOMIC_SEQ_CST)) {
+        worklist_kick (pool_state->wl);
+    } else if (hinted) {
+        ret = worklist_add (pool_state->wl, steal);
+        pool_demand (pool_state);
+    }
+    return ret;
+}
+
 /* This is the wrapper function for threads to acquire new item
  * from the work list, execute the task and then wait for new ones.
  * This function is passed into pthread_create during thread pool initialization
@@ -78,21 +543,29 @@ static void* daemon_run(void* arg) {
     tid.pthread_id = pthread_self ();
 #endif
     DBG_PRINT (("Thread 0x%lx starts\n", _HTHPOOL_TID (tid)));
-    struct hthpool* pool_state = (struct hthpool*) arg;
+    struct hthpool_worker* self = (struct hthpool_worker*) arg;
+    struct hthpool* pool_state = self->pool;
+    int bound;
+    self_worker = self;
+    if (pool_state->topo.n)
+        worklist_bindslot (self->id);
+    if (pool_state->on_worker_start)
+        pool_state->on_worker_start (self->id, pool_state->worker_ctx);
     /* request task from task queue and execute */
     for(;;) {
-        if (pool_state->stop) {
+        if (__atomic_load_n (&pool_state->stop, __ATOMIC_ACQUIRE)) {
             /* After the thread detects `stop` flag, it will stuck at
              * `cond_allow_go` until issued a `continue` cond
              */
-            pthread_mutex_lock (&pool_state->mutex_stop_continue);
+            LS_MUTEX_LOCK (&pool_state->mutex_stop_continue,
+                           &pool_state->ls_stop_continue);
             pool_state->stopped_threads++;
             /* The following wakes up the main thread in `hthpool_wait`,
              * but main thread won't be immediately active:
              * it still acquires `pool_state->mutex_stop_continue`
              * which is locked now
              */
-            if (pool_state->stopped_threads == pool_state->thread_num) {
+            if (pool_state->stopped_threads == pool_state->nstarted) {
                 pthread_cond_broadcast (&pool_state->cond_all_stopped);
             }
             /* Unlock `pool_state->mutex_stop_continue`
@@ -114,12 +587,683 @@ static void* daemon_run(void* arg) {
             DBG_PRINT (("  Thread 0x%lx keeps alive.\n", _HTHPOOL_TID (tid)));
             pthread_barrier_wait (&pool_state->barrier_continue);
         }
-        work_item item = worklist_take(pool_state->wl);
-        item.run(item.arg);
+        work_item item = pool_take (self, &bound);
+        if (pool_state->lazy)
+            __atomic_sub_fetch (&pool_state->idle, 1, __ATOMIC_RELAXED);
+        if (rate_admit (pool_state, item,
+                        bound ? pool_state->mail + self->id : NULL))
+            run_item (item);
+        /* the task forked and we are the child, see `pool_fork_child` */
+        if (self_worker != self)
+            return NULL;
+        if (pool_state->lazy)
+            __atomic_add_fetch (&pool_state->idle, 1, __ATOMIC_RELAXED);
+    }
+    if (pool_state->on_worker_exit)
+        pool_state->on_worker_exit (self->id, pool_state->worker_ctx);
+    self_worker = NULL;
+    return NULL;
+}
+
+/* Sense-reversing barrier of the BSP workers. The last thread to arrive
+ * ends the round: it swaps the frontiers and decides whether to go on
+ * before releasing the others, so one barrier per round suffices.
+ */
+static void bsp_barrier(struct hthpool_bsp* bsp, int* sense) {
+    int spin = 0;
+    *sense = !*sense;
+    if (__atomic_sub_fetch (&bsp->count, 1, __ATOMIC_ACQ_REL) == 0) {
+        int cur = !bsp->cur;
+        bsp->count = bsp->nthreads;
+        /* relaxed: the release store of `sense` publishes them */
+        __atomic_store_n (&bsp->cur, cur, __ATOMIC_RELAXED);
+        if ((bsp->step && !bsp->step (bsp->round))
+            || worklist_empty (&bsp->wl[cur]))
+            __atomic_store_n (&bsp->done, 1, __ATOMIC_RELAXED);
+        bsp->round++;
+        __atomic_store_n (&bsp->sense, *sense, __ATOMIC_RELEASE);
+        return;
+    }
+    while (__atomic_load_n (&bsp->sense, __ATOMIC_ACQUIRE) != *sense) {
+        if (++spin > BSP_SPIN)
+            sched_yield ();
+    }
+}
+
+/* `n` items of a logical pool finished or were dropped */
+static void sub_done(struct hthpool_sub* sub, long n) {
+    LS_MUTEX_LOCK (&sub->lock, &sub->ls);
+    sub->pending -= n;
+    if (sub->pending == 0)
+        pthread_cond_broadcast (&sub->cond_idle);
+    pthread_mutex_unlock (&sub->lock);
+}
+
+/* Every tenant submission queues one of these on the shared worklist.
+ * Which tenant's item it runs is decided by DRR when a worker takes it,
+ * so a tenant's burst can only occupy its share of the workers.
+ */
+static void* tenant_dispatch(void* arg) {
+    struct hthpool* pool_state = (struct hthpool*) arg;
+    work_item item, self = { (task) tenant_dispatch, pool_state };
+    long long now = timerq_now (), wait;
+    tenant_t* from;
+    int ret = tsched_dequeue (&pool_state->tenants, &item, &from, now, &wait);
+    if (ret == STAT_OK) {
+        run_item (item);
+        if (from->owner)
+            sub_done ((struct hthpool_sub*) from->owner, 1);
+    } else if (ret == STAT_AGAIN) {
+        /* only rate-limited tenants have work, come back with a token;
+         * without the timer come back right away rather than strand the
+         * queued item without a dispatch item
+         */
+        if (timerq_schedule (&pool_state->timers, now + wait, self)
+            != STAT_OK) {
+            worklist_add (pool_state->wl, self);
+            pool_demand (pool_state);
+        }
+    }
+    return NULL;
+}
+
+/* Deliver the latest watermark state on the timer thread, unless it
+ * flipped back before we got here
+ */
+static void* watermark_deliver(void* arg) {
+    struct hthpool* pool_state = (struct hthpool*) arg;
+    int above = __atomic_load_n (&pool_state->wm_above, __ATOMIC_ACQUIRE);
+    if (above != pool_state->wm_delivered) {
+        pool_state->wm_delivered = above;
+        pool_state->wm_cb (pool_state->wm_ctx, above,
+                           __atomic_load_n (&pool_state->wm_depth,
+                                            __ATOMIC_RELAXED));
+    }
+    return NULL;
+}
+
+/* unlink and free `prod`, `mutex_producers` held */
+static void producer_free_locked(struct hthpool_producer* prod) {
+    struct hthpool* pool_state = prod->pool;
+    if (prod->prev)
+        prod->prev->next = prod->next;
+    else
+        pool_state->producers = prod->next;
+    if (prod->next)
+        prod->next->prev = prod->prev;
+    lockstat_add (&pool_state->ls_producer, &prod->ls);
+    pthread_mutex_destroy (&prod->lock);
+    free (prod->items);
+    free (prod);
+}
+
+static void producer_free(struct hthpool_producer* prod) {
+    struct hthpool* pool_state = prod->pool;
+    LS_MUTEX_LOCK (&pool_state->mutex_producers, &pool_state->ls_producers);
+    producer_free_locked (prod);
+    pthread_mutex_unlock (&pool_state->mutex_producers);
+}
+
+/* Add the buffer to the worklist, `prod->lock` held. Items a stopped,
+ * full worklist refuses are dropped and counted in `producer_dropped`.
+ */
+static int producer_flush_locked(struct hthpool_producer* prod) {
+    int ret = STAT_OK;
+    size_t added;
+    if (prod->n) {
+        ret = worklist_add_batch (prod->pool->wl, prod->items, prod->n,
+                                  &added);
+        if (added < prod->n)
+            __atomic_add_fetch (&prod->pool->producer_dropped,
+                                prod->n - added, __ATOMIC_RELAXED);
+        pool_demand (prod->pool);
+        prod->n = 0;
+    }
+    return ret;
+}
+
+/* Time bound of a producer buffer, runs on the timer thread */
+static void* producer_expire(void* arg) {
+    struct hthpool_producer* prod = (struct hthpool_producer*) arg;
+    int closed;
+    LS_MUTEX_LOCK (&prod->lock, &prod->ls);
+    producer_flush_locked (prod);
+    prod->armed = 0;
+    closed = prod->closed;
+    pthread_mutex_unlock (&prod->lock);
+    if (closed)
+        producer_free (prod);
+    return NULL;
+}
+
+/* worklist watermark hook, runs on a producer or consumer */
+static void watermark_crossed(void* ctx, int above, long depth) {
+    struct hthpool* pool_state = (struct hthpool*) ctx;
+    work_item deliver = { (task) watermark_deliver, pool_state };
+    __atomic_store_n (&pool_state->wm_depth, depth, __ATOMIC_RELAXED);
+    __atomic_store_n (&pool_state->wm_above, above, __ATOMIC_RELEASE);
+    timerq_schedule (&pool_state->timers, timerq_now (), deliver);
+}
+
+/* timer thread hands due items back to the worklist */
+static void timer_fire(void* ctx, work_item item) {
+    /* internal timers run right here, the rest goes to the workers */
+    if (item.run == (task) watermark_deliver ||
+        item.run == (task) producer_expire)
+        item.run (item.arg);
+    else if (item.run == (task) rate_run_bound)
+        hthpool_submit_to ((struct hthpool*) ctx,
+                           ((struct hthpool_mailbox*) item.arg)->id, item);
+    else {
+        worklist_add (((struct hthpool*) ctx)->wl, item);
+        pool_demand ((struct hthpool*) ctx);
+    }
+}
+
+/* One per worker thread, runs rounds until the last frontier is empty */
+static void* bsp_run(void* arg) {
+    struct hthpool_bsp* bsp = ((struct hthpool*) arg)->bsp;
+    work_item item;
+    int sense = 0;
+    while (!__atomic_load_n (&bsp->done, __ATOMIC_RELAXED)) {
+        int cur = __atomic_load_n (&bsp->cur, __ATOMIC_RELAXED);
+        while (worklist_trytake (&bsp->wl[cur], &item) == STAT_OK)
+            run_item (item);
+        bsp_barrier (bsp, &sense);
+    }
+    pthread_mutex_lock (&bsp->mutex_done);
+    if (++bsp->exited == bsp->nthreads)
+        pthread_cond_signal (&bsp->cond_done);
+    pthread_mutex_unlock (&bsp->mutex_done);
+    return NULL;
+}
+
+/* Log the dequeue of a task submitted with an id, then run it */
+static void* traced_run(void* arg) {
+    struct hthpool_traced traced = *(struct hthpool_traced*) arg;
+    trace* tr = __atomic_load_n (&traced.pool->recording, __ATOMIC_ACQUIRE);
+    free (arg);
+    if (tr != NULL)
+        trace_record (tr, self_worker ? self_worker->id : -1, traced.task);
+    run_item (traced.item);
+    return NULL;
+}
+
+/* One per worker thread, takes the tasks the trace assigns to it */
+static void* replay_run(void* arg) {
+    struct hthpool_replay* rp = ((struct hthpool*) arg)->replay;
+    struct replay_slot* slot;
+    work_item item;
+    size_t i, n = trace_size (rp->tr);
+    int me = self_worker->id, spin;
+
+    pthread_mutex_lock (&rp->mutex_done);
+    if (++rp->entered == rp->nthreads)
+        pthread_cond_broadcast (&rp->cond_done);
+    pthread_mutex_unlock (&rp->mutex_done);
+    for (i = 0; i < n; i++) {
+        if (rp->tr->entries[i].worker != me)
+            continue;
+        slot = replay_find (&rp->table, rp->tr->entries[i].task);
+        spin = 0;
+        while (__atomic_load_n (&rp->next, __ATOMIC_ACQUIRE) != i ||
+               !__atomic_load_n (&slot->ready, __ATOMIC_ACQUIRE)) {
+            if (++spin > BSP_SPIN)
+                sched_yield ();
+        }
+        item = slot->item;
+        __atomic_store_n (&rp->next, i + 1, __ATOMIC_RELEASE);
+        run_item (item);
+    }
+    pthread_mutex_lock (&rp->mutex_done);
+    while (rp->entered != rp->nthreads)
+        pthread_cond_wait (&rp->cond_done, &rp->mutex_done);
+    if (++rp->exited == rp->nthreads)
+        pthread_cond_broadcast (&rp->cond_done);
+    pthread_mutex_unlock (&rp->mutex_done);
+    return NULL;
+}
+
+/* Dispatch of a class item: run the oldest queued item of the class if it
+ * is below its limit, otherwise park and let the worker pick other work.
+ */
+static void* class_dispatch(void* arg) {
+    struct hthpool_class* cls = (struct hthpool_class*) arg;
+    work_item item, self = { (task) class_dispatch, cls };
+    int resubmit;
+
+    LS_MUTEX_LOCK (&cls->lock, &cls->ls);
+    if (cls->running >= cls->limit) {
+        cls->parked++;
+        pthread_mutex_unlock (&cls->lock);
+        return NULL;
+    }
+    if (!ring_pop (&cls->queue, &item)) {
+        pthread_mutex_unlock (&cls->lock);
+        return NULL;
+    }
+    cls->running++;
+    pthread_mutex_unlock (&cls->lock);
+
+    run_item (item);
+
+    LS_MUTEX_LOCK (&cls->lock, &cls->ls);
+    cls->running--;
+    resubmit = cls->parked > 0;
+    if (resubmit)
+        cls->parked--;
+    pthread_mutex_unlock (&cls->lock);
+    if (resubmit)
+        worklist_add (cls->pool->wl, self);
+    return NULL;
+}
+
+static void retry_unlink(struct hthpool* pool_state, struct hthpool_retry* job) {
+    LS_MUTEX_LOCK (&pool_state->mutex_retry, &pool_state->ls_retry);
+    if (job->prev)
+        job->prev->next = job->next;
+    else
+        pool_state->retries = job->next;
+    if (job->next)
+        job->next->prev = job->prev;
+    pthread_mutex_unlock (&pool_state->mutex_retry);
+}
+
+/* One attempt of a retried task. On failure the job goes back through
+ * the timer thread after its backoff, so no worker waits it out.
+ */
+static void* retry_dispatch(void* arg) {
+    struct hthpool_retry* job = (struct hthpool_retry*) arg;
+    struct hthpool* pool_state = job->pool;
+    work_item self = { (task) retry_dispatch, job };
+
+    task_result.failed = 0;
+    run_item (job->item);
+    if (!task_result.failed)
+        goto done;
+    task_result.failed = 0;
+    job->attempts++;
+    if (task_result.status != STAT_TERM &&
+        job->attempts < job->attr.max_attempts &&
+        timerq_schedule (&pool_state->timers,
+                         timerq_now () + job->backoff, self) == STAT_OK) {
+        job->backoff *= 2;
+        if (job->backoff > job->attr.max_backoff)
+            job->backoff = job->attr.max_backoff;
+        return NULL;
+    }
+    if (job->attr.on_failure)
+        job->attr.on_failure (job->attr.ctx, job->item, task_result.status,
+                              task_result.error, job->attempts);
+done:
+    retry_unlink (pool_state, job);
+    free (job);
+    return NULL;
+}
+
+/* free all retry jobs, no worker may be running them and the timer
+ * thread may not be handing them over
+ */
+static void retry_clear(struct hthpool* pool_state) {
+    struct hthpool_retry* job;
+    LS_MUTEX_LOCK (&pool_state->mutex_retry, &pool_state->ls_retry);
+    while ((job = pool_state->retries) != NULL) {
+        pool_state->retries = job->next;
+        free (job);
+    }
+    pthread_mutex_unlock (&pool_state->mutex_retry);
+}
+
+/* Drop all queued and scheduled work, no worker may be taking it and the
+ * timer thread must be paused or gone
+ */
+static void pool_discard(struct hthpool* pool_state) {
+    struct hthpool_class* cls;
+    struct hthpool_sub* sub;
+    struct hthpool_producer* prod;
+    struct hthpool_mailbox* mb;
+    int i;
+    worklist_reset (pool_state->wl);
+    /* their dispatch items were just thrown away */
+    tsched_clear (&pool_state->tenants);
+    timerq_clear (&pool_state->timers);
+    for (cls = pool_state->classes; cls != NULL; cls = cls->next) {
+        ring_clear (&cls->queue);
+        cls->parked = 0;
+    }
+    for (i = 0; i < pool_state->thread_num; i++) {
+        mb = pool_state->mail + i;
+        LS_MUTEX_LOCK (&mb->lock, &mb->ls);
+        ring_clear (&mb->bound);
+        ring_clear (&mb->hinted);
+        ring_clear (&mb->deferred);
+        __atomic_store_n (&mb->n, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock (&mb->lock);
+    }
+    retry_clear (pool_state);
+    /* their `rate_run` went with the timers, so did the tokens they held */
+    LS_MUTEX_LOCK (&pool_state->mutex_rate, &pool_state->ls_rate);
+    ring_clear (&pool_state->deferred);
+    ratelimit_forgive (&pool_state->rate);
+    pthread_mutex_unlock (&pool_state->mutex_rate);
+    for (sub = pool_state->subs; sub != NULL; sub = sub->next)
+        sub_done (sub, sub->pending);
+    /* scheduled flushes were dropped with the timers, destroyed producers
+     * waiting for theirs are freed here; the list stays locked throughout
+     */
+    LS_MUTEX_LOCK (&pool_state->mutex_producers, &pool_state->ls_producers);
+    prod = pool_state->producers;
+    while (prod != NULL) {
+        struct hthpool_producer* next = prod->next;
+        int closed;
+        LS_MUTEX_LOCK (&prod->lock, &prod->ls);
+        prod->armed = 0;
+        closed = prod->closed;
+        pthread_mutex_unlock (&prod->lock);
+        if (closed)
+            producer_free_locked (prod);
+        prod = next;
+    }
+    pthread_mutex_unlock (&pool_state->mutex_producers);
+}
+
+/* A token reserved for a deferred item is due: run the oldest one */
+static void* rate_run(void* arg) {
+    struct hthpool* pool_state = (struct hthpool*) arg;
+    work_item item;
+    int found;
+    LS_MUTEX_LOCK (&pool_state->mutex_rate, &pool_state->ls_rate);
+    found = ring_pop (&pool_state->deferred, &item);
+    pthread_mutex_unlock (&pool_state->mutex_rate);
+    if (found)
+        run_item (item);
+    return NULL;
+}
+
+/* Same for a bound item, mailed back to its worker by `timer_fire` */
+static void* rate_run_bound(void* arg) {
+    struct hthpool_mailbox* mb = (struct hthpool_mailbox*) arg;
+    work_item item;
+    int found;
+    LS_MUTEX_LOCK (&mb->lock, &mb->ls);
+    found = ring_pop (&mb->deferred, &item);
+    pthread_mutex_unlock (&mb->lock);
+    if (found)
+        run_item (item);
+    return NULL;
+}
+
+/* Pool-wide rate limit, consulted for every item a worker takes.
+ * An item over the limit reserves the next token and queues behind the
+ * items deferred before it; the timer thread submits a `rate_run` when
+ * the token is due. Items keep going behind the queue until it drained,
+ * so they run in the order they were taken. The worker moves on.
+ * Items bound to the worker of `mb` (NULL: not bound) queue in its
+ * mailbox instead, so they stay on it and in order.
+ * return: 1 if `item` may run now
+ */
+static int rate_admit(struct hthpool* pool_state, work_item item,
+                      struct hthpool_mailbox* mb) {
+    long long now, wait;
+    work_item due = { rate_run, pool_state };
+    struct ring* deferred = &pool_state->deferred;
+    int queued;
+    if (!__atomic_load_n (&pool_state->rate_limited, __ATOMIC_RELAXED) ||
+        item.run == (task) bsp_run || item.run == (task) replay_run ||
+        item.run == (task) mail_steal || item.run == (task) rate_run ||
+        item.run == (task) rate_run_bound || item.run == WL_EMPTYITEM.run)
+        return 1;
+    if (mb != NULL) {
+        due.run = rate_run_bound;
+        due.arg = mb;
+        deferred = &mb->deferred;
+        LS_MUTEX_LOCK (&mb->lock, &mb->ls);
+    }
+    now = timerq_now ();
+    LS_MUTEX_LOCK (&pool_state->mutex_rate, &pool_state->ls_rate);
+    wait = ratelimit_reserve (&pool_state->rate, now);
+    /* out of memory: run it now, its token is taken anyway */
+    queued = (wait != 0 || deferred->size != 0) &&
+             ring_push (deferred, item) == STAT_OK;
+    pthread_mutex_unlock (&pool_state->mutex_rate);
+    if (mb != NULL)
+        pthread_mutex_unlock (&mb->lock);
+    if (queued)
+        timerq_schedule (&pool_state->timers, now + wait, due);
+    return !queued;
+}
+
+/* default watchdog callback */
+static void watchdog_report(void* ctx, int worker, work_item item,
+                            long long elapsed) {
+    fprintf ((FILE*) ctx, "hthpool: worker %d stuck in task %p(%p) for %.3fs\n",
+             worker, *(void**) &item.run, item.arg, elapsed / 1e9);
+}
+
+/* Scan the workers every quarter threshold, report every task exceeding
+ * the threshold once, and serve dump requests in between
+ */
+static void* watchdog_run(void* arg) {
+    struct hthpool* pool_state = (struct hthpool*) arg;
+    struct hthpool_watchdog* wd = &pool_state->watchdog;
+    long long period = wd->threshold / 4, start, now;
+    long long* reported;
+    struct timespec ts;
+    work_item item;
+    int i, n = pool_state->thread_num;
+
+    reported = (long long*) calloc (n > 0 ? n : 1, sizeof(long long));
+    if (reported == NULL) {
+        perror ("Start watchdog");
+        exit (EXIT_FAILURE);
+    }
+    if (period < 1000000)
+        period = 1000000;
+    while (!__atomic_load_n (&wd->close, __ATOMIC_ACQUIRE)) {
+        /* sem_timedwait takes a CLOCK_REALTIME deadline */
+        clock_gettime (CLOCK_REALTIME, &ts);
+        ts.tv_sec  += (ts.tv_nsec + period) / 1000000000LL;
+        ts.tv_nsec  = (ts.tv_nsec + period) % 1000000000LL;
+        while (sem_timedwait (&wd->sem, &ts) == -1 && errno == EINTR)
+            ;
+        if (__atomic_exchange_n (&wd->dump, 0, __ATOMIC_ACQ_REL))
+            hthpool_dump (pool_state, stderr);
+        now = timerq_now ();
+        for (i = 0; i < n; i++) {
+            start = worker_current (&pool_state->workers[i], &item);
+            if (start == 0 || start == reported[i] ||
+                now - start < wd->threshold)
+                continue;
+            reported[i] = start;
+            wd->cb (wd->ctx, i, item, now - start);
+        }
     }
+    free (reported);
     return NULL;
 }
 
+/* fork() handling, see `hthpoolattr_setfork`.
+ * The prepare handler takes the locks of every registered pool in the
+ * order the pool nests them: the producer list before the buffers; the
+ * buffers, classes, mailboxes, logical pools and tenants before the
+ * worklist they submit to; the rate limit, retry list and timer queue
+ * hold no other lock; `mutex_stop_continue` last, nothing is taken under
+ * it (`hthpool_continue` drops the work before taking it).
+ */
+static pthread_mutex_t fork_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t  fork_once = PTHREAD_ONCE_INIT;
+static struct hthpool* fork_pools;
+
+static void pool_fork_prepare(struct hthpool* pool_state) {
+    struct hthpool_producer* prod;
+    struct hthpool_class* cls;
+    struct hthpool_sub* sub;
+    int i;
+    pthread_mutex_lock (&pool_state->mutex_producers);
+    for (prod = pool_state->producers; prod != NULL; prod = prod->next)
+        pthread_mutex_lock (&prod->lock);
+    for (cls = pool_state->classes; cls != NULL; cls = cls->next)
+        pthread_mutex_lock (&cls->lock);
+    for (i = 0; i < pool_state->thread_num; i++)
+        pthread_mutex_lock (&pool_state->mail[i].lock);
+    for (sub = pool_state->subs; sub != NULL; sub = sub->next)
+        pthread_mutex_lock (&sub->lock);
+    pthread_mutex_lock (&pool_state->tenants.lock);
+    pthread_mutex_lock (&pool_state->mutex_rate);
+    pthread_mutex_lock (&pool_state->mutex_retry);
+    timerq_fork_prepare (&pool_state->timers);
+    worklist_fork_prepare (pool_state->wl);
+    pthread_mutex_lock (&pool_state->mutex_stop_continue);
+}
+
+/* release all but the timer queue, whose child handler restarts it */
+static void pool_fork_unlock(struct hthpool* pool_state) {
+    struct hthpool_producer* prod;
+    struct hthpool_class* cls;
+    struct hthpool_sub* sub;
+    int i;
+    pthread_mutex_unlock (&pool_state->mutex_stop_continue);
+    pthread_mutex_unlock (&pool_state->mutex_retry);
+    pthread_mutex_unlock (&pool_state->mutex_rate);
+    pthread_mutex_unlock (&pool_state->tenants.lock);
+    for (sub = pool_state->subs; sub != NULL; sub = sub->next)
+        pthread_mutex_unlock (&sub->lock);
+    for (i = 0; i < pool_state->thread_num; i++)
+        pthread_mutex_unlock (&pool_state->mail[i].lock);
+    for (cls = pool_state->classes; cls != NULL; cls = cls->next)
+        pthread_mutex_unlock (&cls->lock);
+    for (prod = pool_state->producers; prod != NULL; prod = prod->next)
+        pthread_mutex_unlock (&prod->lock);
+    pthread_mutex_unlock (&pool_state->mutex_producers);
+}
+
+static void pool_fork_parent(struct hthpool* pool_state) {
+    worklist_fork_parent (pool_state->wl);
+    timerq_fork_parent (&pool_state->timers);
+    pool_fork_unlock (pool_state);
+}
+
+/* Only the forking thread exists in the child. Forget the pool's threads,
+ * renew the conds and the barrier they may be counted in, then either drop
+ * the work or start the threads again.
+ */
+static void pool_fork_child(struct hthpool* pool_state) {
+    struct hthpool_class* cls;
+    struct hthpool_sub* sub;
+    work_item dispatch = { (task) class_dispatch, NULL };
+    int keep = pool_state->fork_mode == HTHPOOL_FORK_KEEP;
+    int i, last;
+
+    /* forked by a task: this thread leaves the pool once the task returns */
+    if (self_worker != NULL && self_worker->pool == pool_state)
+        self_worker = NULL;
+    worklist_fork_child (pool_state->wl);
+    pthread_cond_init (&pool_state->cond_all_stopped, NULL);
+    pthread_cond_init (&pool_state->cond_allow_go, NULL);
+    pthread_barrier_init (&pool_state->barrier_continue, NULL,
+                          pool_state->barrier_count);
+    for (sub = pool_state->subs; sub != NULL; sub = sub->next)
+        pthread_cond_init (&sub->cond_idle, NULL);
+    pool_state->nstarted = pool_state->idle = 0;
+    if (pool_state->lazy)
+        worklist_setconcurrency (pool_state->wl, 0);
+    pool_state->deep = 0;
+    pool_state->stopped_threads = pool_state->blocked_threads = 0;
+    memset (pool_state->workers, 0,
+            (pool_state->thread_num > 0 ? pool_state->thread_num : 1) *
+            sizeof(struct hthpool_worker));
+    for (i = 0; i < pool_state->thread_num; i++)
+        pool_state->mail[i].asleep = 0;
+    pool_fork_unlock (pool_state);
+
+    if (!keep) {
+        timerq_fork_child (&pool_state->timers, 0);
+        pool_discard (pool_state);
+        pool_state->watchdog.started = 0;
+        pool_state->close = 1;
+        return;
+    }
+    /* tasks that were running are gone with their threads */
+    for (cls = pool_state->classes; cls != NULL; cls = cls->next) {
+        cls->running = 0;
+        dispatch.arg = cls;
+        for (; cls->parked > 0; cls->parked--)
+            worklist_add (pool_state->wl, dispatch);
+    }
+    for (sub = pool_state->subs; sub != NULL; sub = sub->next) {
+        sub->pending = (long) sub->tenant->queue.size;
+        if (sub->pending == 0)
+            pthread_cond_broadcast (&sub->cond_idle);
+    }
+    if (timerq_fork_child (&pool_state->timers, 1))
+        perror ("Restart timer thread after fork");
+    if (pool_state->watchdog.started) {
+        struct hthpool_watchdog* wd = &pool_state->watchdog;
+        wd->close = wd->dump = 0;
+        wd->started = !sem_init (&wd->sem, 0, 0) &&
+                      !pthread_create (&wd->thread, NULL, watchdog_run,
+                                       pool_state);
+    }
+    /* lazy pools start the workers that have mail, and those before them */
+    for (last = pool_state->thread_num - 1; last >= 0; last--)
+        if (pool_state->mail[last].n > 0)
+            break;
+    pthread_mutex_lock (&pool_state->mutex_stop_continue);
+    for (i = 0; i < pool_state->thread_num && (!pool_state->lazy || i <= last);
+         i++)
+        pool_spawn (pool_state);
+    pthread_mutex_unlock (&pool_state->mutex_stop_continue);
+    if (!worklist_empty (pool_state->wl))
+        pool_demand (pool_state);
+}
+
+static void fork_prepare(void) {
+    struct hthpool* pool_state;
+    pthread_mutex_lock (&fork_lock);
+    for (pool_state = fork_pools; pool_state; pool_state = pool_state->fork_next)
+        pool_fork_prepare (pool_state);
+}
+
+static void fork_parent(void) {
+    struct hthpool* pool_state;
+    for (pool_state = fork_pools; pool_state; pool_state = pool_state->fork_next)
+        pool_fork_parent (pool_state);
+    pthread_mutex_unlock (&fork_lock);
+}
+
+static void fork_child(void) {
+    struct hthpool* pool_state;
+    for (pool_state = fork_pools; pool_state; pool_state = pool_state->fork_next)
+        pool_fork_child (pool_state);
+    pthread_mutex_unlock (&fork_lock);
+}
+
+static void fork_register_handlers(void) {
+    if (pthread_atfork (fork_prepare, fork_parent, fork_child)) {
+        perror ("Register fork handlers");
+        exit (EXIT_FAILURE);
+    }
+}
+
+static void fork_register(struct hthpool* pool_state) {
+    pthread_once (&fork_once, fork_register_handlers);
+    pthread_mutex_lock (&fork_lock);
+    pool_state->fork_next = fork_pools;
+    fork_pools = pool_state;
+    pthread_mutex_unlock (&fork_lock);
+}
+
+static void fork_unregister(struct hthpool* pool_state) {
+    struct hthpool** link;
+    pthread_mutex_lock (&fork_lock);
+    for (link = &fork_pools; *link != NULL; link = &(*link)->fork_next)
+        if (*link == pool_state) {
+            *link = pool_state->fork_next;
+            break;
+        }
+    pthread_mutex_unlock (&fork_lock);
+}
+
 /* --------------------------------------------------------------------
  * API which should only be called by the main thread (not in the pool)
  * --------------------------------------------------------------------
@@ -132,10 +1276,105 @@ void hthpool_register(struct hthpool* pool_state,
     pool_state->full_event  = ftask;
 }
 
+void hthpoolattr_init(hthpool_attr* attr) {
+    attr->wl_type = WL_FIFO;
+    attr->wl_size = WL_SIZE;
+    attr->wl_delta = 0;
+    attr->wl_factor = 2;
+    attr->wl_drop = 0;
+    attr->wl_sp = attr->wl_sc = 0;
+    attr->wl_memflags = 0;
+    attr->lazy = 0;
+    attr->fork_mode = HTHPOOL_FORK_NONE;
+    attr->idle_spin = attr->idle_deep = 0;
+    attr->topology = 0;
+    attr->empty_event = WL_EMPTYITEM;
+    attr->full_event  = WL_EMPTYITEM;
+    attr->wm_low = attr->wm_high = 0;
+    attr->wm_cb = NULL;
+    attr->wm_ctx = NULL;
+    attr->on_worker_start = attr->on_worker_exit = NULL;
+    attr->worker_ctx = NULL;
+}
+
+void hthpoolattr_setworkerhooks(hthpool_attr* attr,
+                                hthpool_worker_cb on_worker_start,
+                                hthpool_worker_cb on_worker_exit,
+                                void* ctx) {
+    attr->on_worker_start = on_worker_start;
+    attr->on_worker_exit = on_worker_exit;
+    attr->worker_ctx = ctx;
+}
+
+void hthpoolattr_setworklist(hthpool_attr* attr, int type, size_t size) {
+    attr->wl_type = type;
+    attr->wl_size = size;
+}
+
+void hthpoolattr_setdelta(hthpool_attr* attr, int delta) {
+    attr->wl_delta = delta;
+}
+
+void hthpoolattr_setfactor(hthpool_attr* attr, size_t factor) {
+    attr->wl_factor = factor;
+}
+
+void hthpoolattr_setdrop(hthpool_attr* attr, int drop) {
+    attr->wl_drop = drop;
+}
+
+void hthpoolattr_setwatermark(hthpool_attr* attr, long low, long high,
+                              hthpool_watermark_cb cb, void* ctx) {
+    attr->wm_low = low;
+    attr->wm_high = high;
+    attr->wm_cb = cb;
+    attr->wm_ctx = ctx;
+}
+
+void hthpoolattr_setsingle(hthpool_attr* attr, int producer, int consumer) {
+    attr->wl_sp = producer;
+    attr->wl_sc = consumer;
+}
+
+void hthpoolattr_setmemory(hthpool_attr* attr, int memflags) {
+    attr->wl_memflags = memflags;
+}
+
+void hthpoolattr_setlazy(hthpool_attr* attr, int lazy) {
+    attr->lazy = lazy;
+}
+
+void hthpoolattr_setidle(hthpool_attr* attr, long long spin_ns,
+                         long long deep_ns) {
+    attr->idle_spin = spin_ns;
+    attr->idle_deep = deep_ns;
+}
+
+void hthpoolattr_settopology(hthpool_attr* attr, int on) {
+    attr->topology = on;
+}
+
+void hthpoolattr_setfork(hthpool_attr* attr, int mode) {
+    attr->fork_mode = mode;
+}
+
+void hthpoolattr_setevent(hthpool_attr* attr,
+                          work_item etask, work_item ftask) {
+    attr->empty_event = etask;
+    attr->full_event  = ftask;
+}
+
 /* Initialize a new threadpool
  */
 struct hthpool* hthpool_init(int num, work_item etask, work_item ftask) {
-    int wlret = 0, pret = 0, mret = 0;
+    hthpool_attr attr;
+    hthpoolattr_init (&attr);
+    hthpoolattr_setevent (&attr, etask, ftask);
+    return hthpool_init_attr (num, &attr);
+}
+
+struct hthpool* hthpool_init_attr(int num, const hthpool_attr* pattr) {
+    int wlret = 0, mret = 0;
     int i;
     struct hthpool* pool_state;
     if (num < 0)
@@ -144,7 +1383,7 @@ struct hthpool* hthpool_init(int num, work_item etask, work_item ftask) {
     pool_state = (struct hthpool*) malloc (sizeof(struct hthpool));
     if (pool_state == NULL)
         exit (EXIT_FAILURE);
-    hthpool_register (pool_state, etask, ftask);
+    hthpool_register (pool_state, pattr->empty_event, pattr->full_event);
 
     pool_state->wl = (_hthp_worklist*) malloc (sizeof(_hthp_worklist));
     if (pool_state->wl == NULL)
@@ -155,16 +1394,76 @@ struct hthpool* hthpool_init(int num, work_item etask, work_item ftask) {
     worklistattr_setevent (&attr,
                            pool_state->empty_event,
                            pool_state->full_event);
-    wlret = worklist_init (pool_state->wl, WL_SIZE, &attr);
+    worklistattr_settype (&attr, pattr->wl_type);
+    worklistattr_setdelta (&attr, pattr->wl_delta);
+    worklistattr_setfactor (&attr, pattr->wl_factor);
+    worklistattr_setdrop (&attr, pattr->wl_drop);
+    worklistattr_setsingle (&attr, pattr->wl_sp, pattr->wl_sc && num == 1);
+    worklistattr_setmemory (&attr, pattr->wl_memflags);
+    pool_state->wm_cb = pattr->wm_cb;
+    pool_state->wm_ctx = pattr->wm_ctx;
+    pool_state->wm_above = pool_state->wm_delivered = 0;
+    pool_state->wm_depth = 0;
+    if (pattr->wm_cb)
+        worklistattr_setwatermark (&attr, pattr->wm_low, pattr->wm_high,
+                                   watermark_crossed, pool_state);
+    memset (&pool_state->topo, 0, sizeof(topo));
+    if (pattr->topology)
+        pool_topology (pool_state, num);
+    if (pool_state->topo.n)
+        worklistattr_setgroups (&attr, pool_state->topo.group,
+                                pool_state->topo.package, num);
+    wlret = worklist_init (pool_state->wl, pattr->wl_size, &attr);
 
     pool_state->thread_num = num;
+    pool_state->lazy = pattr->lazy;
+    if (pool_state->lazy)
+        worklist_setconcurrency (pool_state->wl, 0);
+    pool_state->nstarted = pool_state->idle = 0;
+    pool_state->idle_spin = pattr->idle_spin;
+    pool_state->idle_deep = pattr->idle_deep;
+    pool_state->deep = 0;
+    pool_state->idle_trims = 0;
+    pool_state->barrier_count = num > 0 ? num : 1;
+    pool_state->stop = 0;
+    pool_state->bsp = NULL;
+    ratelimit_init (&pool_state->rate, 0, 1, 0);
+    ring_init (&pool_state->deferred);
+    pool_state->rate_limited = 0;
+    pool_state->classes = NULL;
+    pool_state->watchdog.started = 0;
+    pool_state->retries = NULL;
+    pool_state->subs = NULL;
+    pool_state->producers = NULL;
+    pool_state->on_worker_start = pattr->on_worker_start;
+    pool_state->on_worker_exit = pattr->on_worker_exit;
+    pool_state->worker_ctx = pattr->worker_ctx;
+    pool_state->fork_mode = pattr->fork_mode;
+    pool_state->recording = NULL;
+    pool_state->replay = NULL;
+    lockstat_init (&pool_state->ls_stop_continue);
+    lockstat_init (&pool_state->ls_rate);
+    lockstat_init (&pool_state->ls_retry);
+    lockstat_init (&pool_state->ls_producers);
+    lockstat_init (&pool_state->ls_producer);
+    if (tsched_init (&pool_state->tenants)                          ||
+        timerq_init (&pool_state->timers, timer_fire, pool_state)   ||
+        pthread_mutex_init (&pool_state->mutex_rate, NULL)          ||
+        pthread_mutex_init (&pool_state->mutex_retry, NULL)          ||
+        pthread_mutex_init (&pool_state->mutex_producers, NULL)
+       )
+    {
+        perror ("Initialize tenant scheduler and timers");
+        exit (EXIT_FAILURE);
+    }
     pool_state->stopped_threads = 0;
     pool_state->blocked_threads = 0;
     pool_state->close = 0;
     if (pthread_mutex_init (&pool_state->mutex_stop_continue, NULL) ||
         pthread_cond_init (&pool_state->cond_all_stopped, NULL)     ||
         pthread_cond_init (&pool_state->cond_allow_go, NULL)        ||
-        pthread_barrier_init (&pool_state->barrier_continue, NULL, num)
+        pthread_barrier_init (&pool_state->barrier_continue, NULL,
+                              pool_state->barrier_count)
        )
     {
         perror ("Initialize synchronization variables");
@@ -181,14 +1480,37 @@ struct hthpool* hthpool_init(int num, work_item etask, work_item ftask) {
         exit (EXIT_FAILURE);
     }
 
+    pool_state->workers = (struct hthpool_worker*)
+        calloc (num > 0 ? num : 1, sizeof(struct hthpool_worker));
+    if (pool_state->workers == NULL ||
+        posix_memalign ((void**) &pool_state->mail, MAIL_CACHELINE,
+                        (num > 0 ? num : 1) * sizeof(struct hthpool_mailbox)))
+        exit (EXIT_FAILURE);
+    pool_state->hints_stolen = 0;
+    pool_state->producer_dropped = 0;
     for (i = 0; i < num; i++) {
-        pret = pthread_create(pool_state->pool + i, NULL,
-                              daemon_run, (void*)pool_state);
-        if (pret) {
-            perror ("Create threads");
+        struct hthpool_mailbox* mb = pool_state->mail + i;
+        mb->pool = pool_state;
+        mb->id = i;
+        if (pthread_mutex_init (&mb->lock, NULL)) {
+            perror ("Initialize mailboxes");
             exit (EXIT_FAILURE);
         }
+        lockstat_init (&mb->ls);
+        ring_init (&mb->bound);
+        ring_init (&mb->hinted);
+        ring_init (&mb->deferred);
+        mb->n = 0;
+        mb->asleep = 0;
     }
+    /* lazy pools start their workers in `pool_demand` */
+    LS_MUTEX_LOCK (&pool_state->mutex_stop_continue,
+                   &pool_state->ls_stop_continue);
+    for (i = 0; i < num && !pool_state->lazy; i++)
+        pool_spawn (pool_state);
+    pthread_mutex_unlock (&pool_state->mutex_stop_continue);
+    if (pool_state->fork_mode != HTHPOOL_FORK_NONE)
+        fork_register (pool_state);
 
     return pool_state;
 }
@@ -203,14 +1525,23 @@ void hthpool_destroy(struct hthpool* pool_state) {
     int i, pret;
     void* ret;
     
-    pthread_mutex_lock (&pool_state->mutex_stop_continue);
+    if (pool_state->fork_mode != HTHPOOL_FORK_NONE)
+        fork_unregister (pool_state);
+    /* Nothing takes from the worklist any more: a hand-over of the timer
+     * thread blocked on a full ring gives up, then the thread is joined
+     */
+    worklist_stop (pool_state->wl);
+    timerq_stop (&pool_state->timers);
+    LS_MUTEX_LOCK (&pool_state->mutex_stop_continue,
+                   &pool_state->ls_stop_continue);
     pool_state->close = 1;
-    pool_state->blocked_threads = pool_state->thread_num;
+    pool_state->blocked_threads = pool_state->nstarted;
     DBG_PRINT (("Kill'em all!\n"));
     pthread_mutex_unlock (&pool_state->mutex_stop_continue);
     pthread_cond_broadcast (&pool_state->cond_allow_go);
 
-    for (i = 0; i < pool_state->thread_num; i++) {
+    /* `close` is set, no more workers are started */
+    for (i = 0; i < pool_state->nstarted; i++) {
         pret = pthread_join (pool_state->pool[i], &ret);
         if (pret) {
             perror ("Join threads");
@@ -218,6 +1549,45 @@ void hthpool_destroy(struct hthpool* pool_state) {
         }
     }
     free (pool_state->pool);
+    if (pool_state->watchdog.started) {
+        __atomic_store_n (&pool_state->watchdog.close, 1, __ATOMIC_RELEASE);
+        sem_post (&pool_state->watchdog.sem);
+        pthread_join (pool_state->watchdog.thread, &ret);
+        sem_destroy (&pool_state->watchdog.sem);
+    }
+    free (pool_state->workers);
+    for (i = 0; i < pool_state->thread_num; i++) {
+        pthread_mutex_destroy (&pool_state->mail[i].lock);
+        ring_destroy (&pool_state->mail[i].bound);
+        ring_destroy (&pool_state->mail[i].hinted);
+        ring_destroy (&pool_state->mail[i].deferred);
+    }
+    free (pool_state->mail);
+    topo_free (&pool_state->topo);
+    timerq_destroy (&pool_state->timers);
+    while (pool_state->classes) {
+        struct hthpool_class* cls = pool_state->classes;
+        pool_state->classes = cls->next;
+        pthread_mutex_destroy (&cls->lock);
+        ring_destroy (&cls->queue);
+        free (cls);
+    }
+    retry_clear (pool_state);
+    trace_free (pool_state->recording);
+    while (pool_state->subs) {
+        struct hthpool_sub* sub = pool_state->subs;
+        pool_state->subs = sub->next;
+        pthread_mutex_destroy (&sub->lock);
+        pthread_cond_destroy (&sub->cond_idle);
+        free (sub);
+    }
+    pthread_mutex_destroy (&pool_state->mutex_retry);
+    /* only destroyed producers whose flush never came are left */
+    while (pool_state->producers)
+        producer_free (pool_state->producers);
+    pthread_mutex_destroy (&pool_state->mutex_producers);
+    pthread_mutex_destroy (&pool_state->mutex_rate);
+    ring_destroy (&pool_state->deferred);
     if (pthread_mutex_destroy (&pool_state->mutex_stop_continue)    ||
         pthread_cond_destroy (&pool_state->cond_all_stopped)        ||
         pthread_cond_destroy (&pool_state->cond_allow_go)           ||
@@ -229,14 +1599,16 @@ void hthpool_destroy(struct hthpool* pool_state) {
     }
     worklist_destroy (pool_state->wl);
     free (pool_state->wl);
+    tsched_destroy (&pool_state->tenants);
     free (pool_state);
 }
 
 /* Wait until all threads are stopped */
 void hthpool_wait(struct hthpool* pool_state) {
-    pthread_mutex_lock (&pool_state->mutex_stop_continue);
+    LS_MUTEX_LOCK (&pool_state->mutex_stop_continue,
+                   &pool_state->ls_stop_continue);
     /* If all threads in the threadpool already stopped, no need to wait */
-    while (pool_state->stopped_threads != pool_state->thread_num)
+    while (pool_state->stopped_threads != pool_state->nstarted)
         pthread_cond_wait (&pool_state->cond_all_stopped,
                            &pool_state->mutex_stop_continue);
     DBG_PRINT (("All threads stopped\n"));
@@ -245,14 +1617,208 @@ void hthpool_wait(struct hthpool* pool_state) {
 
 /* Make threadpool running again only after it's been stopped */
 void hthpool_continue(struct hthpool* pool_state) {
-    pthread_mutex_lock (&pool_state->mutex_stop_continue);
-    pool_state->stop = 0;
+    /* The timer thread hands items to the worklist and retry jobs back to
+     * it without any pool lock, so it is paused before both are dropped:
+     * a hand-over blocked on a full ring gives up, one in progress ends.
+     */
+    worklist_stop (pool_state->wl);
+    timerq_pause (&pool_state->timers);
+    /* The workers stay parked until `stop` is cleared below. The pool's
+     * other locks nest outside `mutex_stop_continue` (see the fork
+     * handlers), so the work is dropped before taking it.
+     */
+    pool_discard (pool_state);
+    /* the queue is empty again, tell whoever saw it above the watermark */
+    __atomic_store_n (&pool_state->wm_above, 0, __ATOMIC_RELAXED);
+    if (pool_state->wm_delivered) {
+        work_item deliver = { (task) watermark_deliver, pool_state };
+        timerq_schedule (&pool_state->timers, timerq_now (), deliver);
+    }
+    LS_MUTEX_LOCK (&pool_state->mutex_stop_continue,
+                   &pool_state->ls_stop_continue);
+    __atomic_store_n (&pool_state->stop, 0, __ATOMIC_RELEASE);
     pool_state->stopped_threads = 0;
-    pool_state->blocked_threads = pool_state->thread_num;
-    worklist_reset (pool_state->wl);
+    pool_state->blocked_threads = pool_state->nstarted;
+    /* the released workers meet at the barrier, lazy pools may have
+     * started more since it was set up; nobody is waiting on it now
+     */
+    if (pool_state->nstarted > 0 &&
+        pool_state->nstarted != pool_state->barrier_count) {
+        pthread_barrier_destroy (&pool_state->barrier_continue);
+        pthread_barrier_init (&pool_state->barrier_continue, NULL,
+                              pool_state->nstarted);
+        pool_state->barrier_count = pool_state->nstarted;
+    }
     DBG_PRINT (("Threads, continue working!\n"));
     pthread_mutex_unlock (&pool_state->mutex_stop_continue);
     pthread_cond_broadcast (&pool_state->cond_allow_go);
+    timerq_resume (&pool_state->timers);
+}
+
+/* Start the watchdog thread, at most once per pool */
+int hthpool_watchdog(struct hthpool* pool_state,
+                     const struct timespec* threshold,
+                     hthpool_watchdog_cb cb, void* ctx) {
+    struct hthpool_watchdog* wd = &pool_state->watchdog;
+    if (wd->started)
+        return STAT_AGAIN;
+    wd->threshold = threshold->tv_sec * 1000000000LL + threshold->tv_nsec;
+    wd->cb  = cb ? cb : watchdog_report;
+    wd->ctx = cb ? ctx : (void*) stderr;
+    wd->close = wd->dump = 0;
+    if (sem_init (&wd->sem, 0, 0))
+        return STAT_SYNC;
+    if (pthread_create (&wd->thread, NULL, watchdog_run, pool_state)) {
+        sem_destroy (&wd->sem);
+        return STAT_SYNC;
+    }
+    wd->started = 1;
+    return STAT_OK;
+}
+
+/* Run rounds of bulk-synchronous work on a running threadpool.
+ * Every worker thread takes one BSP task from the shared worklist and stays
+ * in it until the run ends, so the pool must not be stopped meanwhile.
+ * return:  rounds executed, or
+ *  STAT_ALLOC  cannot allocate the frontier worklists or round 0
+ *  STAT_EMPTY  the pool has no worker threads to run the rounds
+ */
+int hthpool_bsp_run(struct hthpool* pool_state, const work_item* items,
+                    size_t n, hthpool_bsp_step step) {
+    struct hthpool_bsp bsp;
+    worklist_attr attr;
+    work_item worker = { (task) bsp_run, pool_state };
+    size_t i;
+    int ret;
+
+    if (pool_state->thread_num == 0)
+        return STAT_EMPTY;
+    worklistattr_init (&attr);
+    worklistattr_setconcurrency (&attr, pool_state->thread_num);
+    worklistattr_settype (&attr, WL_CHUNKED);
+    if (worklist_init (&bsp.wl[0], 0, &attr))
+        return STAT_ALLOC;
+    if (worklist_init (&bsp.wl[1], 0, &attr)) {
+        worklist_destroy (&bsp.wl[0]);
+        return STAT_ALLOC;
+    }
+    for (i = 0; i < n; i++) {
+        if ((ret = worklist_add (&bsp.wl[0], items[i])) != STAT_OK) {
+            worklist_destroy (&bsp.wl[0]);
+            worklist_destroy (&bsp.wl[1]);
+            return ret;
+        }
+    }
+    bsp.cur = 0;
+    bsp.nthreads = bsp.count = pool_state->thread_num;
+    bsp.sense = 0;
+    bsp.done = bsp.exited = 0;
+    bsp.round = 0;
+    bsp.step = step;
+    pthread_mutex_init (&bsp.mutex_done, NULL);
+    pthread_cond_init (&bsp.cond_done, NULL);
+
+    /* every worker takes part in every round */
+    LS_MUTEX_LOCK (&pool_state->mutex_stop_continue,
+                   &pool_state->ls_stop_continue);
+    while (pool_state->nstarted < pool_state->thread_num)
+        pool_spawn (pool_state);
+    pthread_mutex_unlock (&pool_state->mutex_stop_continue);
+    pool_state->bsp = &bsp;
+    for (i = 0; i < (size_t) bsp.nthreads; i++)
+        hthpool_submit (pool_state, worker);
+    pthread_mutex_lock (&bsp.mutex_done);
+    while (bsp.exited != bsp.nthreads)
+        pthread_cond_wait (&bsp.cond_done, &bsp.mutex_done);
+    pthread_mutex_unlock (&bsp.mutex_done);
+    pool_state->bsp = NULL;
+
+    ret = (int) bsp.round;
+    pthread_mutex_destroy (&bsp.mutex_done);
+    pthread_cond_destroy (&bsp.cond_done);
+    worklist_destroy (&bsp.wl[0]);
+    worklist_destroy (&bsp.wl[1]);
+    return ret;
+}
+
+int hthpool_record_start(struct hthpool* pool_state, size_t max_entries) {
+    trace* tr;
+    if (pool_state->recording != NULL)
+        return STAT_AGAIN;
+    if ((tr = trace_create (max_entries)) == NULL)
+        return STAT_ALLOC;
+    __atomic_store_n (&pool_state->recording, tr, __ATOMIC_RELEASE);
+    return STAT_OK;
+}
+
+struct hthpool_trace* hthpool_record_stop(struct hthpool* pool_state) {
+    return (struct hthpool_trace*)
+        __atomic_exchange_n (&pool_state->recording, NULL, __ATOMIC_ACQ_REL);
+}
+
+int hthpool_trace_save(struct hthpool_trace* tr, FILE* out) {
+    return trace_save ((trace*) tr, out);
+}
+
+struct hthpool_trace* hthpool_trace_load(FILE* in) {
+    return (struct hthpool_trace*) trace_load (in);
+}
+
+void hthpool_trace_free(struct hthpool_trace* tr) {
+    trace_free ((trace*) tr);
+}
+
+/* Like `hthpool_bsp_run`, every worker takes one replay task from the
+ * shared worklist and stays in it until its part of the trace is done.
+ */
+int hthpool_replay_start(struct hthpool* pool_state, struct hthpool_trace* tr) {
+    struct hthpool_replay* rp;
+    work_item worker = { (task) replay_run, pool_state };
+    size_t i, n = trace_size ((trace*) tr);
+    if (pool_state->replay != NULL)
+        return STAT_AGAIN;
+    for (i = 0; i < n; i++)
+        if (((trace*) tr)->entries[i].worker >= pool_state->thread_num)
+            return STAT_FULL;
+    rp = (struct hthpool_replay*) malloc (sizeof(struct hthpool_replay));
+    if (rp == NULL)
+        return STAT_ALLOC;
+    if (replay_init (&rp->table, (trace*) tr)) {
+        free (rp);
+        return STAT_ALLOC;
+    }
+    rp->tr = (trace*) tr;
+    rp->next = 0;
+    rp->nthreads = pool_state->thread_num;
+    rp->entered = 0;
+    rp->exited = 0;
+    pthread_mutex_init (&rp->mutex_done, NULL);
+    pthread_cond_init (&rp->cond_done, NULL);
+
+    LS_MUTEX_LOCK (&pool_state->mutex_stop_continue,
+                   &pool_state->ls_stop_continue);
+    while (pool_state->nstarted < pool_state->thread_num)
+        pool_spawn (pool_state);
+    pthread_mutex_unlock (&pool_state->mutex_stop_continue);
+    __atomic_store_n (&pool_state->replay, rp, __ATOMIC_RELEASE);
+    for (i = 0; i < (size_t) rp->nthreads; i++)
+        hthpool_submit (pool_state, worker);
+    return STAT_OK;
+}
+
+void hthpool_replay_wait(struct hthpool* pool_state) {
+    struct hthpool_replay* rp = pool_state->replay;
+    if (rp == NULL)
+        return;
+    pthread_mutex_lock (&rp->mutex_done);
+    while (rp->exited != rp->nthreads)
+        pthread_cond_wait (&rp->cond_done, &rp->mutex_done);
+    pthread_mutex_unlock (&rp->mutex_done);
+    __atomic_store_n (&pool_state->replay, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_destroy (&rp->mutex_done);
+    pthread_cond_destroy (&rp->cond_done);
+    replay_destroy (&rp->table);
+    free (rp);
 }
 
 /* ------------------------------------------------------------------------
@@ -260,17 +1826,522 @@ void hthpool_continue(struct hthpool* pool_state) {
  * ------------------------------------------------------------------------
  */
 int hthpool_submit(struct hthpool* pool_state, work_item item) {
-    return worklist_add(pool_state->wl, item);
+    int ret = worklist_add(pool_state->wl, item);
+    pool_demand (pool_state);
+    return ret;
+}
+
+int hthpool_submit_prio(struct hthpool* pool_state, work_item item,
+                        long prio) {
+    int ret = worklist_add_prio(pool_state->wl, item, prio);
+    pool_demand (pool_state);
+    return ret;
+}
+
+int hthpool_submit_deadline(struct hthpool* pool_state, work_item item,
+                            const struct timespec* deadline) {
+    int ret = worklist_add_deadline(pool_state->wl, item, deadline);
+    pool_demand (pool_state);
+    return ret;
+}
+
+int hthpool_submit_id(struct hthpool* pool_state, work_item item,
+                      unsigned long id) {
+    struct hthpool_replay* rp;
+    struct hthpool_traced* traced;
+    struct replay_slot* slot;
+    work_item wrapped;
+    int ret;
+    rp = __atomic_load_n (&pool_state->replay, __ATOMIC_ACQUIRE);
+    if (rp != NULL && (slot = replay_find (&rp->table, id)) != NULL) {
+        /* its worker is waiting for it, or will be */
+        slot->item = item;
+        __atomic_store_n (&slot->ready, 1, __ATOMIC_RELEASE);
+        return STAT_OK;
+    }
+    if (__atomic_load_n (&pool_state->recording, __ATOMIC_ACQUIRE) == NULL)
+        return hthpool_submit (pool_state, item);
+    traced = (struct hthpool_traced*) malloc (sizeof(struct hthpool_traced));
+    if (traced == NULL)
+        return STAT_ALLOC;
+    traced->pool = pool_state;
+    traced->item = item;
+    traced->task = id;
+    wrapped.run = (task) traced_run;
+    wrapped.arg = traced;
+    ret = hthpool_submit (pool_state, wrapped);
+    if (ret != STAT_OK)
+        free (traced);
+    return ret;
+}
+
+int hthpool_submit_to(struct hthpool* pool_state, int worker,
+                      work_item item) {
+    int ret = STAT_OK;
+    if (worker < 0 || worker >= pool_state->thread_num)
+        return STAT_FULL;
+    /* lazy pools start the worker, and those before it */
+    if (worker >= __atomic_load_n (&pool_state->nstarted, __ATOMIC_ACQUIRE)) {
+        LS_MUTEX_LOCK (&pool_state->mutex_stop_continue,
+                       &pool_state->ls_stop_continue);
+        while (pool_state->nstarted <= worker && !pool_state->close)
+            pool_spawn (pool_state);
+        if (pool_state->nstarted <= worker)
+            ret = STAT_TERM;
+        pthread_mutex_unlock (&pool_state->mutex_stop_continue);
+    }
+    return ret == STAT_OK ? mail_put (pool_state, worker, item, 0) : ret;
+}
+
+int hthpool_submit_hint(struct hthpool* pool_state, int worker,
+                        work_item item) {
+    if (worker < 0 ||
+        worker >= __atomic_load_n (&pool_state->nstarted, __ATOMIC_ACQUIRE))
+        return hthpool_submit (pool_state, item);
+    return mail_put (pool_state, worker, item, 1);
+}
+
+static void lockstat_copy(hthpool_lockstat* to, const lockstat* from) {
+    int i;
+    to->acquired  = from->acquired;
+    to->contended = from->contended;
+    to->wait_ns   = from->wait_ns;
+    for (i = 0; i < HTHPOOL_LOCKSTAT_BUCKETS && i < LOCKSTAT_BUCKETS; i++)
+        to->wait_hist[i] = from->wait_hist[i];
+}
+
+void hthpool_getstats(struct hthpool* pool_state, hthpool_stats* stats) {
+    worklist_stats wstats;
+    lockstat ls[HTHPOOL_LOCKS];
+    struct hthpool_producer* prod;
+    struct hthpool_class* cls;
+    struct hthpool_sub* sub;
+    int i;
+    worklist_getstats (pool_state->wl, &wstats);
+    stats->deadline_missed  = wstats.deadline_missed;
+    stats->deadline_dropped = wstats.deadline_dropped;
+    LS_MUTEX_LOCK (&pool_state->mutex_stop_continue,
+                   &pool_state->ls_stop_continue);
+    stats->idle_trims = pool_state->idle_trims;
+    pthread_mutex_unlock (&pool_state->mutex_stop_continue);
+    stats->hints_stolen = __atomic_load_n (&pool_state->hints_stolen,
+                                           __ATOMIC_RELAXED);
+    stats->producer_dropped = __atomic_load_n (&pool_state->producer_dropped,
+                                               __ATOMIC_RELAXED);
+
+    for (i = 0; i < HTHPOOL_LOCKS; i++)
+        lockstat_init (ls + i);
+    worklist_getlockstats (pool_state->wl, ls + HTHPOOL_LOCK_HEAD,
+                           ls + HTHPOOL_LOCK_TAIL, ls + HTHPOOL_LOCK_BACKEND);
+    lockstat_add (ls + HTHPOOL_LOCK_STOP_CONTINUE,
+                  &pool_state->ls_stop_continue);
+    lockstat_add (ls + HTHPOOL_LOCK_RATE, &pool_state->ls_rate);
+    lockstat_add (ls + HTHPOOL_LOCK_RETRY, &pool_state->ls_retry);
+    /* a plain lock, reading the counters is not counted */
+    pthread_mutex_lock (&pool_state->mutex_producers);
+    lockstat_add (ls + HTHPOOL_LOCK_PRODUCERS, &pool_state->ls_producers);
+    lockstat_add (ls + HTHPOOL_LOCK_PRODUCER, &pool_state->ls_producer);
+    for (prod = pool_state->producers; prod != NULL; prod = prod->next)
+        lockstat_add (ls + HTHPOOL_LOCK_PRODUCER, &prod->ls);
+    pthread_mutex_unlock (&pool_state->mutex_producers);
+    cls = __atomic_load_n (&pool_state->classes, __ATOMIC_ACQUIRE);
+    for (; cls != NULL; cls = cls->next)
+        lockstat_add (ls + HTHPOOL_LOCK_CLASS, &cls->ls);
+    sub = __atomic_load_n (&pool_state->subs, __ATOMIC_ACQUIRE);
+    for (; sub != NULL; sub = sub->next)
+        lockstat_add (ls + HTHPOOL_LOCK_SUB, &sub->ls);
+    for (i = 0; i < pool_state->thread_num; i++)
+        lockstat_add (ls + HTHPOOL_LOCK_MAIL, &pool_state->mail[i].ls);
+    for (i = 0; i < HTHPOOL_LOCKS; i++)
+        lockstat_copy (stats->locks + i, ls + i);
+}
+
+const char* hthpool_lockname(int lock) {
+    static const char* names[HTHPOOL_LOCKS] = {
+        "mutex_head", "mutex_tail", "worklist backend", "mutex_stop_continue",
+        "mutex_rate", "mutex_retry", "mutex_producers", "producer",
+        "class", "sub", "mailbox"
+    };
+    return lock >= 0 && lock < HTHPOOL_LOCKS ? names[lock] : "unknown";
+}
+
+struct hthpool_tenant* hthpool_tenant_create(struct hthpool* pool_state,
+                                             const char* name,
+                                             unsigned weight,
+                                             size_t max_depth) {
+    return (struct hthpool_tenant*)
+        tsched_create (&pool_state->tenants, name, weight, max_depth);
+}
+
+struct hthpool_tenant* hthpool_tenant_find(struct hthpool* pool_state,
+                                           const char* name) {
+    return (struct hthpool_tenant*) tsched_find (&pool_state->tenants, name);
+}
+
+int hthpool_submit_tenant(struct hthpool* pool_state,
+                          struct hthpool_tenant* tenant, work_item item) {
+    work_item dispatch = { (task) tenant_dispatch, pool_state };
+    int ret = tsched_enqueue (&pool_state->tenants, (tenant_t*) tenant, item);
+    if (ret != STAT_OK)
+        return ret;
+    ret = worklist_add (pool_state->wl, dispatch);
+    /* no dispatch item for it: take the item back unless another
+     * dispatch item already ran it
+     */
+    if (ret != STAT_OK &&
+        !tsched_cancel (&pool_state->tenants, (tenant_t*) tenant, item))
+        ret = STAT_OK;
+    pool_demand (pool_state);
+    return ret;
+}
+
+struct hthpool_producer* hthpool_producer_create(struct hthpool* pool_state,
+                                                 size_t batch,
+                                                 const struct timespec* max_delay) {
+    struct hthpool_producer* prod;
+    prod = (struct hthpool_producer*) malloc (sizeof(struct hthpool_producer));
+    if (prod == NULL)
+        return NULL;
+    prod->batch = batch ? batch : 1;
+    prod->items = (work_item*) malloc (prod->batch * sizeof(work_item));
+    if (prod->items == NULL || pthread_mutex_init (&prod->lock, NULL)) {
+        free (prod->items);
+        free (prod);
+        return NULL;
+    }
+    prod->pool = pool_state;
+    lockstat_init (&prod->ls);
+    prod->n = 0;
+    prod->delay = max_delay ? max_delay->tv_sec * 1000000000LL +
+                              max_delay->tv_nsec : -1;
+    prod->armed = prod->closed = 0;
+    LS_MUTEX_LOCK (&pool_state->mutex_producers, &pool_state->ls_producers);
+    prod->prev = NULL;
+    prod->next = pool_state->producers;
+    if (prod->next)
+        prod->next->prev = prod;
+    pool_state->producers = prod;
+    pthread_mutex_unlock (&pool_state->mutex_producers);
+    return prod;
+}
+
+int hthpool_producer_submit(struct hthpool_producer* prod, work_item item) {
+    work_item expire = { (task) producer_expire, prod };
+    int ret = STAT_OK;
+    LS_MUTEX_LOCK (&prod->lock, &prod->ls);
+    prod->items[prod->n++] = item;
+    if (prod->n == prod->batch) {
+        ret = producer_flush_locked (prod);
+    } else if (prod->n == 1 && prod->delay >= 0 && !prod->armed) {
+        /* first item of a buffer, bound how long it may wait */
+        prod->armed = 1;
+        ret = timerq_schedule (&prod->pool->timers,
+                               timerq_now () + prod->delay, expire);
+        if (ret != STAT_OK)
+            prod->armed = 0;
+    }
+    pthread_mutex_unlock (&prod->lock);
+    return ret;
+}
+
+int hthpool_producer_flush(struct hthpool_producer* prod) {
+    int ret;
+    LS_MUTEX_LOCK (&prod->lock, &prod->ls);
+    ret = producer_flush_locked (prod);
+    pthread_mutex_unlock (&prod->lock);
+    return ret;
+}
+
+void hthpool_producer_destroy(struct hthpool_producer* prod) {
+    int armed;
+    LS_MUTEX_LOCK (&prod->lock, &prod->ls);
+    producer_flush_locked (prod);
+    armed = prod->armed;
+    prod->closed = 1;
+    pthread_mutex_unlock (&prod->lock);
+    if (!armed)
+        producer_free (prod);
+}
+
+struct hthpool_sub* hthpool_sub_create(struct hthpool* pool_state,
+                                       const char* name, unsigned share) {
+    struct hthpool_sub* sub;
+    sub = (struct hthpool_sub*) malloc (sizeof(struct hthpool_sub));
+    if (sub == NULL)
+        return NULL;
+    if (pthread_mutex_init (&sub->lock, NULL)) {
+        free (sub);
+        return NULL;
+    }
+    if (pthread_cond_init (&sub->cond_idle, NULL)) {
+        pthread_mutex_destroy (&sub->lock);
+        free (sub);
+        return NULL;
+    }
+    sub->tenant = tsched_create (&pool_state->tenants, name, share, 0);
+    if (sub->tenant == NULL) {
+        pthread_mutex_destroy (&sub->lock);
+        pthread_cond_destroy (&sub->cond_idle);
+        free (sub);
+        return NULL;
+    }
+    sub->pool = pool_state;
+    lockstat_init (&sub->ls);
+    sub->pending = 0;
+    sub->stopped = 0;
+    sub->tenant->owner = sub;
+    sub->next = __atomic_load_n (&pool_state->subs, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n (&pool_state->subs, &sub->next, sub,
+                                         1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    return sub;
+}
+
+int hthpool_sub_submit(struct hthpool_sub* sub, work_item item) {
+    struct hthpool* pool_state = sub->pool;
+    work_item dispatch = { (task) tenant_dispatch, pool_state };
+    int ret;
+    LS_MUTEX_LOCK (&sub->lock, &sub->ls);
+    if (sub->stopped) {
+        pthread_mutex_unlock (&sub->lock);
+        return STAT_TERM;
+    }
+    sub->pending++;
+    pthread_mutex_unlock (&sub->lock);
+    ret = tsched_enqueue (&pool_state->tenants, sub->tenant, item);
+    if (ret == STAT_OK) {
+        ret = worklist_add (pool_state->wl, dispatch);
+        /* as in `hthpool_submit_tenant` */
+        if (ret != STAT_OK &&
+            !tsched_cancel (&pool_state->tenants, sub->tenant, item))
+            ret = STAT_OK;
+    }
+    if (ret != STAT_OK)
+        sub_done (sub, 1);
+    pool_demand (pool_state);
+    return ret;
+}
+
+void hthpool_sub_stop(struct hthpool_sub* sub) {
+    LS_MUTEX_LOCK (&sub->lock, &sub->ls);
+    sub->stopped = 1;
+    pthread_mutex_unlock (&sub->lock);
+    /* their dispatch items stay queued and serve other tenants */
+    sub_done (sub, (long) tsched_drop (&sub->pool->tenants, sub->tenant));
+}
+
+void hthpool_sub_wait(struct hthpool_sub* sub) {
+    LS_MUTEX_LOCK (&sub->lock, &sub->ls);
+    while (sub->pending > 0)
+        pthread_cond_wait (&sub->cond_idle, &sub->lock);
+    pthread_mutex_unlock (&sub->lock);
+}
+
+void hthpool_sub_continue(struct hthpool_sub* sub) {
+    LS_MUTEX_LOCK (&sub->lock, &sub->ls);
+    sub->stopped = 0;
+    pthread_mutex_unlock (&sub->lock);
+}
+
+struct hthpool_class* hthpool_class_create(struct hthpool* pool_state,
+                                           int limit) {
+    struct hthpool_class* cls;
+    if (limit < 1)
+        return NULL;
+    cls = (struct hthpool_class*) malloc (sizeof(struct hthpool_class));
+    if (cls == NULL)
+        return NULL;
+    if (pthread_mutex_init (&cls->lock, NULL)) {
+        free (cls);
+        return NULL;
+    }
+    cls->pool = pool_state;
+    lockstat_init (&cls->ls);
+    ring_init (&cls->queue);
+    cls->limit = limit;
+    cls->running = cls->parked = 0;
+    cls->next = __atomic_load_n (&pool_state->classes, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n (&pool_state->classes, &cls->next, cls,
+                                         1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    return cls;
+}
+
+int hthpool_submit_class(struct hthpool* pool_state,
+                         struct hthpool_class* cls, work_item item) {
+    work_item dispatch = { (task) class_dispatch, cls };
+    int ret;
+    LS_MUTEX_LOCK (&cls->lock, &cls->ls);
+    ret = ring_push (&cls->queue, item);
+    pthread_mutex_unlock (&cls->lock);
+    if (ret != STAT_OK)
+        return ret;
+    ret = worklist_add (pool_state->wl, dispatch);
+    /* no dispatch item for it: take the item back unless another
+     * dispatch item already ran it
+     */
+    if (ret != STAT_OK) {
+        LS_MUTEX_LOCK (&cls->lock, &cls->ls);
+        if (!ring_remove (&cls->queue, item))
+            ret = STAT_OK;
+        pthread_mutex_unlock (&cls->lock);
+    }
+    pool_demand (pool_state);
+    return ret;
+}
+
+void hthpool_tenant_setrate(struct hthpool* pool_state,
+                            struct hthpool_tenant* tenant,
+                            double rate, double burst) {
+    tsched_setrate (&pool_state->tenants, (tenant_t*) tenant,
+                    rate, burst, timerq_now ());
+}
+
+void hthpool_setrate(struct hthpool* pool_state, double rate, double burst) {
+    LS_MUTEX_LOCK (&pool_state->mutex_rate, &pool_state->ls_rate);
+    ratelimit_init (&pool_state->rate, rate, burst, timerq_now ());
+    __atomic_store_n (&pool_state->rate_limited, rate > 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock (&pool_state->mutex_rate);
+}
+
+void hthpool_retryattr_init(hthpool_retryattr* attr) {
+    attr->max_attempts = 3;
+    attr->backoff = 10000000LL;
+    attr->max_backoff = 1000000000LL;
+    attr->on_failure = NULL;
+    attr->ctx = NULL;
+}
+
+void hthpool_retryattr_setattempts(hthpool_retryattr* attr, int max_attempts) {
+    attr->max_attempts = max_attempts;
+}
+
+void hthpool_retryattr_setbackoff(hthpool_retryattr* attr,
+                                  const struct timespec* backoff,
+                                  const struct timespec* max_backoff) {
+    attr->backoff = backoff->tv_sec * 1000000000LL + backoff->tv_nsec;
+    attr->max_backoff = max_backoff->tv_sec * 1000000000LL +
+                        max_backoff->tv_nsec;
+}
+
+void hthpool_retryattr_setcallback(hthpool_retryattr* attr,
+                                   hthpool_failure_cb on_failure, void* ctx) {
+    attr->on_failure = on_failure;
+    attr->ctx = ctx;
+}
+
+int hthpool_submit_retry(struct hthpool* pool_state, work_item item,
+                         const hthpool_retryattr* attr) {
+    struct hthpool_retry* job;
+    work_item dispatch;
+    int ret;
+    job = (struct hthpool_retry*) malloc (sizeof(struct hthpool_retry));
+    if (job == NULL)
+        return STAT_ALLOC;
+    job->pool = pool_state;
+    job->item = item;
+    if (attr)
+        job->attr = *attr;
+    else
+        hthpool_retryattr_init (&job->attr);
+    job->attempts = 0;
+    job->backoff = job->attr.backoff;
+    LS_MUTEX_LOCK (&pool_state->mutex_retry, &pool_state->ls_retry);
+    job->prev = NULL;
+    job->next = pool_state->retries;
+    if (job->next)
+        job->next->prev = job;
+    pool_state->retries = job;
+    pthread_mutex_unlock (&pool_state->mutex_retry);
+
+    dispatch.run = (task) retry_dispatch;
+    dispatch.arg = job;
+    ret = worklist_add (pool_state->wl, dispatch);
+    if (ret != STAT_OK) {
+        retry_unlink (pool_state, job);
+        free (job);
+    }
+    pool_demand (pool_state);
+    return ret;
+}
+
+void hthpool_task_fail(int status, void* error) {
+    task_result.failed = 1;
+    task_result.status = status;
+    task_result.error = error;
+}
+
+int hthpool_submit_at(struct hthpool* pool_state, work_item item,
+                      const struct timespec* when) {
+    return timerq_schedule (&pool_state->timers,
+                            when->tv_sec * 1000000000LL + when->tv_nsec,
+                            item);
+}
+
+void hthpool_tenant_getstats(struct hthpool* pool_state,
+                             struct hthpool_tenant* tenant,
+                             hthpool_tenant_stats* stats) {
+    tenant_stats tstats;
+    tsched_getstats (&pool_state->tenants, (tenant_t*) tenant, &tstats);
+    stats->submitted = tstats.submitted;
+    stats->rejected  = tstats.rejected;
+    stats->executed  = tstats.executed;
+    stats->depth     = tstats.depth;
+}
+
+void hthpool_dump(struct hthpool* pool_state, FILE* out) {
+    long long start, now = timerq_now ();
+    work_item item;
+    int i;
+    for (i = 0; i < pool_state->thread_num; i++) {
+        start = worker_current (&pool_state->workers[i], &item);
+        if (start == 0)
+            fprintf (out, "hthpool: worker %d idle\n", i);
+        else
+            fprintf (out, "hthpool: worker %d running %p(%p) for %.3fs\n",
+                     i, *(void**) &item.run, item.arg, (now - start) / 1e9);
+    }
+}
+
+void hthpool_dump_async(struct hthpool* pool_state) {
+    if (!pool_state->watchdog.started)
+        return;
+    __atomic_store_n (&pool_state->watchdog.dump, 1, __ATOMIC_RELEASE);
+    sem_post (&pool_state->watchdog.sem);
+}
+
+int hthpool_bsp_push(struct hthpool* pool_state, work_item item) {
+    struct hthpool_bsp* bsp = pool_state->bsp;
+    int cur = __atomic_load_n (&bsp->cur, __ATOMIC_RELAXED);
+    return worklist_add (&bsp->wl[!cur], item);
+}
+
+int hthpool_worker_id(void) {
+    return self_worker ? self_worker->id : -1;
+}
+
+int hthpool_worker_group(struct hthpool* pool_state, int worker) {
+    if (worker < 0 || worker >= pool_state->topo.n)
+        return -1;
+    return pool_state->topo.group[worker];
+}
+
+void hthpool_worker_setdata(int slot, void* data) {
+    self_worker->data[slot] = data;
+}
+
+void* hthpool_worker_getdata(int slot) {
+    return self_worker ? self_worker->data[slot] : NULL;
 }
 
 void hthpool_hard_stop(struct hthpool* pool_state) {
     DBG_PRINT (("Threads, immediately stop working!\n"));
-    pool_state->stop = 1;
+    __atomic_store_n (&pool_state->stop, 1, __ATOMIC_RELEASE);
     worklist_stop (pool_state->wl);
 }
 
 void hthpool_soft_stop(struct hthpool* pool_state) {
     DBG_PRINT (("Threads, please stop working.\n"));
-    pool_state->stop = 1;
+    __atomic_store_n (&pool_state->stop, 1, __ATOMIC_RELEASE);
 }
 
@@ -1,5 +1,8 @@
 #ifndef HTHPOOL_H_
 #define HTHPOOL_H_
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
 #include "common.h"
 
 #ifdef __cplusplus
@@ -7,6 +10,238 @@ extern "C" {
 #endif
     extern work_item _wl_empty_item;
     typedef struct hthpool* hthpool;
+    typedef struct hthpool_tenant* hthpool_tenant;
+    typedef struct hthpool_class* hthpool_class;
+    typedef struct hthpool_sub* hthpool_sub;
+    typedef struct hthpool_producer* hthpool_producer;
+    typedef struct hthpool_trace* hthpool_trace;
+
+    /* Worker start/exit hook, see `hthpoolattr_setworkerhooks` */
+    typedef void (*hthpool_worker_cb)(int worker_id, void* ctx);
+
+    /* user-data slots per worker, see `hthpool_worker_setdata` */
+#define HTHPOOL_WORKER_SLOTS 8
+
+    /* What a forked child does with the pool, see `hthpoolattr_setfork` */
+#define HTHPOOL_FORK_NONE       0
+#define HTHPOOL_FORK_DISCARD    1
+#define HTHPOOL_FORK_KEEP       2
+
+    /* Queue watermark callback, see `hthpoolattr_setwatermark` */
+    typedef void (*hthpool_watermark_cb)(void* ctx, int above, long depth);
+
+    /* Threadpool attributes, set them with the hthpoolattr_* functions.
+     * Defaults: a WL_FIFO worklist of 4094 items and no events.
+     */
+    typedef struct hthpool_attr {
+        int       wl_type;
+        size_t    wl_size;
+        int       wl_delta;
+        size_t    wl_factor;
+        int       wl_drop;
+        int       wl_sp, wl_sc;
+        int       wl_memflags;
+        int       lazy;
+        int       fork_mode;
+        long long idle_spin, idle_deep;
+        int       topology;
+        work_item empty_event, full_event;
+        long      wm_low, wm_high;
+        hthpool_watermark_cb wm_cb;
+        void*     wm_ctx;
+        hthpool_worker_cb on_worker_start, on_worker_exit;
+        void*     worker_ctx;
+    } hthpool_attr;
+
+    /* Lock contention counters, only kept when the library is built with
+     * -DHTHPOOL_LOCKSTAT. `wait_hist[0]` counts waits below 1us,
+     * `wait_hist[i]` waits in [2^(9+i), 2^(10+i)) ns, the last bucket
+     * everything longer.
+     */
+#define HTHPOOL_LOCKSTAT_BUCKETS 16
+    typedef struct hthpool_lockstat {
+        unsigned long       acquired;       /* all acquisitions */
+        unsigned long       contended;      /* had to wait */
+        unsigned long long  wait_ns;        /* total time waited */
+        unsigned long       wait_hist[HTHPOOL_LOCKSTAT_BUCKETS];
+    } hthpool_lockstat;
+
+    /* Locks of `hthpool_stats.locks`, name them with `hthpool_lockname` */
+#define HTHPOOL_LOCK_HEAD           0   /* worklist take side */
+#define HTHPOOL_LOCK_TAIL           1   /* worklist add side */
+#define HTHPOOL_LOCK_BACKEND        2   /* locks of non-ring worklists */
+#define HTHPOOL_LOCK_STOP_CONTINUE  3   /* stop/continue, lazy spawning */
+#define HTHPOOL_LOCK_RATE           4   /* pool-wide rate limit */
+#define HTHPOOL_LOCK_RETRY          5   /* list of retried tasks */
+#define HTHPOOL_LOCK_PRODUCERS      6   /* list of producers */
+#define HTHPOOL_LOCK_PRODUCER       7   /* producer buffers */
+#define HTHPOOL_LOCK_CLASS          8   /* task classes */
+#define HTHPOOL_LOCK_SUB            9   /* logical pools */
+#define HTHPOOL_LOCK_MAIL           10  /* worker mailboxes */
+#define HTHPOOL_LOCKS               11
+
+    /* Threadpool counters, read with `hthpool_getstats` */
+    typedef struct hthpool_stats {
+        size_t    deadline_missed;  /* WL_EDF: started after the deadline */
+        size_t    deadline_dropped; /* WL_EDF: dropped, see setdrop */
+        size_t    idle_trims;       /* deep idle periods, see setidle */
+        size_t    hints_stolen;     /* hinted items run by another worker */
+        size_t    producer_dropped; /* buffered items a stopped, full pool
+                                     * refused on flush */
+        /* per lock, locks of one kind (classes, heaps...) summed */
+        hthpool_lockstat locks[HTHPOOL_LOCKS];
+    } hthpool_stats;
+
+    /* Watchdog callback, see `hthpool_watchdog`. Runs on the watchdog
+     * thread with the worker index (0 .. size-1), its task and how long
+     * (ns) it has been running.
+     */
+    typedef void (*hthpool_watchdog_cb)(void* ctx, int worker,
+                                        work_item item, long long elapsed);
+
+    /* Called once a task submitted with `hthpool_submit_retry` gave up,
+     * with the status and error of its last `hthpool_task_fail` and the
+     * number of attempts made. Runs on the worker of the last attempt.
+     */
+    typedef void (*hthpool_failure_cb)(void* ctx, work_item item,
+                                       int status, void* error,
+                                       int attempts);
+
+    /* Retry policy, set it with the hthpool_retryattr_* functions.
+     * Defaults: 3 attempts, backoff from 10ms doubling up to 1s, no
+     * failure callback.
+     */
+    typedef struct hthpool_retryattr {
+        int       max_attempts;
+        long long backoff, max_backoff;     /* ns */
+        hthpool_failure_cb on_failure;
+        void*     ctx;
+    } hthpool_retryattr;
+
+    /* Per-tenant counters, read with `hthpool_tenant_getstats` */
+    typedef struct hthpool_tenant_stats {
+        size_t    submitted;        /* accepted submissions */
+        size_t    rejected;         /* refused, queue at max_depth */
+        size_t    executed;         /* dispatched to a worker */
+        size_t    depth;            /* currently queued */
+    } hthpool_tenant_stats;
+
+    extern void hthpoolattr_init(hthpool_attr* attr);
+
+    /* Worklist policy (WL_FIFO, WL_OBIM, WL_CHUNKED, WL_MULTIQUEUE or
+     * WL_EDF, see `common.h`) and its size. Only WL_FIFO is bounded, the others ignore
+     * `size`.
+     */
+    extern void hthpoolattr_setworklist(hthpool_attr* attr,
+                                        int type, size_t size);
+
+    /* WL_OBIM only: priorities agreeing except for the lowest `delta` bits
+     * share one bucket.
+     */
+    extern void hthpoolattr_setdelta(hthpool_attr* attr, int delta);
+
+    /* WL_MULTIQUEUE only: heaps per worker thread (relaxation factor),
+     * default 2. More heaps contend less but pop further from the minimum.
+     */
+    extern void hthpoolattr_setfactor(hthpool_attr* attr, size_t factor);
+
+    /* WL_EDF only: drop tasks whose deadline passed before they started,
+     * instead of running them late. Both are counted in the stats.
+     */
+    extern void hthpoolattr_setdrop(hthpool_attr* attr, int drop);
+
+    /* WL_FIFO only: declare that exactly one thread submits (`producer`),
+     * and/or, for pools of one worker, that one thread takes (`consumer`).
+     * Submission then publishes the ring index with a release store
+     * instead of taking the tail mutex. Tasks, the timer thread (submit_at,
+     * rate limits, retries), class/tenant dispatch and producer buffers all
+     * submit too: in single-producer mode only the declared thread may.
+     * Empty/full events are not raised.
+     */
+    extern void hthpoolattr_setsingle(hthpool_attr* attr,
+                                      int producer, int consumer);
+
+    /* WL_FIFO only: back the ring with mmap'ed memory, WL_MEM_* flags of
+     * `common.h`: huge pages (explicit or transparent), prefaulted at init
+     * and/or mlock'ed, so the first burst into a big ring takes no page
+     * faults. Huge pages and mlock fall back silently if refused.
+     */
+    extern void hthpoolattr_setmemory(hthpool_attr* attr, int memflags);
+
+    /* Start no worker threads at init, but one whenever work is submitted
+     * and no started worker is idle, up to the pool size. Short-lived
+     * pools then only pay for the threads they use. The empty event fires
+     * once every started worker waits for work.
+     */
+    extern void hthpoolattr_setlazy(hthpool_attr* attr, int lazy);
+
+    /* Idle ladder of the workers. A worker out of work first polls the
+     * worklist for `spin_ns` (low wake-up latency, burns a core), then
+     * sleeps in the worklist until the next submit. Once every started
+     * worker has slept for `deep_ns` without work, the last one to get
+     * there hands memory back to the system (`worklist_trim`, and
+     * `malloc_trim` with glibc) before all of them sleep on. The next
+     * submit wakes them as usual, the memory faults back in on use. An
+     * empty event fires again when the workers go from the timed to the
+     * untimed sleep. 0 turns a stage off, the default for both.
+     */
+    extern void hthpoolattr_setidle(hthpool_attr* attr, long long spin_ns,
+                                    long long deep_ns);
+
+    /* Place the workers by cache topology, read from sysfs at init (see
+     * `topo.h`). Worker i is pinned to the i-th CPU of the pool's affinity
+     * mask in package/L3 order, wrapping around when there are more
+     * workers than CPUs, so workers with neighbouring ids share an L3
+     * (a CCX on AMD). With WL_CHUNKED and WL_OBIM a worker out of work
+     * then steals from the workers of its L3 group first, then from its
+     * socket, then from anyone. Without cache topology in sysfs
+     * each package is one group. Default off.
+     */
+    extern void hthpoolattr_settopology(hthpool_attr* attr, int on);
+
+    /* Make the pool survive fork(). Around every fork the pool's locks are
+     * taken and released by `pthread_atfork` handlers, so the child never
+     * inherits a lock held by a thread it does not have. In the child:
+     *  HTHPOOL_FORK_DISCARD  queued and scheduled work is dropped and no
+     *                        thread is started; only `hthpool_destroy` may
+     *                        be called, and it returns at once.
+     *  HTHPOOL_FORK_KEEP     the workers, timer thread and watchdog are
+     *                        started again (lazy pools on demand) and run
+     *                        the work that was queued at the time of fork.
+     * Tasks running in the parent at that time are not run in the child.
+     * A child forked from inside a task leaves the pool when the task
+     * returns, its thread exits. Not allowed during `hthpool_bsp_run`.
+     * Default HTHPOOL_FORK_NONE: no handlers, the child must not use the
+     * pool.
+     */
+    extern void hthpoolattr_setfork(hthpool_attr* attr, int mode);
+
+    /* Empty & full events, see `hthpool_register` */
+    extern void hthpoolattr_setevent(hthpool_attr* attr,
+                                     work_item empty_task,
+                                     work_item full_task);
+
+    /* Call `cb(ctx, 1, depth)` once the number of queued items reaches
+     * `high`, then `cb(ctx, 0, depth)` once it is back at `low`, and so on
+     * (low < high), so producers can throttle before the queue fills up.
+     * Callbacks run on the pool's timer thread, never on a producer or with
+     * a queue lock held, and are coalesced: if the depth crosses back before
+     * a callback is delivered, neither is.
+     */
+    extern void hthpoolattr_setwatermark(hthpool_attr* attr,
+                                         long low, long high,
+                                         hthpool_watermark_cb cb, void* ctx);
+
+    /* Run `on_worker_start(worker_id, ctx)` on every worker thread before
+     * it takes its first task and `on_worker_exit(worker_id, ctx)` when it
+     * ends in `hthpool_destroy`, e.g. to set up per-thread allocators or
+     * connections with `hthpool_worker_setdata`. Either may be NULL.
+     */
+    extern void hthpoolattr_setworkerhooks(hthpool_attr* attr,
+                                           hthpool_worker_cb on_worker_start,
+                                           hthpool_worker_cb on_worker_exit,
+                                           void* ctx);
+
     /* Register events to execute when the threadpool is totally empty or full.
      * It must be called before hthpool_init, or, after hthpool_wait &
      * before hthpool_continue.
@@ -16,6 +251,8 @@ extern "C" {
      * Similarly, `totally full` means the queue is full and all threads keep
      * adding new work items into the queue. The `full_task` will be executed
      * by the last thread trying to add the task (before it stucks).
+     * Events run without any worklist lock held. Only WL_FIFO is ever full;
+     * to react before the queue fills, see `hthpoolattr_setwatermark`.
      */
     extern void hthpool_register(struct hthpool* pool_state,
                                  work_item empty_task,
@@ -29,6 +266,9 @@ extern "C" {
      */
     extern hthpool hthpool_init(int size, work_item etask, work_item ftask);
 
+    /* Same as `hthpool_init`, configured by `attr` */
+    extern hthpool hthpool_init_attr(int size, const hthpool_attr* attr);
+
     /* Join threads, deallocate the worklist & destroy sync vars
      * It must be called after `hthpool_wait`
      * return: void
@@ -43,6 +283,349 @@ extern "C" {
      */
     extern int  hthpool_submit(struct hthpool* pool_state, work_item);
 
+    /* It can be called by either the main thread or worker thread
+     * Submit a work item with an integer priority, lower runs first.
+     * With a WL_OBIM worklist the order is approximate: workers keep
+     * draining their current priority bucket until it is empty or they
+     * push to a lower one themselves. WL_MULTIQUEUE takes the better of
+     * two random heaps. Other worklists ignore `prio`.
+     */
+    extern int  hthpool_submit_prio(struct hthpool* pool_state, work_item,
+                                    long prio);
+
+    /* It can be called by either the main thread or worker thread
+     * Submit a work item with an absolute CLOCK_MONOTONIC deadline. With a
+     * WL_EDF worklist the nearest deadline runs first and tasks submitted
+     * without a deadline run last. Other worklists ignore `deadline`.
+     */
+    extern int  hthpool_submit_deadline(struct hthpool* pool_state,
+                                        work_item,
+                                        const struct timespec* deadline);
+
+    /* It can be called by either the main thread or worker thread
+     * Read a snapshot of the threadpool counters.
+     */
+    extern void hthpool_getstats(struct hthpool* pool_state,
+                                 hthpool_stats* stats);
+
+    /* Name of a HTHPOOL_LOCK_* index, for reports */
+    extern const char* hthpool_lockname(int lock);
+
+    /* It can be called by either the main thread or worker thread
+     * Create a named submission queue (tenant). Workers pick among tenant
+     * queues by deficit round robin weighted by `weight`, so a burst of one
+     * tenant cannot starve the others. At most `max_depth` items may be
+     * queued (0: no limit). Tenants live until `hthpool_destroy`.
+     * return:  the tenant, or NULL if out of memory
+     */
+    extern hthpool_tenant hthpool_tenant_create(struct hthpool* pool_state,
+                                                const char* name,
+                                                unsigned weight,
+                                                size_t max_depth);
+
+    /* It can be called by either the main thread or worker thread
+     * Look up a tenant by name, NULL if there is none.
+     */
+    extern hthpool_tenant hthpool_tenant_find(struct hthpool* pool_state,
+                                              const char* name);
+
+    /* It can be called by either the main thread or worker thread
+     * Submit a work item on behalf of a tenant.
+     * return:
+     *  0       success
+     *  -5      the tenant queue is at its max_depth, item not queued
+     *  other   the pool is stopped or out of memory, item not queued
+     */
+    extern int  hthpool_submit_tenant(struct hthpool* pool_state,
+                                      hthpool_tenant tenant, work_item);
+
+    /* It can be called by either the main thread or worker thread
+     * Limit a tenant to `rate` tasks per second with bursts of up to
+     * `burst`. When a worker would pick an item of a tenant without a
+     * token, the tenant is skipped; if no other tenant has work, the
+     * dispatch is handed to the timer thread until the next token is due.
+     * No worker sleeps. A zero rate removes the limit.
+     */
+    extern void hthpool_tenant_setrate(struct hthpool* pool_state,
+                                       hthpool_tenant tenant,
+                                       double rate, double burst);
+
+    /* It can be called by either the main thread or worker thread
+     * Read a snapshot of the tenant counters.
+     */
+    extern void hthpool_tenant_getstats(struct hthpool* pool_state,
+                                        hthpool_tenant tenant,
+                                        hthpool_tenant_stats* stats);
+
+    /* It can be called by any thread, the producer belongs to that thread
+     * Create a submission buffer for one hot producer thread. Items given
+     * to `hthpool_producer_submit` are collected and added to the pool in
+     * one batch, taking the queue lock once, when `batch` items are
+     * buffered, on `hthpool_producer_flush`, or at the latest `max_delay`
+     * after the first buffered item (NULL: no time bound). Bigger batches
+     * contend less, shorter delays bound the added latency.
+     * return:  the producer, or NULL if out of memory
+     */
+    extern hthpool_producer hthpool_producer_create(struct hthpool* pool_state,
+                                                    size_t batch,
+                                                    const struct timespec* max_delay);
+
+    /* It can only be called by the thread owning the producer
+     * Buffer a work item, flushing the buffer if it is full.
+     * return: STAT_OK, or the error of the flush or of scheduling its
+     *  time bound. Items a stopped pool refuses with STAT_TERM are dropped
+     *  and counted in `hthpool_stats.producer_dropped`.
+     */
+    extern int  hthpool_producer_submit(hthpool_producer prod, work_item);
+
+    /* It can only be called by the thread owning the producer
+     * Add all buffered items to the pool now.
+     * return: STAT_OK, or STAT_TERM if a stopped, full pool refused some,
+     *  see `hthpool_producer_submit`
+     */
+    extern int  hthpool_producer_flush(hthpool_producer prod);
+
+    /* It can only be called by the thread owning the producer
+     * Flush and release the producer, before `hthpool_destroy`.
+     */
+    extern void hthpool_producer_destroy(hthpool_producer prod);
+
+    /* It can be called by either the main thread or worker thread
+     * Create a logical pool (one per subsystem) served by the worker
+     * threads of `pool`, so several subsystems share one set of threads
+     * sized to the machine instead of each oversubscribing it. Logical
+     * pools are tenants of `pool`: workers pick among them by deficit round
+     * robin weighted by `share`. They live until `hthpool_destroy`.
+     * return:  the logical pool, or NULL if out of memory
+     */
+    extern hthpool_sub hthpool_sub_create(struct hthpool* pool_state,
+                                          const char* name, unsigned share);
+
+    /* It can be called by either the main thread or worker thread
+     * Submit a work item to a logical pool.
+     * return:
+     *  0       success
+     *  -3      the logical pool is stopped
+     */
+    extern int  hthpool_sub_submit(hthpool_sub sub, work_item);
+
+    /* It can be called by any thread but the workers
+     * Stop a logical pool: queued items are dropped, new submissions are
+     * refused until `hthpool_sub_continue`. Running items finish; the
+     * shared pool and the other logical pools are not affected.
+     */
+    extern void hthpool_sub_stop(hthpool_sub sub);
+
+    /* It can be called by any thread but the workers
+     * Wait until every item submitted to the logical pool has finished or
+     * was dropped, stopped or not.
+     */
+    extern void hthpool_sub_wait(hthpool_sub sub);
+
+    /* It can be called by any thread but the workers
+     * Accept submissions again after `hthpool_sub_stop`.
+     */
+    extern void hthpool_sub_continue(hthpool_sub sub);
+
+    /* It can be called by either the main thread or worker thread
+     * Create a task class of which at most `limit` tasks run at a time,
+     * e.g. tasks sharing a connection pool of `limit` connections. Classes
+     * live until `hthpool_destroy`.
+     * return:  the class, or NULL if `limit` < 1 or out of memory
+     */
+    extern hthpool_class hthpool_class_create(struct hthpool* pool_state,
+                                              int limit);
+
+    /* It can be called by either the main thread or worker thread
+     * Submit a work item of a class. A worker that takes it while the class
+     * is at its limit does not block: it defers the item until a running
+     * task of the class finishes, and picks other work meanwhile.
+     * return: 0, or the pool is stopped or out of memory, item not queued
+     */
+    extern int  hthpool_submit_class(struct hthpool* pool_state,
+                                     hthpool_class cls, work_item);
+
+    /* It can be called by either the main thread or worker thread
+     * Limit the whole pool to `rate` tasks per second with bursts of up to
+     * `burst`. Workers check the limit after taking an item: an item over
+     * the limit reserves the next token and is resubmitted through the
+     * timer thread when it is due, behind the items deferred before it;
+     * the worker goes on with the next item. Items of `hthpool_submit_to`
+     * come back to their worker, in order. A zero rate removes the limit.
+     */
+    extern void hthpool_setrate(struct hthpool* pool_state,
+                                double rate, double burst);
+
+    extern void hthpool_retryattr_init(hthpool_retryattr* attr);
+
+    /* Attempts in total, including the first one */
+    extern void hthpool_retryattr_setattempts(hthpool_retryattr* attr,
+                                              int max_attempts);
+
+    /* Wait `backoff` before the first retry, doubling per retry up to
+     * `max_backoff`.
+     */
+    extern void hthpool_retryattr_setbackoff(hthpool_retryattr* attr,
+                                             const struct timespec* backoff,
+                                             const struct timespec* max_backoff);
+
+    extern void hthpool_retryattr_setcallback(hthpool_retryattr* attr,
+                                              hthpool_failure_cb on_failure,
+                                              void* ctx);
+
+    /* It can be called by either the main thread or worker thread
+     * Submit a work item which may fail. The task reports failure by
+     * calling `hthpool_task_fail` before it returns; the pool then
+     * resubmits it through the timer thread after the backoff of `attr`
+     * (NULL for defaults), until an attempt succeeds or `max_attempts` are
+     * used up, and reports the last failure to the callback.
+     * return:
+     *  0       success
+     *  -2      cannot allocate the retry state
+     */
+    extern int  hthpool_submit_retry(struct hthpool* pool_state, work_item,
+                                     const hthpool_retryattr* attr);
+
+    /* It can only be called by a task, for the task itself
+     * Mark the running attempt failed with a status code and an error
+     * value which are passed on to the failure callback. With status
+     * STAT_TERM the failure is permanent and the task is not retried.
+     * Has no effect on tasks not submitted with `hthpool_submit_retry`.
+     */
+    extern void hthpool_task_fail(int status, void* error);
+
+    /* It can be called by either the main thread or worker thread
+     * Submit a work item at an absolute CLOCK_MONOTONIC time. The pool's
+     * timer thread (started on first use) submits it when it is due.
+     */
+    extern int  hthpool_submit_at(struct hthpool* pool_state, work_item,
+                                  const struct timespec* when);
+
+    /* It can be called by either the main thread or worker thread
+     * Submit a work item with a task id, unique within a recording, that
+     * identifies it across runs. While recording, every time a worker
+     * takes such an item the (sequence, worker, id) triple is logged; in a
+     * replay the item runs on the worker and in the order of the trace.
+     * Otherwise it is `hthpool_submit`.
+     */
+    extern int  hthpool_submit_id(struct hthpool* pool_state, work_item,
+                                  unsigned long id);
+
+    /* It can be called by either the main thread or worker thread
+     * Submit a work item to the mailbox of worker `worker` (0 .. size-1,
+     * see `hthpool_worker_id`). A worker takes from its mailbox before the
+     * shared worklist, and a sleeping worker is woken for its mail.
+     * `hthpool_submit_to` binds the item: only that worker runs it, in
+     * submission order, and a lazy pool starts it if need be.
+     * `hthpool_submit_hint` only prefers it: another worker runs the item
+     * if it gets there first, which idle ones do when the preferred worker
+     * is busy. Hinting a worker that does not exist (yet) is
+     * `hthpool_submit`. Mail left at `hthpool_continue` is dropped with the
+     * rest of the queued work.
+     * return:
+     *  STAT_OK     success
+     *  STAT_FULL   `worker` out of range (`hthpool_submit_to` only)
+     *  STAT_ALLOC  cannot grow the mailbox
+     */
+    extern int  hthpool_submit_to(struct hthpool* pool_state, int worker,
+                                  work_item);
+    extern int  hthpool_submit_hint(struct hthpool* pool_state, int worker,
+                                    work_item);
+
+    /* It should only be called by the main thread
+     * Start logging the dequeue order of `hthpool_submit_id` tasks, at most
+     * `max_entries` of them. Logging costs one atomic increment per task;
+     * while recording, every such task is also wrapped in a small
+     * allocation to carry its id through the worklist.
+     * return:
+     *  STAT_OK     success
+     *  STAT_AGAIN  already recording
+     *  STAT_ALLOC  cannot allocate the trace
+     */
+    extern int  hthpool_record_start(struct hthpool* pool_state,
+                                     size_t max_entries);
+
+    /* It should only be called by the main thread, once the recorded tasks
+     * have run (e.g. after `hthpool_wait`)
+     * Stop recording and hand over the trace, NULL if not recording.
+     */
+    extern hthpool_trace hthpool_record_stop(struct hthpool* pool_state);
+
+    /* Save/load a trace as text, one "seq worker id" line per dequeue.
+     * save returns STAT_OK or STAT_SYNC on a write error, load returns
+     * NULL on a read or format error.
+     */
+    extern int  hthpool_trace_save(hthpool_trace tr, FILE* out);
+    extern hthpool_trace hthpool_trace_load(FILE* in);
+    extern void hthpool_trace_free(hthpool_trace tr);
+
+    /* It should only be called by the main thread, on an idle pool
+     * Replay `tr`: every worker takes the `hthpool_submit_id` tasks the
+     * trace assigns to it, in the global sequence of the trace, waiting
+     * (spinning, then yielding) for its turn and for the task to be
+     * submitted. Other tasks run only on workers done with the trace, so
+     * tasks that replayed tasks wait for must be submitted with an id too.
+     * `tr` must outlive the replay.
+     * return:
+     *  STAT_OK     success
+     *  STAT_AGAIN  a replay is in progress
+     *  STAT_FULL   the trace uses more workers than the pool has
+     *  STAT_ALLOC  cannot allocate the replay state
+     */
+    extern int  hthpool_replay_start(struct hthpool* pool_state,
+                                     hthpool_trace tr);
+
+    /* It should only be called by the main thread
+     * Wait until every task of the trace has been taken, then end the
+     * replay.
+     */
+    extern void hthpool_replay_wait(struct hthpool* pool_state);
+
+    /* Bulk-synchronous mode: called between rounds by one worker thread
+     * with the number of the round just finished. Return 0 to stop early.
+     */
+    typedef int (*hthpool_bsp_step)(size_t round);
+
+    /* Main thread runs `items` as round 0, then every round runs the items
+     * pushed with `hthpool_bsp_push` during the previous one, until a round
+     * pushes nothing or `step` (may be NULL) returns 0. Rounds are separated
+     * by a barrier of the worker threads; the worklists are swapped there,
+     * the pool is not stopped. The pool must be running and must not be
+     * stopped until this returns.
+     * return:  the number of rounds, or
+     *  -2      cannot allocate the frontier worklists or round 0
+     *  -4      the pool has no worker threads (size 0)
+     */
+    extern int  hthpool_bsp_run(struct hthpool* pool_state,
+                                const work_item* items, size_t n,
+                                hthpool_bsp_step step);
+
+    /* It can only be called by tasks run by `hthpool_bsp_run`
+     * Add a work item to the frontier of the next round.
+     */
+    extern int  hthpool_bsp_push(struct hthpool* pool_state, work_item);
+
+    /* It can be called by any thread
+     * Index of the calling worker thread in its pool, 0 .. size-1, or -1
+     * if the caller is not a worker. Tasks can use it to index preallocated
+     * per-thread state.
+     */
+    extern int  hthpool_worker_id(void);
+
+    /* It can be called by any thread
+     * L3 group of worker `worker` with `hthpoolattr_settopology`, numbered
+     * from 0 in CPU order; -1 without topology or if there is no such worker.
+     */
+    extern int  hthpool_worker_group(struct hthpool* pool_state, int worker);
+
+    /* It can only be called by worker threads (tasks and worker hooks)
+     * Set/get user-data slot `slot` (0 .. HTHPOOL_WORKER_SLOTS-1) of the
+     * calling worker. Slots start out NULL; getdata returns NULL outside
+     * the pool.
+     */
+    extern void  hthpool_worker_setdata(int slot, void* data);
+    extern void* hthpool_worker_getdata(int slot);
+
     /* It can be called by either the main thread or worker thread
      * Stop worker threads (but not join them);
      *  - Worker threads which are executing tasks may be interrupted and
@@ -60,6 +643,31 @@ extern "C" {
      */
     extern void hthpool_soft_stop(struct hthpool* pool_state);
 
+    /* It should only be called by the main thread, at most once per pool
+     * Start a watchdog thread reporting every task which has been running
+     * longer than `threshold` through `cb`, once per task. With a NULL `cb`
+     * reports go to stderr. The watchdog lives until `hthpool_destroy`.
+     * return:
+     *  STAT_OK     success
+     *  STAT_AGAIN  the watchdog is already running
+     *  STAT_SYNC   cannot create the watchdog thread
+     */
+    extern int  hthpool_watchdog(struct hthpool* pool_state,
+                                 const struct timespec* threshold,
+                                 hthpool_watchdog_cb cb, void* ctx);
+
+    /* It can be called by any thread
+     * Print the current task of every worker and how long it has been
+     * running, or `idle`.
+     */
+    extern void hthpool_dump(struct hthpool* pool_state, FILE* out);
+
+    /* Async-signal-safe, e.g. for a SIGUSR1 handler
+     * Ask the watchdog thread to `hthpool_dump` to stderr. Does nothing
+     * unless `hthpool_watchdog` was started.
+     */
+    extern void hthpool_dump_async(struct hthpool* pool_state);
+
     /* Main thread waits until all threads are stopped
      * (either caused by hard_stop or soft_stop)
      */
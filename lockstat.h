@@ -0,0 +1,119 @@
+#ifndef LOCKSTAT_H_
+#define LOCKSTAT_H_
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Lock contention counters, kept when built with -DHTHPOOL_LOCKSTAT.
+ * Counters sit next to their lock and are updated by the thread holding
+ * it, so counting adds no shared cache line of its own; readers load them
+ * relaxed and may see a slightly stale snapshot. Re-acquisitions inside
+ * pthread_cond_wait are not counted.
+ * `wait_hist[0]` counts contended waits below 1us, `wait_hist[i]` waits in
+ * [2^(9+i), 2^(10+i)) ns, the last bucket everything from ~16ms on.
+ */
+#define LOCKSTAT_BUCKETS 16
+
+typedef struct lockstat {
+    unsigned long       acquired;       /* all acquisitions */
+    unsigned long       contended;      /* had to wait */
+    unsigned long long  wait_ns;        /* total time waited */
+    unsigned long       wait_hist[LOCKSTAT_BUCKETS];
+} lockstat;
+
+static inline void lockstat_init(lockstat* ls) {
+    memset (ls, 0, sizeof(lockstat));
+}
+
+/* sum of `from` into `to` */
+static inline void lockstat_add(lockstat* to, const lockstat* from) {
+    int i;
+    to->acquired  += __atomic_load_n (&from->acquired, __ATOMIC_RELAXED);
+    to->contended += __atomic_load_n (&from->contended, __ATOMIC_RELAXED);
+    to->wait_ns   += __atomic_load_n (&from->wait_ns, __ATOMIC_RELAXED);
+    for (i = 0; i < LOCKSTAT_BUCKETS; i++)
+        to->wait_hist[i] += __atomic_load_n (&from->wait_hist[i],
+                                             __ATOMIC_RELAXED);
+}
+
+#ifdef HTHPOOL_LOCKSTAT
+
+static inline long long lockstat_now(void) {
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* `shared`: the lock may be held by several threads (read locks) */
+static inline void lockstat_count(lockstat* ls, long long wait, int shared) {
+    int b = 0;
+    if (shared) {
+        __atomic_add_fetch (&ls->acquired, 1, __ATOMIC_RELAXED);
+        if (wait < 0)
+            return;
+        __atomic_add_fetch (&ls->contended, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch (&ls->wait_ns, wait, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n (&ls->acquired, ls->acquired + 1, __ATOMIC_RELAXED);
+        if (wait < 0)
+            return;
+        __atomic_store_n (&ls->contended, ls->contended + 1,
+                          __ATOMIC_RELAXED);
+        __atomic_store_n (&ls->wait_ns, ls->wait_ns + wait, __ATOMIC_RELAXED);
+    }
+    for (wait >>= 10; wait && b < LOCKSTAT_BUCKETS - 1; wait >>= 1)
+        b++;
+    if (shared)
+        __atomic_add_fetch (&ls->wait_hist[b], 1, __ATOMIC_RELAXED);
+    else
+        __atomic_store_n (&ls->wait_hist[b], ls->wait_hist[b] + 1,
+                          __ATOMIC_RELAXED);
+}
+
+/* Try first; only a failed try is timed and counted as contended */
+#define LOCKSTAT_ACQUIRE(trylock, lock, lk, ls, shared)                 \
+    do {                                                                \
+        long long _t0;                                                  \
+        if (trylock (lk) == 0) {                                        \
+            lockstat_count ((ls), -1, (shared));                        \
+        } else {                                                        \
+            _t0 = lockstat_now ();                                      \
+            lock (lk);                                                  \
+            lockstat_count ((ls), lockstat_now () - _t0, (shared));     \
+        }                                                               \
+    } while (0)
+
+# define LS_MUTEX_LOCK(m, ls)                                           \
+    LOCKSTAT_ACQUIRE (pthread_mutex_trylock, pthread_mutex_lock, m, ls, 0)
+# define LS_SPIN_LOCK(s, ls)                                            \
+    LOCKSTAT_ACQUIRE (pthread_spin_trylock, pthread_spin_lock, s, ls, 0)
+# define LS_RDLOCK(rw, ls)                                              \
+    LOCKSTAT_ACQUIRE (pthread_rwlock_tryrdlock, pthread_rwlock_rdlock,  \
+                      rw, ls, 1)
+# define LS_WRLOCK(rw, ls)                                              \
+    LOCKSTAT_ACQUIRE (pthread_rwlock_trywrlock, pthread_rwlock_wrlock,  \
+                      rw, ls, 0)
+/* only successful tries are counted */
+# define LS_MUTEX_TRYLOCK(m, ls)                                        \
+    (pthread_mutex_trylock (m) ? 1 : (lockstat_count ((ls), -1, 0), 0))
+
+#else
+
+/* `ls` is still evaluated, so a counter passed down stays used */
+# define LS_MUTEX_LOCK(m, ls)       ((void) (ls), pthread_mutex_lock (m))
+# define LS_SPIN_LOCK(s, ls)        ((void) (ls), pthread_spin_lock (s))
+# define LS_RDLOCK(rw, ls)          ((void) (ls), pthread_rwlock_rdlock (rw))
+# define LS_WRLOCK(rw, ls)          ((void) (ls), pthread_rwlock_wrlock (rw))
+# define LS_MUTEX_TRYLOCK(m, ls)    ((void) (ls), pthread_mutex_trylock (m))
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
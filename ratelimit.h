@@ -0,0 +1,67 @@
+#ifndef RATELIMIT_H_
+#define RATELIMIT_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Token bucket: `rate` tokens per second, at most `burst` saved up.
+ * Internal to the library, not thread-safe: callers hold their own lock.
+ * A zero rate means unlimited.
+ */
+struct ratelimit {
+    double    rate, burst;
+    double    tokens;
+    long long last;     /* ns, CLOCK_MONOTONIC */
+};
+
+static inline void ratelimit_init(struct ratelimit* rl, double rate,
+                                  double burst, long long now) {
+    rl->rate = rate;
+    rl->burst = burst < 1 ? 1 : burst;
+    rl->tokens = rl->burst;
+    rl->last = now;
+}
+
+/* take one token at `now` (ns): return 0 on success, otherwise the ns to
+ * wait until a token is available
+ */
+static inline long long ratelimit_take(struct ratelimit* rl, long long now) {
+    if (rl->rate <= 0)
+        return 0;
+    if (now > rl->last) {
+        rl->tokens += (now - rl->last) * 1e-9 * rl->rate;
+        if (rl->tokens > rl->burst)
+            rl->tokens = rl->burst;
+        rl->last = now;
+    }
+    if (rl->tokens >= 1) {
+        rl->tokens -= 1;
+        return 0;
+    }
+    return (long long) ((1 - rl->tokens) / rl->rate * 1e9) + 1;
+}
+
+/* Take one token at `now` (ns) even if it is not there yet: the bucket
+ * goes into debt, so the next caller waits behind this one.
+ * return: 0 if the token was available, otherwise the ns until it is due
+ */
+static inline long long ratelimit_reserve(struct ratelimit* rl,
+                                          long long now) {
+    long long wait = ratelimit_take (rl, now);
+    if (wait)
+        rl->tokens -= 1;
+    return wait;
+}
+
+/* forget the debt of reservations that were given up */
+static inline void ratelimit_forgive(struct ratelimit* rl) {
+    if (rl->tokens < 0)
+        rl->tokens = 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
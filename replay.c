@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include <string.h>
+#include "replay.h"
+
+/* -----------------------------------------------------------------------
+ * Dequeue traces and the task table of a replay.
+ * For a summary of declarations, see `replay.h`
+ * -----------------------------------------------------------------------
+ */
+trace* trace_create(size_t cap) {
+    trace* tr = (trace*) malloc (sizeof(trace));
+    if (tr == NULL)
+        return NULL;
+    tr->entries = (trace_entry*) malloc ((cap ? cap : 1) * sizeof(trace_entry));
+    if (tr->entries == NULL) {
+        free (tr);
+        return NULL;
+    }
+    tr->n = 0;
+    tr->cap = cap;
+    return tr;
+}
+
+void trace_free(trace* tr) {
+    if (tr == NULL)
+        return;
+    free (tr->entries);
+    free (tr);
+}
+
+void trace_record(trace* tr, int worker, unsigned long task) {
+    size_t seq = __atomic_fetch_add (&tr->n, 1, __ATOMIC_RELAXED);
+    if (seq < tr->cap) {
+        tr->entries[seq].seq = seq;
+        tr->entries[seq].task = task;
+        tr->entries[seq].worker = worker;
+    }
+}
+
+size_t trace_size(const trace* tr) {
+    size_t n = __atomic_load_n (&tr->n, __ATOMIC_RELAXED);
+    return n < tr->cap ? n : tr->cap;
+}
+
+int trace_save(const trace* tr, FILE* out) {
+    size_t i, n = trace_size (tr);
+    for (i = 0; i < n; i++)
+        if (fprintf (out, "%lu %d %lu\n", tr->entries[i].seq,
+                     tr->entries[i].worker, tr->entries[i].task) < 0)
+            return STAT_SYNC;
+    return fflush (out) ? STAT_SYNC : STAT_OK;
+}
+
+trace* trace_load(FILE* in) {
+    trace* tr = trace_create (1024);
+    trace_entry e, *entries;
+    int ret;
+    if (tr == NULL)
+        return NULL;
+    while ((ret = fscanf (in, "%lu %d %lu", &e.seq, &e.worker, &e.task)) == 3) {
+        if (e.seq != tr->n || e.worker < 0)
+            break;
+        if (tr->n == tr->cap) {
+            entries = (trace_entry*) realloc (tr->entries,
+                                              2 * tr->cap * sizeof(trace_entry));
+            if (entries == NULL)
+                break;
+            tr->entries = entries;
+            tr->cap *= 2;
+        }
+        tr->entries[tr->n++] = e;
+    }
+    if (ret != EOF || ferror (in)) {
+        trace_free (tr);
+        return NULL;
+    }
+    return tr;
+}
+
+/* open addressing, linear probing; the table is at most half full */
+static inline size_t replay_hash(unsigned long task, size_t mask) {
+    return (size_t) ((task * 0x9e3779b97f4a7c15ULL) >> 17) & mask;
+}
+
+int replay_init(replay_table* rt, const trace* tr) {
+    size_t i, h, n = trace_size (tr), size = 16;
+    while (size < 2 * n)
+        size *= 2;
+    rt->slots = (struct replay_slot*) calloc (size, sizeof(struct replay_slot));
+    if (rt->slots == NULL)
+        return STAT_ALLOC;
+    rt->mask = size - 1;
+    for (i = 0; i < n; i++) {
+        h = replay_hash (tr->entries[i].task, rt->mask);
+        while (rt->slots[h].used && rt->slots[h].task != tr->entries[i].task)
+            h = (h + 1) & rt->mask;
+        rt->slots[h].used = 1;
+        rt->slots[h].task = tr->entries[i].task;
+    }
+    return STAT_OK;
+}
+
+void replay_destroy(replay_table* rt) {
+    free (rt->slots);
+    rt->slots = NULL;
+}
+
+struct replay_slot* replay_find(replay_table* rt, unsigned long task) {
+    size_t h = replay_hash (task, rt->mask);
+    while (rt->slots[h].used) {
+        if (rt->slots[h].task == task)
+            return rt->slots + h;
+        h = (h + 1) & rt->mask;
+    }
+    return NULL;
+}
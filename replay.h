@@ -0,0 +1,71 @@
+#ifndef REPLAY_H_
+#define REPLAY_H_
+#include <stddef.h>
+#include <stdio.h>
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* One dequeue: the `seq`-th task taken from the pool was `task`, taken by
+ * worker `worker`
+ */
+typedef struct trace_entry {
+    unsigned long seq;
+    unsigned long task;
+    int           worker;
+} trace_entry;
+
+/* Dequeue log. Recording appends with one atomic increment, entries past
+ * `cap` are counted in `n` but not stored, so `seq` is always the index.
+ */
+typedef struct trace {
+    trace_entry* entries;
+    size_t       n, cap;
+} trace;
+
+/* Items of a replayed run, keyed by task id. The keys are fixed when the
+ * table is built from a trace, so submitters and workers share it without
+ * a lock: a submitter stores the item and then sets `ready`.
+ */
+struct replay_slot {
+    unsigned long task;
+    int           used, ready;
+    work_item     item;
+};
+
+typedef struct replay_table {
+    struct replay_slot* slots;
+    size_t              mask;
+} replay_table;
+
+/* allocate a trace of at most `cap` entries, NULL if out of memory */
+extern trace* trace_create (size_t cap);
+extern void   trace_free (trace* tr);
+
+/* log a dequeue, MT-safe */
+extern void   trace_record (trace* tr, int worker, unsigned long task);
+
+/* number of stored entries */
+extern size_t trace_size (const trace* tr);
+
+/* text format, one "seq worker task" line per entry
+ * trace_save return: STAT_OK or STAT_SYNC on a write error
+ * trace_load return: the trace, or NULL on a read or format error
+ */
+extern int    trace_save (const trace* tr, FILE* out);
+extern trace* trace_load (FILE* in);
+
+/* build the table of the task ids in `tr`, return STAT_OK or STAT_ALLOC */
+extern int    replay_init (replay_table* rt, const trace* tr);
+extern void   replay_destroy (replay_table* rt);
+
+/* slot of `task`, NULL if the trace does not know it */
+extern struct replay_slot* replay_find (replay_table* rt, unsigned long task);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef RING_H_
+#define RING_H_
+#include <stdlib.h>
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Growable FIFO ring of work items.
+ * Internal to the library, not thread-safe: callers hold their own lock.
+ */
+struct ring {
+    work_item*  items;
+    size_t      head, size, capacity;
+};
+
+static inline void ring_init(struct ring* r) {
+    r->items = NULL;
+    r->head = r->size = r->capacity = 0;
+}
+
+static inline void ring_destroy(struct ring* r) {
+    free (r->items);
+    ring_init (r);
+}
+
+static inline void ring_clear(struct ring* r) {
+    r->head = r->size = 0;
+}
+
+/* return: STAT_OK, or STAT_ALLOC if the ring cannot grow */
+static inline int ring_push(struct ring* r, work_item item) {
+    size_t capacity, i;
+    work_item* items;
+    if (r->size == r->capacity) {
+        capacity = r->capacity ? 2 * r->capacity : 64;
+        items = (work_item*) malloc (capacity * sizeof(work_item));
+        if (items == NULL)
+            return STAT_ALLOC;
+        for (i = 0; i < r->size; i++)
+            items[i] = r->items[(r->head + i) % r->capacity];
+        free (r->items);
+        r->items = items;
+        r->head = 0;
+        r->capacity = capacity;
+    }
+    r->items[(r->head + r->size++) % r->capacity] = item;
+    return STAT_OK;
+}
+
+/* return: 1 if an item was taken, 0 if the ring is empty */
+static inline int ring_pop(struct ring* r, work_item* item) {
+    if (r->size == 0)
+        return 0;
+    *item = r->items[r->head];
+    r->head = (r->head + 1) % r->capacity;
+    r->size--;
+    return 1;
+}
+
+/* Remove the newest item equal to `item`, keeping the order of the rest
+ * return: 1 if one was removed, 0 if there is none
+ */
+static inline int ring_remove(struct ring* r, work_item item) {
+    size_t i, j;
+    for (i = r->size; i-- > 0; ) {
+        j = (r->head + i) % r->capacity;
+        if (r->items[j].run != item.run || r->items[j].arg != item.arg)
+            continue;
+        for (; i + 1 < r->size; i++)
+            r->items[(r->head + i) % r->capacity] =
+                r->items[(r->head + i + 1) % r->capacity];
+        r->size--;
+        return 1;
+    }
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,167 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "tenant.h"
+
+/* -----------------------------------------------------------------------
+ * Deficit round robin over tenant queues.
+ * For a summary of declarations, see `tenant.h`
+ * -----------------------------------------------------------------------
+ */
+int tsched_init(tenant_sched* ts) {
+    ts->tenants = NULL;
+    ts->ntenants = ts->capacity = 0;
+    ts->cur = 0;
+    if (pthread_mutex_init (&ts->lock, NULL))
+        return STAT_SYNC;
+    return STAT_OK;
+}
+
+void tsched_destroy(tenant_sched* ts) {
+    size_t i;
+    for (i = 0; i < ts->ntenants; i++) {
+        ring_destroy (&ts->tenants[i]->queue);
+        free (ts->tenants[i]);
+    }
+    free (ts->tenants);
+    ts->tenants = NULL;
+    ts->ntenants = ts->capacity = 0;
+    pthread_mutex_destroy (&ts->lock);
+}
+
+void tsched_clear(tenant_sched* ts) {
+    size_t i;
+    pthread_mutex_lock (&ts->lock);
+    for (i = 0; i < ts->ntenants; i++) {
+        ring_clear (&ts->tenants[i]->queue);
+        ts->tenants[i]->deficit = 0;
+        ts->tenants[i]->stats.depth = 0;
+    }
+    pthread_mutex_unlock (&ts->lock);
+}
+
+tenant_t* tsched_create(tenant_sched* ts, const char* name,
+                        unsigned weight, size_t cap)
+{
+    tenant_t *t, **tenants;
+    t = (tenant_t*) calloc (1, sizeof(tenant_t));
+    if (t == NULL)
+        return NULL;
+    strncpy (t->name, name ? name : "", TENANT_NAMELEN - 1);
+    t->weight = weight ? weight : 1;
+    t->cap = cap;
+    ring_init (&t->queue);
+
+    pthread_mutex_lock (&ts->lock);
+    if (ts->ntenants == ts->capacity) {
+        tenants = (tenant_t**) realloc (ts->tenants,
+                (ts->capacity ? 2 * ts->capacity : 8) * sizeof(tenant_t*));
+        if (tenants == NULL) {
+            pthread_mutex_unlock (&ts->lock);
+            free (t);
+            return NULL;
+        }
+        ts->tenants = tenants;
+        ts->capacity = ts->capacity ? 2 * ts->capacity : 8;
+    }
+    ts->tenants[ts->ntenants++] = t;
+    pthread_mutex_unlock (&ts->lock);
+    return t;
+}
+
+size_t tsched_drop(tenant_sched* ts, tenant_t* t) {
+    size_t n;
+    pthread_mutex_lock (&ts->lock);
+    n = t->queue.size;
+    ring_clear (&t->queue);
+    t->deficit = 0;
+    t->stats.depth = 0;
+    pthread_mutex_unlock (&ts->lock);
+    return n;
+}
+
+tenant_t* tsched_find(tenant_sched* ts, const char* name) {
+    tenant_t* t = NULL;
+    size_t i;
+    pthread_mutex_lock (&ts->lock);
+    for (i = 0; i < ts->ntenants && t == NULL; i++)
+        if (!strncmp (ts->tenants[i]->name, name, TENANT_NAMELEN - 1))
+            t = ts->tenants[i];
+    pthread_mutex_unlock (&ts->lock);
+    return t;
+}
+
+int tsched_enqueue(tenant_sched* ts, tenant_t* t, work_item item) {
+    int ret = STAT_OK;
+    pthread_mutex_lock (&ts->lock);
+    if (t->cap && t->queue.size >= t->cap) {
+        t->stats.rejected++;
+        ret = STAT_FULL;
+    } else if ((ret = ring_push (&t->queue, item))) {
+        t->stats.rejected++;
+    } else {
+        t->stats.submitted++;
+        t->stats.depth = t->queue.size;
+    }
+    pthread_mutex_unlock (&ts->lock);
+    return ret;
+}
+
+int tsched_cancel(tenant_sched* ts, tenant_t* t, work_item item) {
+    int found;
+    pthread_mutex_lock (&ts->lock);
+    found = ring_remove (&t->queue, item);
+    if (found) {
+        t->stats.submitted--;
+        t->stats.depth = t->queue.size;
+    }
+    pthread_mutex_unlock (&ts->lock);
+    return found;
+}
+
+void tsched_setrate(tenant_sched* ts, tenant_t* t,
+                    double rate, double burst, long long now) {
+    pthread_mutex_lock (&ts->lock);
+    ratelimit_init (&t->rl, rate, burst, now);
+    pthread_mutex_unlock (&ts->lock);
+}
+
+int tsched_dequeue(tenant_sched* ts, work_item* item, tenant_t** from,
+                   long long now, long long* wait) {
+    tenant_t* t;
+    size_t visited;
+    long long delay;
+    int ret = STAT_EMPTY;
+    pthread_mutex_lock (&ts->lock);
+    /* at most one full round plus the current tenant */
+    for (visited = 0; ts->ntenants && visited <= ts->ntenants; visited++) {
+        t = ts->tenants[ts->cur];
+        if (t->queue.size == 0) {
+            t->deficit = 0;
+        } else if (t->deficit > 0 && (delay = ratelimit_take (&t->rl, now))) {
+            /* over its rate, keep the deficit for when tokens are back */
+            if (ret == STAT_EMPTY || delay < *wait)
+                *wait = delay;
+            ret = STAT_AGAIN;
+        } else if (t->deficit > 0) {
+            ring_pop (&t->queue, item);
+            *from = t;
+            t->deficit--;
+            t->stats.executed++;
+            t->stats.depth = t->queue.size;
+            ret = STAT_OK;
+            break;
+        }
+        ts->cur = (ts->cur + 1) % ts->ntenants;
+        if (ts->tenants[ts->cur]->queue.size)
+            ts->tenants[ts->cur]->deficit += ts->tenants[ts->cur]->weight;
+    }
+    pthread_mutex_unlock (&ts->lock);
+    return ret;
+}
+
+void tsched_getstats(tenant_sched* ts, tenant_t* t, tenant_stats* stats) {
+    pthread_mutex_lock (&ts->lock);
+    *stats = t->stats;
+    pthread_mutex_unlock (&ts->lock);
+}
@@ -0,0 +1,95 @@
+#ifndef TENANT_H_
+#define TENANT_H_
+#include <stddef.h>
+#include <pthread.h>
+#include "common.h"
+#include "ratelimit.h"
+#include "ring.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TENANT_NAMELEN 32
+
+typedef struct tenant_stats {
+    size_t  submitted;  /* accepted by `tsched_enqueue` */
+    size_t  rejected;   /* refused, queue at its depth cap */
+    size_t  executed;   /* handed out by `tsched_dequeue` */
+    size_t  depth;      /* currently queued */
+} tenant_stats;
+
+/* One submission queue */
+typedef struct tenant {
+    char        name[TENANT_NAMELEN];
+    unsigned    weight;
+    size_t      cap;
+    struct ring queue;
+    long        deficit;
+    struct ratelimit rl;
+    tenant_stats stats;
+    void*       owner;      /* user of the tenant, not used by the scheduler */
+} tenant_t;
+
+/* Deficit round robin over tenants, all fields guarded by `lock`.
+ * `cur` is the tenant being served; it keeps the turn while it has queued
+ * items and deficit left, then the next non-empty tenant gets `weight`
+ * more deficit. Every item costs one.
+ */
+typedef struct tenant_sched {
+    pthread_mutex_t lock;
+    tenant_t**  tenants;
+    size_t      ntenants, capacity;
+    size_t      cur;
+} tenant_sched;
+
+/* init/destroy a scheduler, destroy also frees all tenants */
+extern int  tsched_init (tenant_sched* ts);
+extern void tsched_destroy (tenant_sched* ts);
+
+/* drop all queued items, keep tenants and counters */
+extern void tsched_clear (tenant_sched* ts);
+
+/* add a tenant with DRR `weight` (>= 1) and at most `cap` queued items
+ * (0 for no cap). return NULL if out of memory
+ */
+extern tenant_t* tsched_create (tenant_sched* ts, const char* name,
+                                unsigned weight, size_t cap);
+
+/* find a tenant by name, NULL if none */
+extern tenant_t* tsched_find (tenant_sched* ts, const char* name);
+
+/* drop the queued items of one tenant, return how many */
+extern size_t tsched_drop (tenant_sched* ts, tenant_t* t);
+
+/* queue an item, STAT_FULL if the tenant is at its cap */
+extern int  tsched_enqueue (tenant_sched* ts, tenant_t* t, work_item item);
+
+/* take back the newest queued copy of `item` after a failed submit
+ * return: 1 if it was still queued, 0 if it was handed out already
+ */
+extern int  tsched_cancel (tenant_sched* ts, tenant_t* t, work_item item);
+
+/* limit how fast items of `t` are handed out, a zero rate means unlimited */
+extern void tsched_setrate (tenant_sched* ts, tenant_t* t,
+                            double rate, double burst, long long now);
+
+/* take the next item in DRR order at time `now` (ns) and the tenant it
+ * belongs to. Tenants without a token are skipped.
+ * return:
+ *  STAT_OK     success
+ *  STAT_EMPTY  all tenants are empty
+ *  STAT_AGAIN  only rate-limited tenants have items, the first token
+ *              comes in *wait ns
+ */
+extern int  tsched_dequeue (tenant_sched* ts, work_item* item,
+                            tenant_t** from, long long now, long long* wait);
+
+extern void tsched_getstats (tenant_sched* ts, tenant_t* t,
+                             tenant_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,310 @@
+/* Regression tests: one function per fixed bug, each reproducing the
+ * sequence that used to go wrong.
+ * usage: regress > /dev/null
+ *
+ * exit status: 0 ok, 1 a check failed. Results go to stderr, the pool's
+ * debug output to stdout.
+ */
+#if defined(__GNUC__)
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include "../hthpool.h"
+#include "../worklist.h"
+
+static int failed;
+
+static void check(int ok, const char* what) {
+    if (!ok) {
+        fprintf (stderr, "FAIL: %s\n", what);
+        failed = 1;
+    }
+}
+
+static void* nop(void* arg) {
+    return arg;
+}
+
+/* WL_MULTIQUEUE: an item with priority LONG_MAX made its heap look empty */
+static void mq_long_max(void) {
+    worklist_t wl;
+    worklist_attr attr;
+    work_item item = { nop, &wl };
+    worklistattr_init (&attr);
+    worklistattr_settype (&attr, WL_MULTIQUEUE);
+    worklistattr_setconcurrency (&attr, 2);
+    if (worklist_init (&wl, 0, &attr)) {
+        check (0, "multiqueue init");
+        return;
+    }
+    check (worklist_add_prio (&wl, item, LONG_MAX) == STAT_OK,
+           "multiqueue add LONG_MAX");
+    check (!worklist_empty (&wl), "multiqueue LONG_MAX not empty");
+    item.arg = NULL;
+    check (worklist_trytake (&wl, &item) == STAT_OK && item.arg == &wl,
+           "multiqueue take LONG_MAX");
+    check (worklist_empty (&wl), "multiqueue empty after take");
+    worklist_destroy (&wl);
+}
+
+/* a tenant item whose dispatch item could not be queued stayed queued */
+static void tenant_orphan(void) {
+    hthpool_attr attr;
+    hthpool pool;
+    hthpool_tenant t;
+    hthpool_tenant_stats st;
+    work_item item = { nop, NULL };
+    hthpoolattr_init (&attr);
+    hthpoolattr_setworklist (&attr, WL_FIFO, 1);
+    pool = hthpool_init_attr (2, &attr);
+    t = hthpool_tenant_create (pool, "orphan", 1, 0);
+    hthpool_hard_stop (pool);
+    hthpool_wait (pool);
+    /* a stopped, full ring refuses the dispatch item */
+    hthpool_submit (pool, item);
+    check (hthpool_submit_tenant (pool, t, item) != STAT_OK,
+           "tenant submit to a stopped pool");
+    hthpool_tenant_getstats (pool, t, &st);
+    check (st.depth == 0 && st.submitted == 0, "tenant item taken back");
+    hthpool_destroy (pool);
+}
+
+static int retried_runs;
+
+static void* always_fail(void* arg) {
+    __atomic_add_fetch (&retried_runs, 1, __ATOMIC_RELAXED);
+    hthpool_task_fail (STAT_AGAIN, NULL);
+    return arg;
+}
+
+/* A retry blocked in the timer thread on a full ring was queued after
+ * `hthpool_continue` had reset the ring and freed its job.
+ */
+static void retry_continue(void) {
+    hthpool_attr attr;
+    hthpool_retryattr rattr;
+    hthpool pool;
+    struct timespec backoff = { 0, 20 * 1000000 };
+    work_item fail = { always_fail, NULL }, item = { nop, NULL };
+    int runs;
+    hthpoolattr_init (&attr);
+    hthpoolattr_setworklist (&attr, WL_FIFO, 1);
+    pool = hthpool_init_attr (1, &attr);
+    hthpool_retryattr_init (&rattr);
+    hthpool_retryattr_setattempts (&rattr, 100);
+    hthpool_retryattr_setbackoff (&rattr, &backoff, &backoff);
+    hthpool_submit_retry (pool, fail, &rattr);
+    while (__atomic_load_n (&retried_runs, __ATOMIC_RELAXED) == 0)
+        usleep (1000);
+    hthpool_soft_stop (pool);
+    hthpool_submit (pool, item);    /* wakes the worker to stop */
+    hthpool_wait (pool);
+    hthpool_submit (pool, item);    /* fills the ring */
+    usleep (60000);                 /* the retry blocks on the full ring */
+    runs = __atomic_load_n (&retried_runs, __ATOMIC_RELAXED);
+    hthpool_continue (pool);
+    usleep (10000);
+    hthpool_submit (pool, item);    /* makes room for a blocked hand-over */
+    usleep (60000);
+    check (__atomic_load_n (&retried_runs, __ATOMIC_RELAXED) == runs,
+           "retry dropped by continue ran again");
+    hthpool_hard_stop (pool);
+    hthpool_wait (pool);
+    hthpool_destroy (pool);
+}
+
+/* destroy joined the workers, then waited forever for a timer thread
+ * blocked handing an item to the full ring of a soft-stopped pool
+ */
+static void destroy_timer_blocked(void) {
+    hthpool_attr attr;
+    hthpool pool;
+    struct timespec when;
+    work_item item = { nop, NULL };
+    hthpoolattr_init (&attr);
+    hthpoolattr_setworklist (&attr, WL_FIFO, 1);
+    pool = hthpool_init_attr (1, &attr);
+    usleep (10000);                 /* the worker waits for work */
+    hthpool_soft_stop (pool);
+    hthpool_submit (pool, item);    /* wakes the worker to stop */
+    hthpool_wait (pool);
+    hthpool_submit (pool, item);    /* fills the ring */
+    clock_gettime (CLOCK_MONOTONIC, &when);
+    hthpool_submit_at (pool, item, &when);
+    usleep (20000);                 /* the timer thread blocks */
+    hthpool_destroy (pool);         /* hangs, see the alarm in `main` */
+}
+
+static long long rate_ran[6];
+static int rate_next;
+
+static void* rate_record(void* arg) {
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    rate_ran[(long) arg] = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    check ((long) arg == rate_next++, "rate limited items in order");
+    return arg;
+}
+
+/* Deferred items all waited for the same token and came back at once;
+ * the ones that lost went to the timer again, in any order.
+ */
+static void rate_fifo(void) {
+    hthpool pool = hthpool_init (1, WL_EMPTYITEM, WL_EMPTYITEM);
+    work_item item = { rate_record, NULL };
+    long i;
+    hthpool_setrate (pool, 50, 1);
+    for (i = 0; i < 6; i++) {
+        item.arg = (void*) i;
+        hthpool_submit (pool, item);
+    }
+    while (__atomic_load_n (&rate_next, __ATOMIC_RELAXED) < 6)
+        usleep (1000);
+    for (i = 1; i < 6; i++)
+        check (rate_ran[i] - rate_ran[i - 1] > 10 * 1000000LL,
+               "rate limited items spread out");
+    hthpool_hard_stop (pool);
+    hthpool_wait (pool);
+    hthpool_destroy (pool);
+}
+
+/* a producer batch refused by a stopped, full pool vanished silently */
+static void producer_dropped(void) {
+    hthpool_attr attr;
+    hthpool pool;
+    hthpool_producer prod;
+    hthpool_stats st;
+    work_item item = { nop, NULL };
+    hthpoolattr_init (&attr);
+    hthpoolattr_setworklist (&attr, WL_FIFO, 2);
+    pool = hthpool_init_attr (1, &attr);
+    hthpool_hard_stop (pool);
+    hthpool_wait (pool);
+    while (hthpool_submit (pool, item) == STAT_OK)
+        ;
+    prod = hthpool_producer_create (pool, 3, NULL);
+    hthpool_producer_submit (prod, item);
+    hthpool_producer_submit (prod, item);
+    check (hthpool_producer_submit (prod, item) == STAT_TERM,
+           "producer flush to a stopped pool");
+    hthpool_producer_destroy (prod);
+    hthpool_getstats (pool, &st);
+    check (st.producer_dropped == 3, "producer items dropped counted");
+    hthpool_destroy (pool);
+}
+
+static hthpool lazy_pool;
+
+static void* lazy_stop(void* arg) {
+    hthpool_hard_stop (lazy_pool);
+    return arg;
+}
+
+/* a lazy pool ran its empty event only once all workers existed, so
+ * stopping from it hung with a single worker started
+ */
+static void lazy_empty(void) {
+    hthpool_attr attr;
+    work_item stop = { lazy_stop, NULL }, item = { nop, NULL };
+    hthpoolattr_init (&attr);
+    hthpoolattr_setlazy (&attr, 1);
+    hthpoolattr_setevent (&attr, stop, WL_EMPTYITEM);
+    lazy_pool = hthpool_init_attr (4, &attr);
+    hthpool_submit (lazy_pool, item);
+    hthpool_wait (lazy_pool);       /* hangs, see the alarm in `main` */
+    hthpool_destroy (lazy_pool);
+}
+
+static int bound_next;
+
+static void* bound_record(void* arg) {
+    check (hthpool_worker_id () == 3, "rate limited bound item on its worker");
+    check ((long) arg == bound_next, "rate limited bound items in order");
+    __atomic_store_n (&bound_next, bound_next + 1, __ATOMIC_RELEASE);
+    return arg;
+}
+
+/* bound items over the rate limit came back through the shared worklist
+ * and ran on any worker, in any order
+ */
+static void rate_bound(void) {
+    hthpool pool = hthpool_init (4, WL_EMPTYITEM, WL_EMPTYITEM);
+    work_item item = { bound_record, NULL };
+    long i;
+    hthpool_setrate (pool, 5, 1);
+    for (i = 0; i < 6; i++) {
+        item.arg = (void*) i;
+        hthpool_submit_to (pool, 3, item);
+    }
+    while (__atomic_load_n (&bound_next, __ATOMIC_ACQUIRE) < 6)
+        usleep (1000);
+    hthpool_hard_stop (pool);
+    hthpool_wait (pool);
+    hthpool_destroy (pool);
+}
+
+static int slow_seen;
+
+static void* slow(void* arg) {
+    usleep (100000);
+    return arg;
+}
+
+static void slow_report(void* ctx, int worker, work_item item,
+                        long long elapsed) {
+    (void) ctx; (void) worker; (void) elapsed;
+    if (item.run == slow)
+        __atomic_store_n (&slow_seen, 1, __ATOMIC_RELAXED);
+}
+
+/* a rate-deferred task ran inside its dispatcher unrecorded, so the
+ * watchdog saw the dispatcher, or nothing
+ */
+static void rate_watchdog(void) {
+    hthpool pool = hthpool_init (1, WL_EMPTYITEM, WL_EMPTYITEM);
+    struct timespec threshold = { 0, 20 * 1000000 };
+    work_item first = { nop, NULL }, item = { slow, NULL };
+    hthpool_watchdog (pool, &threshold, slow_report, NULL);
+    hthpool_setrate (pool, 20, 1);
+    hthpool_submit (pool, first);   /* takes the only token */
+    hthpool_submit (pool, item);
+    usleep (300000);
+    check (__atomic_load_n (&slow_seen, __ATOMIC_RELAXED),
+           "watchdog reports a rate-deferred task");
+    hthpool_hard_stop (pool);
+    hthpool_wait (pool);
+    hthpool_destroy (pool);
+}
+
+/* a BSP run on a pool without workers ran nothing and reported 0 rounds */
+static void bsp_no_workers(void) {
+    hthpool pool = hthpool_init (0, WL_EMPTYITEM, WL_EMPTYITEM);
+    work_item item = { nop, NULL };
+    check (hthpool_bsp_run (pool, &item, 1, NULL) == STAT_EMPTY,
+           "BSP run refused without workers");
+    hthpool_hard_stop (pool);
+    hthpool_wait (pool);
+    hthpool_destroy (pool);
+}
+
+int main(void) {
+    /* a hang is a failure too */
+    alarm (30);
+    mq_long_max ();
+    tenant_orphan ();
+    retry_continue ();
+    destroy_timer_blocked ();
+    rate_fifo ();
+    producer_dropped ();
+    lazy_empty ();
+    rate_bound ();
+    rate_watchdog ();
+    bsp_no_workers ();
+    if (!failed)
+        fprintf (stderr, "regress: ok\n");
+    return failed;
+}
@@ -0,0 +1,322 @@
+/* Stress test: many producers and task-spawning workers against randomized
+ * stop/continue/destroy sequences, then a thread-count sweep.
+ * usage: stress [max threads] [rounds] [seed] > /dev/null
+ *
+ * Every round starts a fresh set of producer threads on the current pool
+ * (random worklist, idle policy, topology placement and up to twice
+ * `max threads` workers, default: all CPUs) and then does one of:
+ *   drain    let the producers finish, wait for every task to run, check
+ *            the counts and checksums, then soft stop, wait and continue
+ *   stop     hard stop while the producers are running, wait, continue
+ *   destroy  hard stop while the producers are running, wait, destroy
+ *            and create a new pool
+ * Tasks go to the shared worklist or, by their id, to a worker's mailbox:
+ * bound to a random worker, or children hinted to their parent's worker.
+ * A stop or destroy discards the queued tasks, so the tasks accepted up to
+ * then are closed as one epoch: a task of an older epoch that still runs
+ * was resurrected. Every task records that it ran; running twice is an
+ * error, and after a drain every accepted task must have run exactly once.
+ *
+ * The sweep runs the same fixed load with 1, 2, 4, ... `max threads`
+ * workers and flags a thread count whose throughput falls below
+ * 1/COLLAPSE of the best one seen before it.
+ *
+ * exit status: 0 ok, 1 lost, duplicated or resurrected tasks, 2 scaling
+ * collapse. Errors print the seed that reproduces the sequence. Results go
+ * to stderr, the pool's debug output to stdout.
+ */
+#if defined(__GNUC__)
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../hthpool.h"
+
+#define PRODUCERS       4
+#define PER_PRODUCER    2000
+#define CHILD_EVERY     4       /* every 4th producer task spawns a child */
+#define MAIL_EVERY      3       /* every 3rd task goes to a mailbox */
+#define DRAIN_TIMEOUT   30      /* s without progress before tasks count
+                                   as lost */
+#define SWEEP_TASKS     200000
+#define COLLAPSE        4
+
+#define DEAD            (-1)    /* epoch of a task whose submit failed */
+
+static hthpool pool;
+static int     nthreads;
+static unsigned seed, seed0;   /* `seed` is the state of rand_r */
+
+/* per task id */
+static unsigned char* ran;
+static int*           epochs;
+static unsigned long  maxids;
+
+static unsigned long next_id;
+static int           epoch;
+static unsigned long accepted, executed, discarded, rejected;
+static unsigned long long sum_accepted, sum_executed;
+static int           children = 1, mailboxes = 1;
+
+static const int wl_types[] = { WL_FIFO, WL_CHUNKED, WL_OBIM, WL_MULTIQUEUE };
+static const char* wl_names[] = { "fifo", "chunked", "obim", "multiqueue" };
+#define NTYPES (sizeof(wl_types) / sizeof(wl_types[0]))
+
+static void fail(const char* what, unsigned long id) {
+    fprintf (stderr, "FAIL: %s (task %lu), seed %u\n", what, id, seed0);
+    exit (1);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* spreads the ids over the checksum */
+static unsigned long long mix(unsigned long id) {
+    unsigned long long x = id + 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static void* work(void* arg);
+
+/* submit a new task, also from workers; the task is set up and counted
+ * before the submit because a worker may run it at once
+ */
+static void submit(int child) {
+    unsigned long id = __atomic_fetch_add (&next_id, 1, __ATOMIC_RELAXED);
+    work_item item = { work, (void*) (uintptr_t) (id << 1 | child) };
+    int ret;
+    if (id >= maxids)
+        fail ("out of task ids", id);
+    __atomic_store_n (&epochs[id], __atomic_load_n (&epoch, __ATOMIC_ACQUIRE),
+                      __ATOMIC_RELEASE);
+    __atomic_add_fetch (&sum_accepted, mix (id), __ATOMIC_RELAXED);
+    __atomic_add_fetch (&accepted, 1, __ATOMIC_RELEASE);
+    if (!mailboxes || id % MAIL_EVERY != 0)
+        ret = hthpool_submit (pool, item);
+    else if (child)
+        ret = hthpool_submit_hint (pool, hthpool_worker_id (), item);
+    else
+        ret = hthpool_submit_to (pool, (int) (id / MAIL_EVERY % nthreads),
+                                 item);
+    if (ret != STAT_OK) {
+        __atomic_store_n (&epochs[id], DEAD, __ATOMIC_RELEASE);
+        __atomic_sub_fetch (&sum_accepted, mix (id), __ATOMIC_RELAXED);
+        __atomic_sub_fetch (&accepted, 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch (&rejected, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void* work(void* arg) {
+    unsigned long id = (unsigned long) (uintptr_t) arg >> 1;
+    int child = (int) ((uintptr_t) arg & 1);
+    int born = __atomic_load_n (&epochs[id], __ATOMIC_ACQUIRE);
+    if (__atomic_fetch_add (&ran[id], 1, __ATOMIC_RELAXED))
+        fail ("task ran twice", id);
+    if (born == DEAD)
+        fail ("rejected task ran", id);
+    if (born != __atomic_load_n (&epoch, __ATOMIC_ACQUIRE))
+        fail ("discarded task ran", id);
+    if (!child && children && id % CHILD_EVERY == 0)
+        submit (1);
+    __atomic_add_fetch (&sum_executed, mix (id), __ATOMIC_RELAXED);
+    __atomic_add_fetch (&executed, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void* wake(void* arg) {
+    return NULL;
+}
+
+static void* produce(void* arg) {
+    long i;
+    for (i = 0; i < PER_PRODUCER; i++) {
+        submit (0);
+        if (i % 64 == 0)
+            sched_yield ();
+    }
+    return NULL;
+}
+
+static void pool_create(void) {
+    hthpool_attr attr;
+    int t = rand_r (&seed) % NTYPES;
+    nthreads = 1 + rand_r (&seed) % nthreads;
+    hthpoolattr_init (&attr);
+    /* a full ring would block the workers spawning children */
+    hthpoolattr_setworklist (&attr, wl_types[t],
+                             4 * PRODUCERS * PER_PRODUCER);
+    hthpoolattr_setlazy (&attr, rand_r (&seed) % 2);
+    /* 10us spinning, trimming after 1ms idle */
+    hthpoolattr_setidle (&attr, rand_r (&seed) % 2 ? 10000 : 0,
+                         rand_r (&seed) % 2 ? 1000000 : 0);
+    hthpoolattr_settopology (&attr, rand_r (&seed) % 2);
+    pool = hthpool_init_attr (nthreads, &attr);
+    fprintf (stderr, "  pool: %d threads, %s, %s%s%s%s\n", nthreads,
+             wl_names[t], attr.lazy ? "lazy" : "eager",
+             attr.idle_spin ? ", spin" : "", attr.idle_deep ? ", trim" : "",
+             attr.topology ? ", pinned" : "");
+}
+
+/* everything accepted so far was run or has just been discarded */
+static void close_epoch(void) {
+    discarded += __atomic_load_n (&accepted, __ATOMIC_ACQUIRE) -
+                 __atomic_load_n (&executed, __ATOMIC_ACQUIRE);
+    __atomic_add_fetch (&epoch, 1, __ATOMIC_RELEASE);
+    /* the checksums only hold across drains */
+    sum_accepted = sum_executed = 0;
+    accepted = executed = 0;
+}
+
+static void drain(void) {
+    unsigned long last = (unsigned long) -1, done;
+    double since = now ();
+    work_item w = { wake, NULL };
+    int i;
+    while ((done = __atomic_load_n (&executed, __ATOMIC_ACQUIRE)) !=
+           __atomic_load_n (&accepted, __ATOMIC_ACQUIRE)) {
+        if (done != last) {
+            last = done;
+            since = now ();
+        } else if (now () - since > DRAIN_TIMEOUT) {
+            fail ("tasks lost", accepted - done);
+        }
+        sched_yield ();
+    }
+    if (__atomic_load_n (&sum_executed, __ATOMIC_RELAXED) !=
+        __atomic_load_n (&sum_accepted, __ATOMIC_RELAXED))
+        fail ("checksum mismatch", 0);
+    /* idle workers block in take, one wake item each lets them stop */
+    hthpool_soft_stop (pool);
+    for (i = 0; i < nthreads; i++)
+        hthpool_submit (pool, w);
+    hthpool_wait (pool);
+    hthpool_continue (pool);
+}
+
+static void rounds(int maxthreads, int n) {
+    pthread_t prod[PRODUCERS];
+    unsigned long stop_at;
+    int r, i, action;
+
+    nthreads = 2 * maxthreads;
+    pool_create ();
+    for (r = 0; r < n; r++) {
+        action = rand_r (&seed) % 3;
+        stop_at = next_id + rand_r (&seed) % (PRODUCERS * PER_PRODUCER);
+        fprintf (stderr, "round %d: %s\n", r,
+                 action == 0 ? "drain" : action == 1 ? "stop" : "destroy");
+        for (i = 0; i < PRODUCERS; i++)
+            pthread_create (&prod[i], NULL, produce, NULL);
+        if (action == 0) {
+            for (i = 0; i < PRODUCERS; i++)
+                pthread_join (prod[i], NULL);
+            drain ();
+            continue;
+        }
+        /* stop somewhere in the middle of the round */
+        while (__atomic_load_n (&next_id, __ATOMIC_RELAXED) < stop_at)
+            sched_yield ();
+        hthpool_hard_stop (pool);
+        for (i = 0; i < PRODUCERS; i++)
+            pthread_join (prod[i], NULL);
+        hthpool_wait (pool);
+        close_epoch ();
+        if (action == 1) {
+            hthpool_continue (pool);
+        } else {
+            hthpool_destroy (pool);
+            nthreads = 2 * maxthreads;
+            pool_create ();
+        }
+    }
+    for (i = 0; i < PRODUCERS; i++)
+        pthread_create (&prod[i], NULL, produce, NULL);
+    for (i = 0; i < PRODUCERS; i++)
+        pthread_join (prod[i], NULL);
+    drain ();
+    close_epoch ();
+    hthpool_hard_stop (pool);
+    hthpool_wait (pool);
+    hthpool_destroy (pool);
+    fprintf (stderr, "%d rounds: %lu tasks ran, %lu discarded by stops, "
+             "%lu rejected\n", n, next_id - discarded - rejected, discarded,
+             rejected);
+}
+
+/* fixed load, `SWEEP_TASKS` tasks from the main thread */
+static double sweep_run(int threads) {
+    hthpool_attr attr;
+    double t0;
+    long i;
+    hthpoolattr_init (&attr);
+    hthpoolattr_setworklist (&attr, WL_FIFO, 4096);
+    pool = hthpool_init_attr (threads, &attr);
+    accepted = executed = 0;
+    t0 = now ();
+    for (i = 0; i < SWEEP_TASKS; i++)
+        submit (0);
+    while (__atomic_load_n (&executed, __ATOMIC_ACQUIRE) != SWEEP_TASKS)
+        sched_yield ();
+    t0 = now () - t0;
+    hthpool_hard_stop (pool);
+    hthpool_wait (pool);
+    hthpool_destroy (pool);
+    return SWEEP_TASKS / t0;
+}
+
+static int sweep(int maxthreads) {
+    double tput, best = 0;
+    int t, collapsed = 0;
+    children = mailboxes = 0;
+    fprintf (stderr, "\n%8s %12s\n", "threads", "tasks/s");
+    for (t = 1; ; t = t * 2 < maxthreads ? t * 2 : maxthreads) {
+        tput = sweep_run (t);
+        fprintf (stderr, "%8d %12.0f", t, tput);
+        if (tput * COLLAPSE < best) {
+            fprintf (stderr, "  COLLAPSE");
+            collapsed = 1;
+        }
+        fprintf (stderr, "\n");
+        if (tput > best)
+            best = tput;
+        if (t == maxthreads)
+            break;
+    }
+    return collapsed;
+}
+
+int main(int argc, char** argv) {
+    int maxthreads = argc > 1 ? atoi (argv[1])
+                              : (int) sysconf (_SC_NPROCESSORS_ONLN);
+    int n          = argc > 2 ? atoi (argv[2]) : 20;
+    int t, sweeps = 1;
+    seed = seed0 = argc > 3 ? (unsigned) atol (argv[3])
+                            : (unsigned) time (NULL);
+    if (maxthreads < 1)
+        maxthreads = 1;
+    fprintf (stderr, "%d threads max, %d rounds, seed %u\n",
+             maxthreads, n, seed);
+    for (t = 1; t < maxthreads; t *= 2)
+        sweeps++;
+    /* every round: all producer tasks and at most one child each */
+    maxids = (unsigned long) (n + 1) * PRODUCERS * PER_PRODUCER * 2 +
+             (unsigned long) sweeps * SWEEP_TASKS;
+    ran = (unsigned char*) calloc (maxids, 1);
+    epochs = (int*) calloc (maxids, sizeof(int));
+    if (ran == NULL || epochs == NULL) {
+        perror ("calloc");
+        return 1;
+    }
+    rounds (maxthreads, n);
+    return sweep (maxthreads) ? 2 : 0;
+}
@@ -0,0 +1,171 @@
+/* clock_gettime and pthread_condattr_setclock need _GNU_SOURCE with
+ * -std=c99, see the note at the top of `hthpool.c`
+ */
+#if defined(__GNUC__)
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include "timer.h"
+
+/* -----------------------------------------------------------------------
+ * Timer queue.
+ * For a summary of declarations, see `timer.h`
+ * -----------------------------------------------------------------------
+ */
+long long timerq_now(void) {
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void* timerq_run(void* arg) {
+    timerq* tq = (timerq*) arg;
+    struct heap_node due;
+    struct timespec ts;
+    long long now;
+    pthread_mutex_lock (&tq->lock);
+    while (!tq->close) {
+        if (tq->heap.size == 0 || tq->paused) {
+            pthread_cond_wait (&tq->cond, &tq->lock);
+            continue;
+        }
+        now = timerq_now ();
+        if (tq->heap.nodes[0].key > now) {
+            ts.tv_sec  = tq->heap.nodes[0].key / 1000000000LL;
+            ts.tv_nsec = tq->heap.nodes[0].key % 1000000000LL;
+            pthread_cond_timedwait (&tq->cond, &tq->lock, &ts);
+            continue;
+        }
+        heap_pop (&tq->heap, &due);
+        /* never hold the lock while handing over, `fire` may block */
+        tq->firing = 1;
+        pthread_mutex_unlock (&tq->lock);
+        tq->fire (tq->ctx, due.item);
+        pthread_mutex_lock (&tq->lock);
+        tq->firing = 0;
+        if (tq->paused)
+            pthread_cond_broadcast (&tq->cond_idle);
+    }
+    pthread_mutex_unlock (&tq->lock);
+    return NULL;
+}
+
+static int timerq_initcond(timerq* tq) {
+    pthread_condattr_t cattr;
+    if (pthread_condattr_init (&cattr)                          ||
+        pthread_condattr_setclock (&cattr, CLOCK_MONOTONIC)     ||
+        pthread_cond_init (&tq->cond, &cattr)
+       )
+        return STAT_SYNC;
+    pthread_condattr_destroy (&cattr);
+    return STAT_OK;
+}
+
+int timerq_init(timerq* tq, timerq_fire fire, void* ctx) {
+    heap_init (&tq->heap);
+    tq->started = tq->close = 0;
+    tq->paused = tq->firing = 0;
+    tq->fire = fire;
+    tq->ctx = ctx;
+    if (timerq_initcond (tq)                                    ||
+        pthread_cond_init (&tq->cond_idle, NULL)                ||
+        pthread_mutex_init (&tq->lock, NULL)
+       )
+    {
+        perror ("Create timer synchronization variables");
+        return STAT_SYNC;
+    }
+    return STAT_OK;
+}
+
+void timerq_stop(timerq* tq) {
+    pthread_mutex_lock (&tq->lock);
+    tq->close = 1;
+    pthread_cond_signal (&tq->cond);
+    pthread_mutex_unlock (&tq->lock);
+    if (tq->started)
+        pthread_join (tq->thread, NULL);
+    tq->started = 0;
+}
+
+void timerq_destroy(timerq* tq) {
+    timerq_stop (tq);
+    heap_destroy (&tq->heap);
+    pthread_mutex_destroy (&tq->lock);
+    pthread_cond_destroy (&tq->cond);
+    pthread_cond_destroy (&tq->cond_idle);
+}
+
+void timerq_clear(timerq* tq) {
+    pthread_mutex_lock (&tq->lock);
+    tq->heap.size = 0;
+    pthread_mutex_unlock (&tq->lock);
+}
+
+void timerq_pause(timerq* tq) {
+    pthread_mutex_lock (&tq->lock);
+    tq->paused++;
+    while (tq->firing)
+        pthread_cond_wait (&tq->cond_idle, &tq->lock);
+    pthread_mutex_unlock (&tq->lock);
+}
+
+void timerq_resume(timerq* tq) {
+    pthread_mutex_lock (&tq->lock);
+    if (--tq->paused == 0)
+        pthread_cond_signal (&tq->cond);
+    pthread_mutex_unlock (&tq->lock);
+}
+
+int timerq_schedule(timerq* tq, long long when, work_item item) {
+    int ret = STAT_OK;
+    pthread_mutex_lock (&tq->lock);
+    if (tq->close) {
+        pthread_mutex_unlock (&tq->lock);
+        return STAT_TERM;
+    }
+    if (!tq->started) {
+        if (pthread_create (&tq->thread, NULL, timerq_run, tq)) {
+            pthread_mutex_unlock (&tq->lock);
+            perror ("Create timer thread");
+            return STAT_SYNC;
+        }
+        tq->started = 1;
+    }
+    ret = heap_push (&tq->heap, when, item);
+    /* only a new earliest item changes how long the thread sleeps */
+    if (ret == STAT_OK && tq->heap.nodes[0].key == when)
+        pthread_cond_signal (&tq->cond);
+    pthread_mutex_unlock (&tq->lock);
+    return ret;
+}
+
+void timerq_fork_prepare(timerq* tq) {
+    pthread_mutex_lock (&tq->lock);
+}
+
+void timerq_fork_parent(timerq* tq) {
+    pthread_mutex_unlock (&tq->lock);
+}
+
+/* the old thread may still be counted as a sleeper of `cond` */
+int timerq_fork_child(timerq* tq, int keep) {
+    int ret = timerq_initcond (tq);
+    if (ret == STAT_OK && pthread_cond_init (&tq->cond_idle, NULL))
+        ret = STAT_SYNC;
+    /* the threads firing or pausing are gone */
+    tq->started = 0;
+    tq->paused = tq->firing = 0;
+    if (!keep)
+        tq->heap.size = 0;
+    if (ret == STAT_OK && tq->heap.size && !tq->close) {
+        if (pthread_create (&tq->thread, NULL, timerq_run, tq))
+            ret = STAT_SYNC;
+        else
+            tq->started = 1;
+    }
+    pthread_mutex_unlock (&tq->lock);
+    return ret;
+}
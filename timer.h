@@ -0,0 +1,71 @@
+#ifndef TIMER_H_
+#define TIMER_H_
+#include <pthread.h>
+#include "common.h"
+#include "heap.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Called by the timer thread for every due item */
+typedef void (*timerq_fire)(void* ctx, work_item item);
+
+/* Timer queue: work items keyed by absolute CLOCK_MONOTONIC time in ns.
+ * A dedicated thread, started on the first `timerq_schedule`, sleeps until
+ * the earliest item is due and passes it to `fire`. `fire` runs on the
+ * timer thread and should only hand the item over, e.g. submit it.
+ */
+typedef struct timerq {
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    pthread_cond_t  cond_idle;  /* `firing` went to 0 while paused */
+    struct heap     heap;
+    int             started, close;
+    int             paused, firing;
+    timerq_fire     fire;
+    void*           ctx;
+} timerq;
+
+/* current CLOCK_MONOTONIC time in ns */
+extern long long timerq_now (void);
+
+extern int  timerq_init (timerq* tq, timerq_fire fire, void* ctx);
+
+/* Join the timer thread, pending items are no longer fired and later
+ * schedules fail. The caller must not hold a lock `fire` takes.
+ */
+extern void timerq_stop (timerq* tq);
+
+/* stop the timer thread if needed and free the queue */
+extern void timerq_destroy (timerq* tq);
+
+/* drop all pending items */
+extern void timerq_clear (timerq* tq);
+
+/* Hold back due items and wait until `fire` returned for the one being
+ * fired, if any; `resume` lets them go again. Pauses nest. The caller
+ * must not hold a lock `fire` takes.
+ */
+extern void timerq_pause (timerq* tq);
+extern void timerq_resume (timerq* tq);
+
+/* fire `item` at `when` (ns)
+ * return: STAT_OK, STAT_ALLOC, STAT_SYNC, or STAT_TERM once stopped
+ */
+extern int  timerq_schedule (timerq* tq, long long when, work_item item);
+
+/* fork() support, see `worklist_fork_prepare`. In the child the timer
+ * thread is gone; `keep` restarts it for the pending items, otherwise they
+ * are dropped.
+ */
+extern void timerq_fork_prepare (timerq* tq);
+extern void timerq_fork_parent (timerq* tq);
+extern int  timerq_fork_child (timerq* tq, int keep);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,164 @@
+#if defined(__GNUC__)
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "topo.h"
+
+/* -----------------------------------------------------------------------
+ * CPU cache topology from sysfs.
+ * For a summary of declarations, see `topo.h`
+ * -----------------------------------------------------------------------
+ */
+#define TOPO_MAXCPUS    CPU_SETSIZE
+#define TOPO_MAXCACHES  16
+
+/* sort key of one CPU; `l3` is the lowest CPU sharing its L3, or minus
+ * one minus the package if it has none
+ */
+struct topo_cpu {
+    int cpu, package, l3;
+};
+
+/* read the first line of `path`, return 0 on success */
+static int topo_read(const char* path, char* buf, size_t len) {
+    FILE* f = fopen (path, "r");
+    int ok;
+    if (f == NULL)
+        return -1;
+    ok = fgets (buf, (int) len, f) != NULL;
+    fclose (f);
+    return ok ? 0 : -1;
+}
+
+/* Parse a CPU list such as "0-7,16-23" into `set`
+ * return: the lowest CPU of the list, -1 if it is empty or malformed
+ */
+static int topo_parse_list(const char* s, unsigned char* set) {
+    char* end;
+    long lo, hi, c;
+    int first = -1;
+    while (*s != '\0' && *s != '\n') {
+        lo = strtol (s, &end, 10);
+        if (end == s || lo < 0)
+            return -1;
+        hi = lo;
+        s = end;
+        if (*s == '-') {
+            hi = strtol (s + 1, &end, 10);
+            if (end == s + 1 || hi < lo)
+                return -1;
+            s = end;
+        }
+        for (c = lo; c <= hi && c < TOPO_MAXCPUS; c++)
+            if (set != NULL)
+                set[c] = 1;
+        if (first < 0 || lo < first)
+            first = (int) lo;
+        if (*s == ',')
+            s++;
+        else if (*s != '\0' && *s != '\n')
+            return -1;
+    }
+    return first;
+}
+
+/* lowest CPU sharing the L3 of `cpu`, -1 if sysfs does not say */
+static int topo_l3(const char* root, int cpu) {
+    char path[256], buf[4096];
+    int i;
+    for (i = 0; i < TOPO_MAXCACHES; i++) {
+        snprintf (path, sizeof(path), "%s/cpu%d/cache/index%d/level",
+                  root, cpu, i);
+        if (topo_read (path, buf, sizeof(buf)) || atoi (buf) != 3)
+            continue;
+        snprintf (path, sizeof(path), "%s/cpu%d/cache/index%d/shared_cpu_list",
+                  root, cpu, i);
+        if (topo_read (path, buf, sizeof(buf)))
+            return -1;
+        return topo_parse_list (buf, NULL);
+    }
+    return -1;
+}
+
+static int topo_cmp(const void* a, const void* b) {
+    const struct topo_cpu* x = (const struct topo_cpu*) a;
+    const struct topo_cpu* y = (const struct topo_cpu*) b;
+    if (x->package != y->package)
+        return x->package < y->package ? -1 : 1;
+    if (x->l3 != y->l3)
+        return x->l3 < y->l3 ? -1 : 1;
+    return x->cpu < y->cpu ? -1 : x->cpu > y->cpu;
+}
+
+int topo_discover(topo* t, const char* root, const cpu_set_t* allowed) {
+    char path[256], buf[4096];
+    unsigned char* online;
+    struct topo_cpu* cpus;
+    int c, i, n = 0;
+
+    memset (t, 0, sizeof(topo));
+    online = (unsigned char*) calloc (TOPO_MAXCPUS, 1);
+    cpus = (struct topo_cpu*) malloc (TOPO_MAXCPUS * sizeof(struct topo_cpu));
+    if (online == NULL || cpus == NULL) {
+        free (online);
+        free (cpus);
+        return STAT_ALLOC;
+    }
+    snprintf (path, sizeof(path), "%s/online", root);
+    if (topo_read (path, buf, sizeof(buf)) ||
+        topo_parse_list (buf, online) < 0)
+    {
+        /* no sysfs: trust `allowed`, or assume CPUs 0 .. n-1 */
+        long last = allowed ? TOPO_MAXCPUS : sysconf (_SC_NPROCESSORS_ONLN);
+        for (c = 0; c < last && c < TOPO_MAXCPUS; c++)
+            online[c] = 1;
+    }
+    for (c = 0; c < TOPO_MAXCPUS; c++) {
+        if (!online[c] || (allowed != NULL && !CPU_ISSET (c, allowed)))
+            continue;
+        cpus[n].cpu = c;
+        snprintf (path, sizeof(path), "%s/cpu%d/topology/physical_package_id",
+                  root, c);
+        cpus[n].package = topo_read (path, buf, sizeof(buf)) ? 0 : atoi (buf);
+        cpus[n].l3 = topo_l3 (root, c);
+        if (cpus[n].l3 < 0)
+            cpus[n].l3 = -1 - cpus[n].package;
+        n++;
+    }
+    free (online);
+    if (n == 0) {
+        free (cpus);
+        return STAT_EMPTY;
+    }
+    qsort (cpus, n, sizeof(struct topo_cpu), topo_cmp);
+
+    t->cpu = (int*) malloc (n * sizeof(int));
+    t->group = (int*) malloc (n * sizeof(int));
+    t->package = (int*) malloc (n * sizeof(int));
+    if (t->cpu == NULL || t->group == NULL || t->package == NULL) {
+        free (cpus);
+        topo_free (t);
+        return STAT_ALLOC;
+    }
+    for (i = 0; i < n; i++) {
+        if (i == 0 || cpus[i].package != cpus[i - 1].package ||
+            cpus[i].l3 != cpus[i - 1].l3)
+            t->ngroups++;
+        t->cpu[i] = cpus[i].cpu;
+        t->group[i] = t->ngroups - 1;
+        t->package[i] = cpus[i].package;
+    }
+    t->n = n;
+    free (cpus);
+    return STAT_OK;
+}
+
+void topo_free(topo* t) {
+    free (t->cpu);
+    free (t->group);
+    free (t->package);
+    memset (t, 0, sizeof(topo));
+}
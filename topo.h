@@ -0,0 +1,39 @@
+#ifndef TOPO_H_
+#define TOPO_H_
+#include <stddef.h>
+#include <sched.h>
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TOPO_SYSFS  "/sys/devices/system/cpu"
+
+/* CPU cache topology, read from sysfs. The usable CPUs are ordered by
+ * package, then last-level cache domain (the L3 of one CCX on AMD, mostly
+ * the whole package on Intel), then number, so neighbouring entries share
+ * as much cache as possible. `group` numbers the L3 domains densely in
+ * that order; a CPU without an L3 entry is grouped with its package.
+ */
+typedef struct topo {
+    int     n;          /* usable CPUs */
+    int*    cpu;        /* CPU number of each */
+    int*    group;      /* L3 domain of each */
+    int*    package;    /* physical package (socket) of each */
+    int     ngroups;
+} topo;
+
+/* Read the topology under `root` (normally TOPO_SYSFS) of the online CPUs
+ * in `allowed`, all online CPUs if NULL. Missing files are not an error,
+ * missing topology then puts CPUs in package 0 and one group per package.
+ * return: STAT_OK, STAT_EMPTY if no CPU is usable, or STAT_ALLOC
+ */
+extern int  topo_discover (topo* t, const char* root, const cpu_set_t* allowed);
+extern void topo_free (topo* t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,4 +1,798 @@
+/* pthread spinlocks and rwlocks need _GNU_SOURCE with -std=c99,
+ * see the note at the top of `hthpool.c`
+ */
+#if defined(__GNUC__)
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "heap.h"
 #include "worklist.h"
+#include "lockstat.h"
+#include "fence.h"
+
+#define DEFAULT_SIZE 65533
+
+/* empty task which literally does nothing */
+static void* _wl_dry_run(void* arg) {
+    return NULL;
+}
+const work_item WL_EMPTYITEM = { (task) _wl_dry_run, NULL };
+work_item _wl_empty_item = { (task) _wl_dry_run, NULL };
+
+/* -----------------------------------------------------------------------
+ * Per-thread slots.
+ * Every thread touching a worklist gets a process-wide index on first use;
+ * per-thread state of a worklist is the slot `index % nslots`, or the one
+ * it bound itself to with `worklist_bindslot`. Slots are still locked, so
+ * sharing one between threads is slower but safe.
+ * -----------------------------------------------------------------------
+ */
+#define WL_CACHELINE 64
+static __thread size_t wl_thread_idx;
+static __thread size_t wl_bound_slot;   /* slot + 1, 0 if unbound */
+static size_t wl_thread_cnt;
+
+static inline size_t wl_slot(size_t nslots) {
+    if (wl_thread_idx == 0)
+        wl_thread_idx = __atomic_add_fetch (&wl_thread_cnt, 1,
+                                            __ATOMIC_RELAXED);
+    if (wl_bound_slot != 0)
+        return (wl_bound_slot - 1) % nslots;
+    return (wl_thread_idx - 1) % nslots;
+}
+
+/* Steal order of `worklistattr_setgroups`: row `me` of the nslots x nslots
+ * table lists slot `me`, then the other slots of its group, of its package,
+ * and the rest, each class in ring order from `me`. Slots without a group
+ * (beyond `n`) come last for everyone and steal in plain ring order.
+ * return: the table, or NULL without groups or memory
+ */
+static size_t* steal_order(const worklist_attr* attr, size_t nslots) {
+    size_t me, k, cls, i, slot, *order;
+    const int *group = attr->group, *package = attr->package;
+    size_t n = attr->ngroup;
+    int near;
+    if (group == NULL || package == NULL || n == 0)
+        return NULL;
+    order = (size_t*) malloc (nslots * nslots * sizeof(size_t));
+    if (order == NULL)
+        return NULL;
+    for (me = 0; me < nslots; me++) {
+        i = 0;
+        for (cls = 0; cls < 3; cls++)
+            for (k = 0; k < nslots; k++) {
+                slot = (me + k) % nslots;
+                if (me >= n || slot >= n)
+                    near = me >= n ? 0 : 2;
+                else if (group[slot] == group[me])
+                    near = 0;
+                else if (package[slot] == package[me])
+                    near = 1;
+                else
+                    near = 2;
+                if ((size_t) near == cls)
+                    order[me * nslots + i++] = slot;
+            }
+    }
+    return order;
+}
+
+/* -----------------------------------------------------------------------
+ * Chunked FIFO (WL_CHUNKED), also the bucket type of WL_OBIM.
+ * Each thread appends to a private chunk and publishes it once it is full,
+ * so shared state is touched once per WL_CHUNK_SIZE items. Publishing is a
+ * lock-free push onto `incoming`; consumers move `incoming` to the FIFO side
+ * in one exchange under `mutex_out`. A consumer drains its private chunk,
+ * then a published one, then its own partial chunk, and at last steals the
+ * partial chunks of other threads, so no item gets stuck in an idle producer.
+ * `nchunks` counts chunks holding items; it changes once per chunk and lets
+ * consumers skip an empty FIFO without touching any slot.
+ * -----------------------------------------------------------------------
+ */
+#define WL_CHUNK_SIZE 64
+
+struct wl_chunk {
+    struct wl_chunk* next;
+    unsigned head, tail;
+    work_item items[WL_CHUNK_SIZE];
+};
+
+struct wl_cslot {
+    pthread_spinlock_t lock;
+    struct wl_chunk *push, *pop;
+    lockstat ls;
+} __attribute__ ((aligned (WL_CACHELINE)));
+
+struct wl_cfifo {
+    struct wl_chunk* incoming;
+    pthread_mutex_t  mutex_out;
+    lockstat         ls_out;
+    struct wl_chunk* out;
+    struct wl_cslot* slots;
+    size_t nslots;
+    size_t nchunks;
+    const size_t* order;    /* steal order, see `steal_order`, or NULL */
+};
+
+static int cfifo_init(struct wl_cfifo* cf, size_t nslots,
+                      const size_t* order) {
+    size_t i;
+    cf->incoming = NULL;
+    cf->out = NULL;
+    cf->nslots = nslots;
+    cf->order = order;
+    cf->nchunks = 0;
+    lockstat_init (&cf->ls_out);
+    if (posix_memalign ((void**) &cf->slots, WL_CACHELINE,
+                        nslots * sizeof(struct wl_cslot)))
+        return STAT_ALLOC;
+    if (pthread_mutex_init (&cf->mutex_out, NULL)) {
+        free (cf->slots);
+        return STAT_SYNC;
+    }
+    for (i = 0; i < nslots; i++) {
+        pthread_spin_init (&cf->slots[i].lock, PTHREAD_PROCESS_PRIVATE);
+        cf->slots[i].push = cf->slots[i].pop = NULL;
+        lockstat_init (&cf->slots[i].ls);
+    }
+    return STAT_OK;
+}
+
+static void free_chunks(struct wl_chunk* c) {
+    struct wl_chunk* next;
+    for (; c != NULL; c = next) {
+        next = c->next;
+        free (c);
+    }
+}
+
+/* drop all items, MT-unsafe */
+static void cfifo_clear(struct wl_cfifo* cf) {
+    size_t i;
+    free_chunks (cf->incoming);
+    free_chunks (cf->out);
+    cf->incoming = cf->out = NULL;
+    for (i = 0; i < cf->nslots; i++) {
+        free (cf->slots[i].push);
+        free (cf->slots[i].pop);
+        cf->slots[i].push = cf->slots[i].pop = NULL;
+    }
+    cf->nchunks = 0;
+}
+
+static void cfifo_destroy(struct wl_cfifo* cf) {
+    size_t i;
+    cfifo_clear (cf);
+    for (i = 0; i < cf->nslots; i++)
+        pthread_spin_destroy (&cf->slots[i].lock);
+    pthread_mutex_destroy (&cf->mutex_out);
+    free (cf->slots);
+}
+
+static void cfifo_publish(struct wl_cfifo* cf, struct wl_chunk* c) {
+    struct wl_chunk* top = __atomic_load_n (&cf->incoming, __ATOMIC_RELAXED);
+    do {
+        c->next = top;
+    } while (!__atomic_compare_exchange_n (&cf->incoming, &top, c, 1,
+                                           __ATOMIC_RELEASE,
+                                           __ATOMIC_RELAXED));
+}
+
+/* get the oldest published chunk, or NULL */
+static struct wl_chunk* cfifo_fetch(struct wl_cfifo* cf) {
+    struct wl_chunk *c, *next, *rev = NULL;
+    LS_MUTEX_LOCK (&cf->mutex_out, &cf->ls_out);
+    if (cf->out == NULL) {
+        /* `incoming` is newest-first, reverse it into FIFO order */
+        c = __atomic_exchange_n (&cf->incoming, NULL, __ATOMIC_ACQUIRE);
+        for (; c != NULL; c = next) {
+            next = c->next;
+            c->next = rev;
+            rev = c;
+        }
+        __atomic_store_n (&cf->out, rev, __ATOMIC_RELAXED);
+    }
+    c = cf->out;
+    if (c != NULL)
+        __atomic_store_n (&cf->out, c->next, __ATOMIC_RELAXED);
+    pthread_mutex_unlock (&cf->mutex_out);
+    return c;
+}
+
+/* take a non-empty private chunk of any thread, starting with our own
+ * and then the nearest ones if there is a steal order
+ */
+static struct wl_chunk* cfifo_steal(struct wl_cfifo* cf, size_t me) {
+    struct wl_chunk* c = NULL;
+    struct wl_cslot* s;
+    size_t k;
+    for (k = 0; k < cf->nslots && c == NULL; k++) {
+        s = cf->slots + (cf->order ? cf->order[me * cf->nslots + k] :
+                                     (me + k) % cf->nslots);
+        LS_SPIN_LOCK (&s->lock, &s->ls);
+        if (s->pop != NULL && s->pop->head != s->pop->tail) {
+            c = s->pop;
+            s->pop = NULL;
+        } else if (s->push != NULL && s->push->head != s->push->tail) {
+            c = s->push;
+            s->push = NULL;
+        }
+        pthread_spin_unlock (&s->lock);
+    }
+    return c;
+}
+
+static int cfifo_push(struct wl_cfifo* cf, work_item item) {
+    struct wl_cslot* s = cf->slots + wl_slot (cf->nslots);
+    struct wl_chunk *full = NULL, *spare = NULL;
+    for (;;) {
+        LS_SPIN_LOCK (&s->lock, &s->ls);
+        if (s->push != NULL && s->push->tail < WL_CHUNK_SIZE)
+            break;
+        if (spare != NULL) {
+            full = s->push;
+            s->push = spare;
+            spare = NULL;
+            __atomic_add_fetch (&cf->nchunks, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+        /* never malloc with the slot spinning */
+        pthread_spin_unlock (&s->lock);
+        spare = (struct wl_chunk*) malloc (sizeof(struct wl_chunk));
+        if (spare == NULL)
+            return STAT_ALLOC;
+        spare->next = NULL;
+        spare->head = spare->tail = 0;
+    }
+    s->push->items[s->push->tail++] = item;
+    pthread_spin_unlock (&s->lock);
+    free (spare);
+    if (full != NULL)
+        cfifo_publish (cf, full);
+    return STAT_OK;
+}
+
+static int cfifo_pop(struct wl_cfifo* cf, work_item* item) {
+    size_t me = wl_slot (cf->nslots);
+    struct wl_cslot* s = cf->slots + me;
+    struct wl_chunk *c, *dead = NULL;
+    if (__atomic_load_n (&cf->nchunks, __ATOMIC_SEQ_CST) == 0)
+        return 0;
+    LS_SPIN_LOCK (&s->lock, &s->ls);
+    c = s->pop;
+    if (c == NULL) {
+        pthread_spin_unlock (&s->lock);
+        if (__atomic_load_n (&cf->incoming, __ATOMIC_RELAXED) != NULL ||
+            __atomic_load_n (&cf->out, __ATOMIC_RELAXED) != NULL)
+            c = cfifo_fetch (cf);
+        if (c == NULL)
+            c = cfifo_steal (cf, me);
+        if (c == NULL)
+            return 0;
+        LS_SPIN_LOCK (&s->lock, &s->ls);
+        if (s->pop != NULL) {
+            /* a thread sharing this slot got there first */
+            cfifo_publish (cf, c);
+            c = s->pop;
+        } else {
+            s->pop = c;
+        }
+    }
+    *item = c->items[c->head++];
+    if (c->head == c->tail) {
+        /* drained chunks never refill, pop chunks are not pushed to */
+        s->pop = NULL;
+        dead = c;
+        __atomic_sub_fetch (&cf->nchunks, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_spin_unlock (&s->lock);
+    free (dead);
+    return 1;
+}
+
+/* -----------------------------------------------------------------------
+ * Ordered-by-integer-metric (OBIM) worklist.
+ * A sorted map from priority key (`prio >> delta`) to a chunked FIFO bucket.
+ * Buckets are created on demand under `lock_map` and never freed before
+ * `worklist_destroy`, so every thread may cache bucket pointers:
+ * `last` avoids a map lookup for runs of pushes with the same key, `cur` is
+ * the bucket the thread drains. Only when `cur` runs dry does the thread
+ * scan the map for the lowest non-empty bucket; a push to a lower bucket
+ * moves `cur` of the pushing thread only. Priorities are thus approximate,
+ * but no lock is taken on the common push/pop path.
+ * -----------------------------------------------------------------------
+ */
+struct wl_bucket {
+    long key;
+    struct wl_cfifo fifo;
+};
+
+struct wl_oslot {
+    struct wl_bucket *cur, *last;
+} __attribute__ ((aligned (WL_CACHELINE)));
+
+struct wl_obim {
+    pthread_rwlock_t   lock_map;
+    lockstat           ls_map;
+    struct wl_bucket** map;
+    size_t nbuckets, capacity;
+    int    delta;
+    size_t nslots;
+    const size_t* order;    /* steal order of the buckets */
+    struct wl_oslot* slots;
+};
+
+static struct wl_obim* obim_create(size_t nslots, int delta,
+                                   const size_t* order) {
+    size_t i;
+    struct wl_obim* ob = (struct wl_obim*) malloc (sizeof(struct wl_obim));
+    if (ob == NULL)
+        return NULL;
+    ob->map = NULL;
+    ob->nbuckets = ob->capacity = 0;
+    ob->delta = delta;
+    ob->nslots = nslots;
+    ob->order = order;
+    lockstat_init (&ob->ls_map);
+    if (posix_memalign ((void**) &ob->slots, WL_CACHELINE,
+                        nslots * sizeof(struct wl_oslot)))
+    {
+        free (ob);
+        return NULL;
+    }
+    if (pthread_rwlock_init (&ob->lock_map, NULL)) {
+        free (ob->slots);
+        free (ob);
+        return NULL;
+    }
+    for (i = 0; i < nslots; i++)
+        ob->slots[i].cur = ob->slots[i].last = NULL;
+    return ob;
+}
+
+static void obim_clear(struct wl_obim* ob) {
+    size_t i;
+    for (i = 0; i < ob->nbuckets; i++)
+        cfifo_clear (&ob->map[i]->fifo);
+}
+
+static void obim_destroy(struct wl_obim* ob) {
+    size_t i;
+    for (i = 0; i < ob->nbuckets; i++) {
+        cfifo_destroy (&ob->map[i]->fifo);
+        free (ob->map[i]);
+    }
+    pthread_rwlock_destroy (&ob->lock_map);
+    free (ob->map);
+    free (ob->slots);
+    free (ob);
+}
+
+/* binary search, `lock_map` held; *pos is the insertion point if not found */
+static struct wl_bucket* obim_search(struct wl_obim* ob, long key,
+                                     size_t* pos)
+{
+    size_t lo = 0, hi = ob->nbuckets, mid;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (ob->map[mid]->key == key) {
+            *pos = mid;
+            return ob->map[mid];
+        }
+        if (ob->map[mid]->key < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *pos = lo;
+    return NULL;
+}
+
+static struct wl_bucket* obim_bucket(struct wl_obim* ob, long key) {
+    struct wl_bucket *b, *nb, **map;
+    size_t pos;
+    LS_RDLOCK (&ob->lock_map, &ob->ls_map);
+    b = obim_search (ob, key, &pos);
+    pthread_rwlock_unlock (&ob->lock_map);
+    if (b != NULL)
+        return b;
+
+    nb = (struct wl_bucket*) malloc (sizeof(struct wl_bucket));
+    if (nb == NULL)
+        return NULL;
+    nb->key = key;
+    if (cfifo_init (&nb->fifo, ob->nslots, ob->order)) {
+        free (nb);
+        return NULL;
+    }
+    LS_WRLOCK (&ob->lock_map, &ob->ls_map);
+    b = obim_search (ob, key, &pos);
+    if (b == NULL && ob->nbuckets == ob->capacity) {
+        map = (struct wl_bucket**) realloc (ob->map,
+                (ob->capacity ? 2 * ob->capacity : 16) * sizeof(*map));
+        if (map != NULL) {
+            ob->map = map;
+            ob->capacity = ob->capacity ? 2 * ob->capacity : 16;
+        }
+    }
+    if (b == NULL && ob->nbuckets < ob->capacity) {
+        memmove (ob->map + pos + 1, ob->map + pos,
+                 (ob->nbuckets - pos) * sizeof(*ob->map));
+        ob->map[pos] = b = nb;
+        ob->nbuckets++;
+        nb = NULL;
+    }
+    pthread_rwlock_unlock (&ob->lock_map);
+    if (nb != NULL) {
+        /* lost the race, or out of memory (b == NULL) */
+        cfifo_destroy (&nb->fifo);
+        free (nb);
+    }
+    return b;
+}
+
+static int obim_empty(struct wl_obim* ob) {
+    size_t i;
+    int empty = 1;
+    LS_RDLOCK (&ob->lock_map, &ob->ls_map);
+    for (i = 0; i < ob->nbuckets && empty; i++)
+        empty = !__atomic_load_n (&ob->map[i]->fifo.nchunks, __ATOMIC_SEQ_CST);
+    pthread_rwlock_unlock (&ob->lock_map);
+    return empty;
+}
+
+static int obim_push(struct wl_obim* ob, work_item item, long prio) {
+    struct wl_oslot* os = ob->slots + wl_slot (ob->nslots);
+    struct wl_bucket *b, *cur;
+    long key = prio >> ob->delta;
+    int ret;
+
+    b = __atomic_load_n (&os->last, __ATOMIC_ACQUIRE);
+    if (b == NULL || b->key != key) {
+        b = obim_bucket (ob, key);
+        if (b == NULL)
+            return STAT_ALLOC;
+        __atomic_store_n (&os->last, b, __ATOMIC_RELEASE);
+    }
+    ret = cfifo_push (&b->fifo, item);
+    if (ret != STAT_OK)
+        return ret;
+    cur = __atomic_load_n (&os->cur, __ATOMIC_ACQUIRE);
+    if (cur == NULL || key < cur->key)
+        __atomic_store_n (&os->cur, b, __ATOMIC_RELEASE);
+    return STAT_OK;
+}
+
+static int obim_pop(struct wl_obim* ob, work_item* item) {
+    struct wl_oslot* os = ob->slots + wl_slot (ob->nslots);
+    struct wl_bucket* b = __atomic_load_n (&os->cur, __ATOMIC_ACQUIRE);
+    size_t i;
+    int found = 0;
+
+    if (b != NULL && cfifo_pop (&b->fifo, item))
+        return 1;
+    /* current bucket ran dry, look for the lowest non-empty one */
+    LS_RDLOCK (&ob->lock_map, &ob->ls_map);
+    for (i = 0; i < ob->nbuckets && !found; i++) {
+        b = ob->map[i];
+        found = cfifo_pop (&b->fifo, item);
+    }
+    pthread_rwlock_unlock (&ob->lock_map);
+    if (found)
+        __atomic_store_n (&os->cur, b, __ATOMIC_RELEASE);
+    return found;
+}
+
+/* -----------------------------------------------------------------------
+ * MultiQueue, a relaxed concurrent priority queue (WL_MULTIQUEUE).
+ * `factor` x concurrency heaps, each behind its own lock. A push goes to a
+ * random heap; a pop peeks at the minimum of two random heaps and takes the
+ * smaller one. `top` and `size` cache the minimum key and the item count of
+ * each heap so peeking needs no lock; `top` is LLONG_MAX for an empty heap
+ * but items may have that key too, so emptiness is told by `size`.
+ * Larger factors mean less contention but larger rank errors.
+ * -----------------------------------------------------------------------
+ */
+#define WL_MQ_TRIES 8
+
+struct wl_mqheap {
+    pthread_mutex_t lock;
+    struct heap     heap;
+    long long       top;
+    size_t          size;
+    lockstat        ls;
+} __attribute__ ((aligned (WL_CACHELINE)));
+
+struct wl_mq {
+    struct wl_mqheap* heaps;
+    size_t nheaps;
+};
+
+static __thread unsigned long long wl_rng;
+
+/* xorshift64*, seeded per thread from its slot index */
+static inline size_t wl_rand(size_t n) {
+    if (wl_rng == 0) {
+        wl_slot (1);    /* assigns wl_thread_idx */
+        wl_rng = 0x9e3779b97f4a7c15ULL * wl_thread_idx;
+    }
+    wl_rng ^= wl_rng >> 12;
+    wl_rng ^= wl_rng << 25;
+    wl_rng ^= wl_rng >> 27;
+    return (size_t) ((wl_rng * 0x2545f4914f6cdd1dULL) >> 32) % n;
+}
+
+static struct wl_mq* mq_create(size_t nheaps) {
+    size_t i;
+    struct wl_mq* mq = (struct wl_mq*) malloc (sizeof(struct wl_mq));
+    if (mq == NULL)
+        return NULL;
+    if (nheaps < 2)
+        nheaps = 2;
+    mq->nheaps = nheaps;
+    if (posix_memalign ((void**) &mq->heaps, WL_CACHELINE,
+                        nheaps * sizeof(struct wl_mqheap)))
+    {
+        free (mq);
+        return NULL;
+    }
+    for (i = 0; i < nheaps; i++) {
+        pthread_mutex_init (&mq->heaps[i].lock, NULL);
+        heap_init (&mq->heaps[i].heap);
+        mq->heaps[i].top = LLONG_MAX;
+        mq->heaps[i].size = 0;
+        lockstat_init (&mq->heaps[i].ls);
+    }
+    return mq;
+}
+
+static void mq_clear(struct wl_mq* mq) {
+    size_t i;
+    for (i = 0; i < mq->nheaps; i++) {
+        mq->heaps[i].heap.size = 0;
+        mq->heaps[i].top = LLONG_MAX;
+        mq->heaps[i].size = 0;
+    }
+}
+
+static void mq_destroy(struct wl_mq* mq) {
+    size_t i;
+    for (i = 0; i < mq->nheaps; i++) {
+        pthread_mutex_destroy (&mq->heaps[i].lock);
+        heap_destroy (&mq->heaps[i].heap);
+    }
+    free (mq->heaps);
+    free (mq);
+}
+
+static inline long long mq_top(struct wl_mqheap* q) {
+    return __atomic_load_n (&q->top, __ATOMIC_SEQ_CST);
+}
+
+static inline size_t mq_size(struct wl_mqheap* q) {
+    return __atomic_load_n (&q->size, __ATOMIC_SEQ_CST);
+}
+
+static inline void mq_settop(struct wl_mqheap* q) {
+    __atomic_store_n (&q->top, q->heap.size ? q->heap.nodes[0].key
+                                            : LLONG_MAX, __ATOMIC_SEQ_CST);
+    __atomic_store_n (&q->size, q->heap.size, __ATOMIC_SEQ_CST);
+}
+
+static int mq_push(struct wl_mq* mq, work_item item, long long key) {
+    struct wl_mqheap* q;
+    int tries, ret;
+    for (tries = 0; ; tries++) {
+        q = mq->heaps + wl_rand (mq->nheaps);
+        if (tries >= WL_MQ_TRIES) {
+            LS_MUTEX_LOCK (&q->lock, &q->ls);
+            break;
+        }
+        if (!LS_MUTEX_TRYLOCK (&q->lock, &q->ls))
+            break;
+    }
+    ret = heap_push (&q->heap, key, item);
+    mq_settop (q);
+    pthread_mutex_unlock (&q->lock);
+    return ret;
+}
+
+/* Only reports empty after seeing every heap empty, which the sleep/wake
+ * protocol of `wl_get` relies on.
+ */
+static int mq_pop(struct wl_mq* mq, work_item* item, long long* key) {
+    struct wl_mqheap *q, *r;
+    struct heap_node min;
+    size_t i;
+    int tries;
+    for (tries = 0; ; tries++) {
+        if (tries < WL_MQ_TRIES) {
+            q = mq->heaps + wl_rand (mq->nheaps);
+            r = mq->heaps + wl_rand (mq->nheaps);
+            if (mq_top (r) < mq_top (q))
+                q = r;
+        } else {
+            q = NULL;
+        }
+        if (q == NULL || mq_size (q) == 0) {
+            /* both choices empty, fall back to any non-empty heap */
+            for (i = 0, q = NULL; i < mq->nheaps && q == NULL; i++)
+                if (mq_size (mq->heaps + i) != 0)
+                    q = mq->heaps + i;
+            if (q == NULL)
+                return 0;
+        }
+        if (tries >= WL_MQ_TRIES)
+            LS_MUTEX_LOCK (&q->lock, &q->ls);
+        else if (LS_MUTEX_TRYLOCK (&q->lock, &q->ls))
+            continue;
+        if (q->heap.size) {
+            heap_pop (&q->heap, &min);
+            mq_settop (q);
+            pthread_mutex_unlock (&q->lock);
+            *item = min.item;
+            if (key)
+                *key = min.key;
+            return 1;
+        }
+        pthread_mutex_unlock (&q->lock);
+    }
+}
+
+static int mq_empty(struct wl_mq* mq) {
+    size_t i;
+    for (i = 0; i < mq->nheaps; i++)
+        if (mq_size (mq->heaps + i) != 0)
+            return 0;
+    return 1;
+}
+
+/* -----------------------------------------------------------------------
+ * Earliest deadline first (WL_EDF).
+ * One locked min-heap keyed by absolute CLOCK_MONOTONIC deadlines in ns,
+ * items without a deadline sort last. A popped item whose deadline has
+ * passed counts as missed, or is dropped and counted if `drop` is set.
+ * -----------------------------------------------------------------------
+ */
+struct wl_edf {
+    pthread_mutex_t lock;
+    lockstat        ls;
+    struct heap     heap;
+    int             drop;
+    size_t          missed, dropped;
+};
+
+static long long wl_now(void) {
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static struct wl_edf* edf_create(int drop) {
+    struct wl_edf* edf = (struct wl_edf*) malloc (sizeof(struct wl_edf));
+    if (edf == NULL)
+        return NULL;
+    if (pthread_mutex_init (&edf->lock, NULL)) {
+        free (edf);
+        return NULL;
+    }
+    heap_init (&edf->heap);
+    lockstat_init (&edf->ls);
+    edf->drop = drop;
+    edf->missed = edf->dropped = 0;
+    return edf;
+}
+
+static void edf_destroy(struct wl_edf* edf) {
+    pthread_mutex_destroy (&edf->lock);
+    heap_destroy (&edf->heap);
+    free (edf);
+}
+
+static int edf_push(struct wl_edf* edf, work_item item, long long deadline) {
+    int ret;
+    LS_MUTEX_LOCK (&edf->lock, &edf->ls);
+    ret = heap_push (&edf->heap, deadline, item);
+    pthread_mutex_unlock (&edf->lock);
+    return ret;
+}
+
+static int edf_pop(struct wl_edf* edf, work_item* item, long* ndropped) {
+    struct heap_node min;
+    long long now = 0;
+    int found = 0;
+    LS_MUTEX_LOCK (&edf->lock, &edf->ls);
+    while (!found && edf->heap.size) {
+        heap_pop (&edf->heap, &min);
+        if (min.key != LLONG_MAX && min.key < (now ? now : (now = wl_now ()))) {
+            if (edf->drop) {
+                edf->dropped++;
+                (*ndropped)++;
+                continue;
+            }
+            edf->missed++;
+        }
+        *item = min.item;
+        found = 1;
+    }
+    pthread_mutex_unlock (&edf->lock);
+    return found;
+}
+
+static int edf_empty(struct wl_edf* edf) {
+    int empty;
+    LS_MUTEX_LOCK (&edf->lock, &edf->ls);
+    empty = edf->heap.size == 0;
+    pthread_mutex_unlock (&edf->lock);
+    return empty;
+}
+
+/* -----------------------------------------------------------------------
+ * Ring storage.
+ * Plain malloc unless WL_MEM_* flags ask for more. Mapped rings are
+ * rounded up to the page size in use, 2M for huge pages.
+ * -----------------------------------------------------------------------
+ */
+#define WL_HUGEPAGE (2UL << 20)
+
+static work_item* ring_alloc(size_t bytes, int flags, size_t* mapped) {
+    void* p = MAP_FAILED;
+    size_t page = (size_t) sysconf (_SC_PAGESIZE), len, i;
+    int mflags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+    *mapped = 0;
+    if (flags == 0)
+        return (work_item*) malloc (bytes);
+#ifdef MAP_POPULATE
+    if (flags & WL_MEM_PREFAULT)
+        mflags |= MAP_POPULATE;
+#endif
+#ifdef MAP_HUGETLB
+    if (flags & WL_MEM_HUGETLB) {
+        len = (bytes + WL_HUGEPAGE - 1) & ~(WL_HUGEPAGE - 1);
+        p = mmap (NULL, len, PROT_READ | PROT_WRITE, mflags | MAP_HUGETLB,
+                  -1, 0);
+    }
+#endif
+    if (p == MAP_FAILED) {
+        /* THP needs 2M alignment to help, over-allocate with 4K pages */
+        len = (flags & WL_MEM_THP) ?
+              (bytes + WL_HUGEPAGE - 1) & ~(WL_HUGEPAGE - 1) :
+              (bytes + page - 1) & ~(page - 1);
+        p = mmap (NULL, len, PROT_READ | PROT_WRITE, mflags, -1, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+#ifdef MADV_HUGEPAGE
+        if (flags & WL_MEM_THP)
+            madvise (p, len, MADV_HUGEPAGE);
+#endif
+    }
+    if (flags & WL_MEM_PREFAULT) {
+        /* MAP_POPULATE may be missing or skip THP, write one byte a page */
+        for (i = 0; i < len; i += page)
+            ((volatile char*) p)[i] = 0;
+    }
+    if (flags & WL_MEM_LOCK)
+        mlock (p, len);
+    *mapped = len;
+    return (work_item*) p;
+}
+
+static void ring_free(work_item* queue, size_t mapped) {
+    if (mapped)
+        munmap (queue, mapped);
+    else
+        free (queue);
+}
 
 /* -----------------------------------------------------------------------
  * API for worklist and worklistattr.
@@ -10,6 +804,17 @@ void  worklistattr_init (worklist_attr* attr) {
     attr->concurrency = 0;
     attr->full_event  = WL_EMPTYITEM;
     attr->empty_event = WL_EMPTYITEM;
+    attr->type  = WL_FIFO;
+    attr->delta = 0;
+    attr->factor = 2;
+    attr->drop = 0;
+    attr->sp = attr->sc = 0;
+    attr->memflags = 0;
+    attr->low = attr->high = 0;
+    attr->watermark = NULL;
+    attr->watermark_ctx = NULL;
+    attr->group = attr->package = NULL;
+    attr->ngroup = 0;
 }
 
 void worklistattr_setconcurrency (worklist_attr *attr,
@@ -28,15 +833,107 @@ void worklistattr_setevent (worklist_attr *attr,
     attr->trigger = 1;
 }
 
+void worklistattr_settype (worklist_attr *attr, int type) {
+    attr->type = type;
+}
+
+void worklistattr_setdelta (worklist_attr *attr, int delta) {
+    attr->delta = delta;
+}
+
+void worklistattr_setfactor (worklist_attr *attr, size_t factor) {
+    attr->factor = factor;
+}
+
+void worklistattr_setdrop (worklist_attr *attr, int drop) {
+    attr->drop = drop;
+}
+
+void worklistattr_setsingle (worklist_attr *attr, int producer, int consumer)
+{
+    attr->sp = producer;
+    attr->sc = consumer;
+}
+
+void worklistattr_setmemory (worklist_attr *attr, int memflags) {
+    attr->memflags = memflags;
+}
+
+void worklistattr_setwatermark (worklist_attr *attr, long low, long high,
+                                wl_watermark_cb cb, void* ctx)
+{
+    attr->low = low;
+    attr->high = high;
+    attr->watermark = cb;
+    attr->watermark_ctx = ctx;
+    attr->trigger = 1;
+}
+
+void worklistattr_setgroups (worklist_attr *attr, const int* group,
+                             const int* package, size_t n)
+{
+    attr->group = group;
+    attr->package = package;
+    attr->ngroup = n;
+}
+
+void worklist_bindslot (size_t slot) {
+    wl_bound_slot = slot + 1;
+}
+
+/* `stop` is read without the worklist locks, see `is_stopped` */
 static inline void set_stop(worklist_t *wl) {
-    wl->status.stop = 1;
+    __atomic_store_n (&wl->status.stop, 1, __ATOMIC_RELEASE);
+}
+static inline int is_stopped(worklist_t *wl) {
+    return __atomic_load_n (&wl->status.stop, __ATOMIC_ACQUIRE);
 }
 static inline void clear_status(worklist_t *wl) {
-    wl->status.stop     = 0;
+    __atomic_store_n (&wl->status.stop, 0, __ATOMIC_RELEASE);
     wl->status.adding   = 0;
     wl->status.taking   = 0;
 }
 
+/* The locked ring: adders own `tail` and takers `head`, each under its own
+ * mutex. A side reads the other's index without that lock, so indices are
+ * published with release stores after the slot is written or read.
+ */
+static inline size_t ring_head(worklist_t* wl) {
+    return __atomic_load_n (&wl->head, __ATOMIC_ACQUIRE);
+}
+
+static inline size_t ring_tail(worklist_t* wl) {
+    return __atomic_load_n (&wl->tail, __ATOMIC_ACQUIRE);
+}
+
+/* Timed takes wait on CLOCK_MONOTONIC */
+static int wl_initcond(pthread_cond_t* cond) {
+    pthread_condattr_t cattr;
+    if (pthread_condattr_init (&cattr)                          ||
+        pthread_condattr_setclock (&cattr, CLOCK_MONOTONIC)     ||
+        pthread_cond_init (cond, &cattr)
+       )
+        return STAT_SYNC;
+    pthread_condattr_destroy (&cattr);
+    return STAT_OK;
+}
+
+/* whether a take that read `*kicks` was kicked since, never if NULL */
+static inline int wl_kicked(worklist_t* wl, const size_t* kicks) {
+    return kicks != NULL &&
+           __atomic_load_n (&wl->kicks, __ATOMIC_ACQUIRE) != *kicks;
+}
+
+/* wait on `cond` until `abstime`, forever if NULL; return 1 on timeout */
+static inline int wl_wait(pthread_cond_t* cond, pthread_mutex_t* mutex,
+                          const struct timespec* abstime) {
+    if (abstime == NULL) {
+        pthread_cond_wait (cond, mutex);
+        return 0;
+    }
+    return pthread_cond_timedwait (cond, mutex, abstime) == ETIMEDOUT;
+}
+
 /* initialize a worklist with given size and worklist_attr, MT-unsafe
  * arg:
  * @wl            the pointer to the worklist to be initialized
@@ -57,32 +954,88 @@ int worklist_init(worklist_t *wl, size_t size,
     wl->tail    = 1;
     wl->qsize   = size + 2;   /* including head and tail sentinel nodes */
     clear_status (wl);
+    wl->type    = attr ? attr->type : WL_FIFO;
+    wl->waiters = 0;
+    wl->adders  = 0;
+    wl->kicks   = 0;
+    wl->sp      = attr && wl->type == WL_FIFO ? attr->sp : 0;
+    wl->sc      = attr && wl->type == WL_FIFO ? attr->sc : 0;
+    wl->depth   = 0;
+    wl->above   = 0;
+    wl->queue   = NULL;
+    wl->qbytes  = 0;
+    wl->obim    = NULL;
+    wl->fifo    = NULL;
+    wl->mq      = NULL;
+    wl->edf     = NULL;
+    wl->steal   = NULL;
+    lockstat_init (&wl->ls_head);
+    lockstat_init (&wl->ls_tail);
     if (pthread_mutex_init (&wl->mutex_head, NULL)  ||
         pthread_mutex_init (&wl->mutex_tail, NULL)  ||
-        pthread_cond_init (&wl->cond_nonempty, NULL)||
-        pthread_cond_init (&wl->cond_nonfull, NULL)
+        wl_initcond (&wl->cond_nonempty)            ||
+        wl_initcond (&wl->cond_nonfull)
        )
     {
         perror ("Create worklist synchronization variables");
         return STAT_SYNC;
     }
-    wl->queue = (work_item*) malloc (wl->qsize * sizeof(work_item));
+    if (wl->type == WL_OBIM || wl->type == WL_CHUNKED)
+        wl->steal = steal_order (attr, attr->concurrency + 1);
+    if (wl->type == WL_OBIM) {
+        wl->obim = obim_create (attr->concurrency + 1, attr->delta,
+                                wl->steal);
+    } else if (wl->type == WL_MULTIQUEUE) {
+        wl->mq = mq_create (attr->factor * (attr->concurrency ?
+                                            attr->concurrency : 1));
+    } else if (wl->type == WL_EDF) {
+        wl->edf = edf_create (attr->drop);
+    } else if (wl->type == WL_CHUNKED) {
+        wl->fifo = (struct wl_cfifo*) malloc (sizeof(struct wl_cfifo));
+        if (wl->fifo && cfifo_init (wl->fifo, attr->concurrency + 1,
+                                    wl->steal)) {
+            free (wl->fifo);
+            wl->fifo = NULL;
+        }
+    } else {
+        wl->queue = ring_alloc (wl->qsize * sizeof(work_item),
+                                attr ? attr->memflags : 0, &wl->qbytes);
+    }
     if (NULL == attr) {
         wl->attr = NULL;
     } else {
         wl->attr = (worklist_attr*) malloc (sizeof(worklist_attr));
     }
 
-    if (wl->queue == NULL || wl->attr == NULL) {
+    if ((wl->queue == NULL && wl->obim == NULL && wl->fifo == NULL &&
+         wl->mq == NULL && wl->edf == NULL) ||
+        (attr != NULL && wl->attr == NULL))
+    {
+        if (wl->queue)
+            ring_free (wl->queue, wl->qbytes);
+        if (wl->edf)
+            edf_destroy (wl->edf);
+        if (wl->mq)
+            mq_destroy (wl->mq);
+        if (wl->obim)
+            obim_destroy (wl->obim);
+        if (wl->fifo) {
+            cfifo_destroy (wl->fifo);
+            free (wl->fifo);
+        }
+        free (wl->steal);
+        free (wl->attr);
         pthread_mutex_destroy (&wl->mutex_head);
         pthread_mutex_destroy (&wl->mutex_tail);
         pthread_cond_destroy (&wl->cond_nonempty);
         pthread_cond_destroy (&wl->cond_nonfull);
         return STAT_ALLOC;
-    } else {
+    } else if (attr != NULL) {
         memcpy(wl->attr, attr, sizeof(worklist_attr));
-        if (!wl->attr->trigger)
+        if (!wl->attr->trigger) {
+            free (wl->attr);
             wl->attr = NULL;
+        }
     }
     return STAT_OK;
 }
@@ -91,8 +1044,19 @@ int worklist_init(worklist_t *wl, size_t size,
 void worklist_reset(worklist_t* wl) {
     wl->head    = 0;
     wl->tail    = 1;
+    wl->depth   = 0;
+    wl->above   = 0;
     clear_status (wl);
-    memset (wl->queue, 0, sizeof(work_item) * wl->qsize);
+    if (wl->obim)
+        obim_clear (wl->obim);
+    else if (wl->fifo)
+        cfifo_clear (wl->fifo);
+    else if (wl->mq)
+        mq_clear (wl->mq);
+    else if (wl->edf)
+        wl->edf->heap.size = 0;
+    else
+        memset (wl->queue, 0, sizeof(work_item) * wl->qsize);
 }
 
 /* destroy built-in worklist and associated sync variables, MT-unsafe
@@ -101,8 +1065,25 @@ void worklist_reset(worklist_t* wl) {
  * No arg, return value.
  */
 void worklist_destroy(worklist_t* wl) {
-    free (wl->queue);
+    if (wl->queue)
+        ring_free (wl->queue, wl->qbytes);
     wl->queue = NULL;
+    if (wl->obim)
+        obim_destroy (wl->obim);
+    wl->obim = NULL;
+    if (wl->fifo) {
+        cfifo_destroy (wl->fifo);
+        free (wl->fifo);
+    }
+    wl->fifo = NULL;
+    if (wl->mq)
+        mq_destroy (wl->mq);
+    wl->mq = NULL;
+    if (wl->edf)
+        edf_destroy (wl->edf);
+    wl->edf = NULL;
+    free (wl->steal);
+    wl->steal = NULL;
     free (wl->attr);
     wl->attr = NULL;
     if (pthread_mutex_destroy (&wl->mutex_head)     ||
@@ -115,99 +1096,600 @@ void worklist_destroy(worklist_t* wl) {
     }
 }
 
-/* Stop current round of tasks */
+/* Only the event threshold changes, nothing is resized */
+void worklist_setconcurrency(worklist_t* wl, size_t concurrency) {
+    if (wl->attr)
+        __atomic_store_n (&wl->attr->concurrency, concurrency,
+                          __ATOMIC_RELAXED);
+}
+
+/* takers or adders the empty and full events wait for */
+static inline size_t wl_concurrency(worklist_t* wl) {
+    return __atomic_load_n (&wl->attr->concurrency, __ATOMIC_RELAXED);
+}
+
+/* Stop current round of tasks. Sleepers check `stop` under their mutex,
+ * so broadcast under it too or a thread about to sleep misses the wakeup.
+ */
 void worklist_stop(worklist_t* wl) {
     set_stop (wl);
+    LS_MUTEX_LOCK (&wl->mutex_tail, &wl->ls_tail);
     pthread_cond_broadcast (&wl->cond_nonfull);
+    pthread_mutex_unlock (&wl->mutex_tail);
+    LS_MUTEX_LOCK (&wl->mutex_head, &wl->ls_head);
     pthread_cond_broadcast (&wl->cond_nonempty);
+    pthread_mutex_unlock (&wl->mutex_head);
+}
+
+/* An empty ring holds no live slot, its whole pages are handed back and
+ * fault in as zero pages on the next add. Rings of single producers or
+ * consumers are touched without the locks and are left alone, as are
+ * prefaulted or locked ones, which asked to stay resident.
+ */
+static void ring_trim(worklist_t* wl) {
+    size_t page = (size_t) sysconf (_SC_PAGESIZE);
+    uintptr_t lo = ((uintptr_t) wl->queue + page - 1) & ~(page - 1);
+    uintptr_t hi = ((uintptr_t) (wl->queue + wl->qsize)) & ~(page - 1);
+    if (wl->sp || wl->sc ||
+        (wl->attr && wl->attr->memflags & (WL_MEM_PREFAULT | WL_MEM_LOCK)))
+        return;
+    LS_MUTEX_LOCK (&wl->mutex_tail, &wl->ls_tail);
+    LS_MUTEX_LOCK (&wl->mutex_head, &wl->ls_head);
+    if ((wl->head + 1) % wl->qsize == wl->tail && lo < hi)
+        madvise ((void*) lo, hi - lo, MADV_DONTNEED);
+    pthread_mutex_unlock (&wl->mutex_head);
+    pthread_mutex_unlock (&wl->mutex_tail);
+}
+
+void worklist_trim(worklist_t* wl) {
+    size_t i;
+    if (wl->queue) {
+        ring_trim (wl);
+    } else if (wl->mq) {
+        for (i = 0; i < wl->mq->nheaps; i++) {
+            LS_MUTEX_LOCK (&wl->mq->heaps[i].lock, &wl->mq->heaps[i].ls);
+            heap_trim (&wl->mq->heaps[i].heap);
+            pthread_mutex_unlock (&wl->mq->heaps[i].lock);
+        }
+    } else if (wl->edf) {
+        LS_MUTEX_LOCK (&wl->edf->lock, &wl->edf->ls);
+        heap_trim (&wl->edf->heap);
+        pthread_mutex_unlock (&wl->edf->lock);
+    }
+    /* chunked FIFOs free their chunks as they drain */
+}
+
+/* Locks are taken in the order the add/take paths nest them:
+ * `mutex_tail`, `mutex_head`, then the backend, the OBIM map before its
+ * buckets.
+ */
+static void cfifo_lockall(struct wl_cfifo* cf) {
+    size_t i;
+    pthread_mutex_lock (&cf->mutex_out);
+    for (i = 0; i < cf->nslots; i++)
+        pthread_spin_lock (&cf->slots[i].lock);
+}
+
+static void cfifo_unlockall(struct wl_cfifo* cf) {
+    size_t i;
+    for (i = 0; i < cf->nslots; i++)
+        pthread_spin_unlock (&cf->slots[i].lock);
+    pthread_mutex_unlock (&cf->mutex_out);
+}
+
+void worklist_fork_prepare(worklist_t* wl) {
+    size_t i;
+    pthread_mutex_lock (&wl->mutex_tail);
+    pthread_mutex_lock (&wl->mutex_head);
+    if (wl->obim) {
+        pthread_rwlock_wrlock (&wl->obim->lock_map);
+        for (i = 0; i < wl->obim->nbuckets; i++)
+            cfifo_lockall (&wl->obim->map[i]->fifo);
+    } else if (wl->fifo) {
+        cfifo_lockall (wl->fifo);
+    } else if (wl->mq) {
+        for (i = 0; i < wl->mq->nheaps; i++)
+            pthread_mutex_lock (&wl->mq->heaps[i].lock);
+    } else if (wl->edf) {
+        pthread_mutex_lock (&wl->edf->lock);
+    }
+}
+
+/* the child renews the OBIM map lock instead, readers of the parent that
+ * were queued behind our write lock may still be recorded in it
+ */
+static void wl_fork_unlock(worklist_t* wl, int child) {
+    size_t i;
+    if (wl->obim) {
+        for (i = 0; i < wl->obim->nbuckets; i++)
+            cfifo_unlockall (&wl->obim->map[i]->fifo);
+        if (child)
+            pthread_rwlock_init (&wl->obim->lock_map, NULL);
+        else
+            pthread_rwlock_unlock (&wl->obim->lock_map);
+    } else if (wl->fifo) {
+        cfifo_unlockall (wl->fifo);
+    } else if (wl->mq) {
+        for (i = 0; i < wl->mq->nheaps; i++)
+            pthread_mutex_unlock (&wl->mq->heaps[i].lock);
+    } else if (wl->edf) {
+        pthread_mutex_unlock (&wl->edf->lock);
+    }
+    pthread_mutex_unlock (&wl->mutex_head);
+    pthread_mutex_unlock (&wl->mutex_tail);
+}
+
+void worklist_fork_parent(worklist_t* wl) {
+    wl_fork_unlock (wl, 0);
+}
+
+/* The forking thread owns the locks in the child too. The conds may still
+ * count sleepers of the parent, so they are initialized afresh rather than
+ * destroyed, which could wait for those sleepers.
+ */
+void worklist_fork_child(worklist_t* wl) {
+    wl->waiters = 0;
+    wl->adders  = 0;
+    wl->status.adding = 0;
+    wl->status.taking = 0;
+    wl_initcond (&wl->cond_nonempty);
+    wl_initcond (&wl->cond_nonfull);
+    wl_fork_unlock (wl, 1);
+}
+
+/* Account `delta` queued items and run the watermark callback on a
+ * crossing. Called with no worklist lock held. The depth is signed since a
+ * take may be counted before the add of its item.
+ */
+static void wl_watermark(worklist_t* wl, long delta) {
+    worklist_attr* attr = wl->attr;
+    long depth;
+    if (attr == NULL || attr->watermark == NULL || delta == 0)
+        return;
+    depth = __atomic_add_fetch (&wl->depth, delta, __ATOMIC_RELAXED);
+    if (delta > 0 && depth >= attr->high) {
+        int below = 0;
+        if (__atomic_compare_exchange_n (&wl->above, &below, 1, 0,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            attr->watermark (attr->watermark_ctx, 1, depth);
+    } else if (delta < 0 && depth <= attr->low) {
+        int above = 1;
+        if (__atomic_compare_exchange_n (&wl->above, &above, 0, 0,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            attr->watermark (attr->watermark_ctx, 0, depth);
+    }
+}
+
+/* Run an empty/full event with no worklist lock held, `locked` is
+ * released around it
+ */
+static void wl_event(pthread_mutex_t* locked, lockstat* ls,
+                     work_item event) {
+    pthread_mutex_unlock (locked);
+    event.run (event.arg);
+    LS_MUTEX_LOCK (locked, ls);
+}
+
+/* Producer side of the `waiters` handshake: the item is published, fence
+ * and only take `mutex_head` to wake somebody if a taker registered.
+ */
+static inline void wake_takers(worklist_t* wl, int all) {
+    if (FENCED_LOAD (&wl->waiters)) {
+        LS_MUTEX_LOCK (&wl->mutex_head, &wl->ls_head);
+        if (all)
+            pthread_cond_broadcast (&wl->cond_nonempty);
+        else
+            pthread_cond_signal (&wl->cond_nonempty);
+        pthread_mutex_unlock (&wl->mutex_head);
+    }
+}
+
+/* Ring add/take with a single producer and/or a single consumer.
+ * `tail` is written by producers only and `head` by consumers only; the
+ * single side publishes its index with a release store and reads the
+ * other one with an acquire load, the multi side keeps its mutex. Sleeping
+ * uses the `waiters`/`adders` handshake of the unbounded worklists below:
+ * register, fence, re-check, wait; the other side fences and only locks to
+ * signal if somebody registered.
+ */
+static int sr_add(worklist_t* wl, work_item item) {
+    size_t tail, next;
+    if (!wl->sp)
+        LS_MUTEX_LOCK (&wl->mutex_tail, &wl->ls_tail);
+    /* other producers move `tail` while we sleep with the mutex released */
+    for (;;) {
+        tail = __atomic_load_n (&wl->tail, __ATOMIC_RELAXED);
+        next = (tail + 1) % wl->qsize;
+        if (next != __atomic_load_n (&wl->head, __ATOMIC_ACQUIRE))
+            break;
+        if (wl->sp)
+            LS_MUTEX_LOCK (&wl->mutex_tail, &wl->ls_tail);
+        __atomic_add_fetch (&wl->adders, 1, __ATOMIC_SEQ_CST);
+        while ((__atomic_load_n (&wl->tail, __ATOMIC_RELAXED) + 1) % wl->qsize
+               == __atomic_load_n (&wl->head, __ATOMIC_SEQ_CST) &&
+               !is_stopped (wl))
+            pthread_cond_wait (&wl->cond_nonfull, &wl->mutex_tail);
+        __atomic_sub_fetch (&wl->adders, 1, __ATOMIC_SEQ_CST);
+        if (is_stopped (wl)) {
+            pthread_mutex_unlock (&wl->mutex_tail);
+            return STAT_TERM;
+        }
+        if (wl->sp)
+            pthread_mutex_unlock (&wl->mutex_tail);
+    }
+    wl->queue[tail] = item;
+    __atomic_store_n (&wl->tail, next, __ATOMIC_RELEASE);
+    if (!wl->sp)
+        pthread_mutex_unlock (&wl->mutex_tail);
+    wake_takers (wl, 0);
+    wl_watermark (wl, 1);
+    return STAT_OK;
+}
+
+/* return STAT_OK, STAT_EMPTY (`block` = 0 or `abstime` passed),
+ * STAT_AGAIN (kicked) or STAT_TERM
+ */
+static int sr_take(worklist_t* wl, work_item* item, int block,
+                   const struct timespec* abstime, const size_t* kicks) {
+    size_t next;
+    int timeout = 0;
+    if (!wl->sc)
+        LS_MUTEX_LOCK (&wl->mutex_head, &wl->ls_head);
+    /* likewise other consumers move `head` */
+    for (;;) {
+        next = (__atomic_load_n (&wl->head, __ATOMIC_RELAXED) + 1) % wl->qsize;
+        if (next != __atomic_load_n (&wl->tail, __ATOMIC_ACQUIRE))
+            break;
+        if (!block || timeout || is_stopped (wl) || wl_kicked (wl, kicks)) {
+            if (!wl->sc)
+                pthread_mutex_unlock (&wl->mutex_head);
+            return !block || timeout ? STAT_EMPTY
+                 : is_stopped (wl)   ? STAT_TERM : STAT_AGAIN;
+        }
+        if (wl->sc)
+            LS_MUTEX_LOCK (&wl->mutex_head, &wl->ls_head);
+        __atomic_add_fetch (&wl->waiters, 1, __ATOMIC_SEQ_CST);
+        while ((__atomic_load_n (&wl->head, __ATOMIC_RELAXED) + 1) % wl->qsize
+               == __atomic_load_n (&wl->tail, __ATOMIC_SEQ_CST) &&
+               !is_stopped (wl) && !wl_kicked (wl, kicks) && !timeout)
+            timeout = wl_wait (&wl->cond_nonempty, &wl->mutex_head, abstime);
+        __atomic_sub_fetch (&wl->waiters, 1, __ATOMIC_SEQ_CST);
+        if (wl->sc)
+            pthread_mutex_unlock (&wl->mutex_head);
+    }
+    *item = wl->queue[next];
+    __atomic_store_n (&wl->head, next, __ATOMIC_RELEASE);
+    if (!wl->sc)
+        pthread_mutex_unlock (&wl->mutex_head);
+    if (FENCED_LOAD (&wl->adders)) {
+        LS_MUTEX_LOCK (&wl->mutex_tail, &wl->ls_tail);
+        pthread_cond_signal (&wl->cond_nonfull);
+        pthread_mutex_unlock (&wl->mutex_tail);
+    }
+    wl_watermark (wl, -1);
+    return STAT_OK;
+}
+
+/* Add/take for the unbounded, non-ring worklists.
+ * `waiters` is the number of takers sleeping on `cond_nonempty`. A taker
+ * registers in `waiters` before its last pop attempt, a producer publishes
+ * its item before it reads `waiters`; with the full fences in between one
+ * of them sees the other. So producers share no per-item counter and only
+ * touch `mutex_head` when somebody actually sleeps.
+ */
+/* `*ntaken` accumulates the items removed, including dropped ones */
+static inline int wl_pop(worklist_t* wl, work_item* item, long* ntaken) {
+    int found;
+    if (wl->obim)
+        found = obim_pop (wl->obim, item);
+    else if (wl->mq)
+        found = mq_pop (wl->mq, item, NULL);
+    else if (wl->edf)
+        found = edf_pop (wl->edf, item, ntaken);
+    else
+        found = cfifo_pop (wl->fifo, item);
+    *ntaken += found;
+    return found;
+}
+
+static int wl_put(worklist_t* wl, work_item item, long long key) {
+    int ret = wl->obim ? obim_push (wl->obim, item, (long) key)
+            : wl->mq   ? mq_push (wl->mq, item, key)
+            : wl->edf  ? edf_push (wl->edf, item, key)
+                       : cfifo_push (wl->fifo, item);
+    if (ret != STAT_OK)
+        return ret;
+    wake_takers (wl, 0);
+    wl_watermark (wl, 1);
+    return STAT_OK;
+}
+
+/* The last of `concurrency` takers to go to sleep runs the empty event.
+ * return STAT_OK, STAT_EMPTY once `abstime` (NULL: never) passed,
+ * STAT_AGAIN once kicked (`kicks` not NULL) or STAT_TERM
+ */
+static int wl_get(worklist_t* wl, work_item* item,
+                  const struct timespec* abstime, const size_t* kicks) {
+    long ntaken = 0;
+    int found = 0, timeout = 0, kicked = 0;
+    if (wl_pop (wl, item, &ntaken)) {
+        wl_watermark (wl, -ntaken);
+        return STAT_OK;
+    }
+    LS_MUTEX_LOCK (&wl->mutex_head, &wl->ls_head);
+    if (__atomic_add_fetch (&wl->waiters, 1, __ATOMIC_SEQ_CST) ==
+        (wl->attr ? wl_concurrency (wl) : 0))
+    {
+        if (!(found = wl_pop (wl, item, &ntaken)))
+            wl_event (&wl->mutex_head, &wl->ls_head, wl->attr->empty_event);
+    }
+    while (!found && !(found = wl_pop (wl, item, &ntaken)) &&
+           !is_stopped (wl) && !(kicked = wl_kicked (wl, kicks)) && !timeout)
+        timeout = wl_wait (&wl->cond_nonempty, &wl->mutex_head, abstime);
+    __atomic_sub_fetch (&wl->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock (&wl->mutex_head);
+    wl_watermark (wl, -ntaken);
+    return found   ? STAT_OK
+         : kicked  ? STAT_AGAIN
+         : timeout ? STAT_EMPTY : STAT_TERM;
+}
+
+/* Non-blocking take, STAT_EMPTY if there is nothing to take */
+int worklist_trytake(worklist_t* wl, work_item* item) {
+    long ntaken = 0;
+    int found;
+    if (wl->type != WL_FIFO) {
+        found = wl_pop (wl, item, &ntaken);
+        wl_watermark (wl, -ntaken);
+        return found ? STAT_OK : STAT_EMPTY;
+    }
+    if (wl->sp || wl->sc)
+        return sr_take (wl, item, 0, NULL, NULL);
+    LS_MUTEX_LOCK (&wl->mutex_head, &wl->ls_head);
+    if ((wl->head + 1) % wl->qsize == ring_tail (wl)) {
+        pthread_mutex_unlock (&wl->mutex_head);
+        return STAT_EMPTY;
+    }
+    *item = wl->queue[(wl->head + 1) % wl->qsize];
+    __atomic_store_n (&wl->head, (wl->head + 1) % wl->qsize, __ATOMIC_RELEASE);
+    pthread_mutex_unlock (&wl->mutex_head);
+    pthread_cond_signal (&wl->cond_nonfull);
+    wl_watermark (wl, -1);
+    return STAT_OK;
+}
+
+/* Only exact while no thread adds or takes */
+int worklist_empty(worklist_t* wl) {
+    if (wl->obim)
+        return obim_empty (wl->obim);
+    if (wl->mq)
+        return mq_empty (wl->mq);
+    if (wl->edf)
+        return edf_empty (wl->edf);
+    if (wl->fifo)
+        return !__atomic_load_n (&wl->fifo->nchunks, __ATOMIC_SEQ_CST);
+    return (ring_head (wl) + 1) % wl->qsize == ring_tail (wl);
+}
+
+int worklist_add_prio(worklist_t* wl, work_item item, long prio) {
+    if (wl->type == WL_OBIM || wl->type == WL_MULTIQUEUE)
+        return wl_put (wl, item, prio);
+    return worklist_add (wl, item);
+}
+
+int worklist_add_deadline(worklist_t* wl, work_item item,
+                          const struct timespec* deadline)
+{
+    if (wl->type == WL_EDF)
+        return wl_put (wl, item, deadline->tv_sec * 1000000000LL +
+                                 deadline->tv_nsec);
+    return worklist_add (wl, item);
+}
+
+void worklist_getstats(worklist_t* wl, worklist_stats* stats) {
+    memset (stats, 0, sizeof(worklist_stats));
+    if (wl->edf) {
+        LS_MUTEX_LOCK (&wl->edf->lock, &wl->edf->ls);
+        stats->deadline_missed  = wl->edf->missed;
+        stats->deadline_dropped = wl->edf->dropped;
+        pthread_mutex_unlock (&wl->edf->lock);
+    }
+}
+
+void worklist_getlockstats(worklist_t* wl, lockstat* head, lockstat* tail,
+                           lockstat* backend) {
+    size_t i, j;
+    lockstat_add (head, &wl->ls_head);
+    lockstat_add (tail, &wl->ls_tail);
+    if (wl->obim) {
+        LS_RDLOCK (&wl->obim->lock_map, &wl->obim->ls_map);
+        lockstat_add (backend, &wl->obim->ls_map);
+        for (i = 0; i < wl->obim->nbuckets; i++) {
+            struct wl_cfifo* cf = &wl->obim->map[i]->fifo;
+            lockstat_add (backend, &cf->ls_out);
+            for (j = 0; j < cf->nslots; j++)
+                lockstat_add (backend, &cf->slots[j].ls);
+        }
+        pthread_rwlock_unlock (&wl->obim->lock_map);
+    } else if (wl->fifo) {
+        lockstat_add (backend, &wl->fifo->ls_out);
+        for (j = 0; j < wl->fifo->nslots; j++)
+            lockstat_add (backend, &wl->fifo->slots[j].ls);
+    } else if (wl->mq) {
+        for (i = 0; i < wl->mq->nheaps; i++)
+            lockstat_add (backend, &wl->mq->heaps[i].ls);
+    } else if (wl->edf) {
+        lockstat_add (backend, &wl->edf->ls);
+    }
 }
 
 /* Blocking add work */
 int worklist_add(worklist_t* wl, work_item item) {
     int registered = 0;
+    if (wl->type != WL_FIFO)
+        return wl_put (wl, item, wl->edf ? LLONG_MAX : 0);
+    if (wl->sp || wl->sc)
+        return sr_add (wl, item);
     // Enter the critical section for worklist tail
-    pthread_mutex_lock (&wl->mutex_tail);
+    LS_MUTEX_LOCK (&wl->mutex_tail, &wl->ls_tail);
 
     // If worklist is totally full, full_event (if defined) is triggered; 
     // else the current thread shall wait on cond_nonfull
-    while ((wl->tail + 1) % wl->qsize == wl->head) {
+    while ((wl->tail + 1) % wl->qsize == ring_head (wl)) {
         if (!registered) {
             registered = 1;
-            if (!wl->attr) {
+            if (wl->attr) {
                 wl->status.adding++;
-                if (wl->status.adding >= wl->attr->concurrency)
-                {
-                    // These unlocks & locks around the `full_event` are necessary to
-                    // 1. make sure no threads executing `worklist_take` will stuck at
-                    //    `cond_nonfull`
-                    // 2. no deadlock (which may be caused by locking mutex_head w/o
-                    //    unlocking mutex_tail here)
-                    pthread_mutex_unlock (&wl->mutex_tail);
-                    pthread_mutex_lock (&wl->mutex_head);
-                    wl->attr->full_event.run (wl->attr->full_event.arg);
-                    pthread_mutex_unlock (&wl->mutex_head);
-                    pthread_mutex_lock (&wl->mutex_tail);
-                }
+                // The `full_event` runs without any worklist lock held, so
+                // it may take items or stop the worklist itself
+                if (wl->status.adding >= wl_concurrency (wl))
+                    wl_event (&wl->mutex_tail, &wl->ls_tail, wl->attr->full_event);
+                continue;
             }
         }
-        if (wl->status.stop) {
+        if (is_stopped (wl)) {
             pthread_mutex_unlock (&wl->mutex_tail);
             return STAT_TERM;
         }
         pthread_cond_wait (&wl->cond_nonfull, &wl->mutex_tail);
     }
-    if (registered && !wl->attr)
+    if (registered && wl->attr)
         wl->status.adding--;
     /* not full now, append item and signal cond_nonempty */
     wl->queue[wl->tail] = item;
-    wl->tail = (wl->tail + 1) % wl->qsize;
+    __atomic_store_n (&wl->tail, (wl->tail + 1) % wl->qsize, __ATOMIC_RELEASE);
     pthread_mutex_unlock (&wl->mutex_tail);
-    pthread_cond_signal (&wl->cond_nonempty);
+    wake_takers (wl, 0);
+    wl_watermark (wl, 1);
     return STAT_OK;
 }
 
-/* Blocking take work */
-work_item worklist_take (worklist_t* wl) {
-    int registered = 0;
-    work_item item;
+/* Blocking add of a batch of work */
+int worklist_add_batch(worklist_t* wl, const work_item* items, size_t n,
+                       size_t* added) {
+    size_t i = 0;
+    int ret;
+    if (added)
+        *added = 0;
+    if (wl->type != WL_FIFO || wl->sp || wl->sc) {
+        for (i = 0; i < n; i++) {
+            if ((ret = worklist_add (wl, items[i])))
+                return ret;
+            if (added)
+                *added = i + 1;
+        }
+        return STAT_OK;
+    }
+    LS_MUTEX_LOCK (&wl->mutex_tail, &wl->ls_tail);
+    while (i < n) {
+        if ((wl->tail + 1) % wl->qsize == ring_head (wl)) {
+            if (is_stopped (wl)) {
+                pthread_mutex_unlock (&wl->mutex_tail);
+                wl_watermark (wl, (long) i);
+                if (added)
+                    *added = i;
+                return STAT_TERM;
+            }
+            /* let the takers drain what we have added so far */
+            wake_takers (wl, 1);
+            pthread_cond_wait (&wl->cond_nonfull, &wl->mutex_tail);
+            continue;
+        }
+        wl->queue[wl->tail] = items[i++];
+        __atomic_store_n (&wl->tail, (wl->tail + 1) % wl->qsize,
+                          __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock (&wl->mutex_tail);
+    if (n > 0)
+        wake_takers (wl, n > 1);
+    wl_watermark (wl, (long) n);
+    if (added)
+        *added = n;
+    return STAT_OK;
+}
+
+/* Blocking take, until `abstime` unless NULL and, unless `kicks` is NULL,
+ * until kicked
+ */
+static int wl_take(worklist_t* wl, work_item* item,
+                   const struct timespec* abstime, const size_t* kicks) {
+    int registered = 0, timeout = 0;
+    if (wl->type != WL_FIFO)
+        return wl_get (wl, item, abstime, kicks);
+    if (wl->sp || wl->sc)
+        return sr_take (wl, item, 1, abstime, kicks);
     // Enter the critical section for worklist head
-    pthread_mutex_lock (&wl->mutex_head);
+    LS_MUTEX_LOCK (&wl->mutex_head, &wl->ls_head);
 
     // If worklist is totally empty, empty_event (if defined) is triggered; 
     // else the current thread shall wait on cond_nonempty
-    while ((wl->head + 1) % wl->qsize == wl->tail) {
+    while ((wl->head + 1) % wl->qsize == ring_tail (wl)) {
         if (!registered) {
             registered = 1;
-            if (!wl->attr) {
+            if (wl->attr) {
                 wl->status.taking++;
-                if (wl->status.taking >= wl->attr->concurrency)
-                {
-                    // These unlocks & locks around the `empty_event` are necessary to
-                    // 1. make sure no threads executing `worklist_add` will stuck at
-                    //    `cond_nonempty`
-                    // 2. no deadlock (which may be caused by locking mutex_tail w/o
-                    //    unlocking mutex_tail here)
-                    pthread_mutex_unlock (&wl->mutex_head);
-                    pthread_mutex_lock (&wl->mutex_tail);
-                    wl->attr->empty_event.run (wl->attr->empty_event.arg);
-                    pthread_mutex_unlock (&wl->mutex_tail);
-                    pthread_mutex_lock (&wl->mutex_head);
-                }
+                // Same as `full_event`, no worklist lock is held
+                if (wl->status.taking >= wl_concurrency (wl))
+                    wl_event (&wl->mutex_head, &wl->ls_head, wl->attr->empty_event);
+                continue;
             }
         }
-        if (wl->status.stop) {
+        if (is_stopped (wl)) {
+            pthread_mutex_unlock (&wl->mutex_head);
+            return STAT_TERM;
+        }
+        if (timeout || wl_kicked (wl, kicks)) {
+            /* no longer among the waiting takers */
+            if (registered && wl->attr)
+                wl->status.taking--;
             pthread_mutex_unlock (&wl->mutex_head);
-            return WL_EMPTYITEM;
+            return timeout ? STAT_EMPTY : STAT_AGAIN;
         }
-        pthread_cond_wait (&wl->cond_nonempty, &wl->mutex_head);
+        /* adders do not take `mutex_head`, see `wake_takers` */
+        __atomic_add_fetch (&wl->waiters, 1, __ATOMIC_SEQ_CST);
+        if ((wl->head + 1) % wl->qsize ==
+            __atomic_load_n (&wl->tail, __ATOMIC_SEQ_CST))
+            timeout = wl_wait (&wl->cond_nonempty, &wl->mutex_head, abstime);
+        __atomic_sub_fetch (&wl->waiters, 1, __ATOMIC_SEQ_CST);
     }
-    if (registered && !wl->attr)
+    if (registered && wl->attr)
         wl->status.taking--;
     /* not empty now, poll item and signal cond_nonfull (if block any) */
-    wl->head = (wl->head + 1) % wl->qsize;
-    item = wl->queue[wl->head];
+    *item = wl->queue[(wl->head + 1) % wl->qsize];
+    __atomic_store_n (&wl->head, (wl->head + 1) % wl->qsize, __ATOMIC_RELEASE);
     pthread_mutex_unlock (&wl->mutex_head);
     pthread_cond_signal (&wl->cond_nonfull);
-    return item;
+    wl_watermark (wl, -1);
+    return STAT_OK;
+}
+
+/* Blocking take work */
+work_item worklist_take (worklist_t* wl) {
+    work_item item;
+    return wl_take (wl, &item, NULL, NULL) == STAT_OK ? item : WL_EMPTYITEM;
+}
+
+int worklist_take_timed(worklist_t* wl, work_item* item,
+                        const struct timespec* abstime) {
+    return wl_take (wl, item, abstime, NULL);
+}
+
+size_t worklist_kicks(worklist_t* wl) {
+    return __atomic_load_n (&wl->kicks, __ATOMIC_ACQUIRE);
+}
+
+/* Sleepers check the count under `mutex_head`, bump and broadcast under
+ * it too, as `worklist_stop` does
+ */
+void worklist_kick(worklist_t* wl) {
+    LS_MUTEX_LOCK (&wl->mutex_head, &wl->ls_head);
+    __atomic_store_n (&wl->kicks, wl->kicks + 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast (&wl->cond_nonempty);
+    pthread_mutex_unlock (&wl->mutex_head);
+}
+
+int worklist_take_intr(worklist_t* wl, work_item* item,
+                       const struct timespec* abstime, size_t kicks) {
+    return wl_take (wl, item, abstime, &kicks);
 }
 
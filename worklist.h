@@ -1,35 +1,91 @@
-#ifndef WORKLIST_H_ 
+#ifndef WORKLIST_H_
 #define WORKLIST_H_
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
 #include "common.h"
+#include "lockstat.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+struct status {
+    int stop;
+    int adding;
+    int taking;
+};
+typedef struct status status_t;
+
+/* Watermark callback, see `worklistattr_setwatermark` */
+typedef void (*wl_watermark_cb)(void* ctx, int above, long depth);
+
 typedef struct worklist_attr {
     int     trigger;
     size_t  concurrency;
     work_item empty_event, full_event;
+    int     type;
+    int     delta;
+    size_t  factor;
+    int     drop;
+    int     sp, sc;
+    int     memflags;
+    long    low, high;
+    wl_watermark_cb watermark;
+    void*   watermark_ctx;
+    const int* group;       /* see `worklistattr_setgroups` */
+    const int* package;
+    size_t  ngroup;
 } worklist_attr;
 
+typedef struct worklist_stats {
+    size_t  deadline_missed;    /* WL_EDF: taken after the deadline */
+    size_t  deadline_dropped;   /* WL_EDF: discarded, deadline passed */
+} worklist_stats;
+
+/* backend state of the non-ring worklists, see worklist.c */
+struct wl_obim;
+struct wl_cfifo;
+struct wl_mq;
+struct wl_edf;
+
 typedef struct worklist {
     work_item* queue;
+    size_t     qbytes;      /* mapped length of `queue`, 0 if malloc'ed */
     size_t head, tail;
     size_t qsize;
     status_t status;
     pthread_mutex_t  mutex_head, mutex_tail;
     pthread_cond_t   cond_nonempty, cond_nonfull;
     worklist_attr* attr;
+    /* scheduling policy and state of non-ring worklists */
+    int    type;
+    size_t waiters;
+    struct wl_obim*  obim;
+    struct wl_cfifo* fifo;
+    struct wl_mq*    mq;
+    struct wl_edf*   edf;
+    size_t*          steal;     /* steal order of the slots, or NULL */
+    /* WL_FIFO single producer/consumer, `adders` count producers
+     * sleeping on `cond_nonfull` as `waiters` do takers
+     */
+    int    sp, sc;
+    size_t adders;
+    /* bumped under `mutex_head` by `worklist_kick` */
+    size_t kicks;
+    /* queued items and watermark state, kept only with a watermark */
+    long   depth;
+    int    above;
+    /* contention of `mutex_head`/`mutex_tail`, see `lockstat.h` */
+    lockstat ls_head, ls_tail;
 } worklist_t;
 
 /* empty task which literally does nothing */
-static void* _wl_dry_run(void* arg) {
-    return NULL;
-}
-const work_item WL_EMPTYITEM = { (task) _wl_dry_run, NULL };
+extern const work_item WL_EMPTYITEM;
 
 /* init a worklist_attr data structure, default:
  * trigger = 0; concurrency = 0; empty_event = full_event = WL_EMPTYITEM
+ * type = WL_FIFO; delta = 0; factor = 2; drop = 0
  */
 extern void worklistattr_init (worklist_attr *attr);
 
@@ -42,7 +98,64 @@ extern void worklistattr_setevent (worklist_attr *attr,
                                    work_item empty_event,
                                    work_item full_event);
 
-/* init a new worklist with specified size and attribute */
+/* set the scheduling policy of the worklist, see `common.h` */
+extern void worklistattr_settype (worklist_attr *attr, int type);
+
+/* WL_OBIM only: items whose priorities agree except for the lowest `delta`
+ * bits share one bucket (bucket width 2^delta, as in delta-stepping)
+ */
+extern void worklistattr_setdelta (worklist_attr *attr, int delta);
+
+/* WL_MULTIQUEUE only: number of heaps per concurrent thread (relaxation
+ * factor). More heaps contend less but pop further from the minimum.
+ */
+extern void worklistattr_setfactor (worklist_attr *attr, size_t factor);
+
+/* WL_EDF only: discard items whose deadline passed before they are taken */
+extern void worklistattr_setdrop (worklist_attr *attr, int drop);
+
+/* WL_FIFO only: declare that a single thread adds (`producer`) and/or a
+ * single thread takes (`consumer`). That side then updates its ring index
+ * with a release store instead of taking its mutex, and only locks to
+ * sleep or to wake a sleeper. Empty/full events are not raised.
+ */
+extern void worklistattr_setsingle (worklist_attr *attr,
+                                    int producer, int consumer);
+
+/* WL_FIFO only: allocate the ring with mmap according to WL_MEM_* flags
+ * (see `common.h`) instead of malloc, for predictable first-burst latency
+ * of big rings. Huge pages and mlock are best effort: if the system
+ * refuses them the ring uses normal pages / stays swappable.
+ */
+extern void worklistattr_setmemory (worklist_attr *attr, int memflags);
+
+/* Call `cb` when the depth rises to `high` and, once it did, when it falls
+ * back to `low` (low < high), so callbacks alternate between above = 1 and
+ * above = 0. `cb` runs on the adding or taking thread after it released the
+ * worklist locks; it must not add to or take from the worklist itself.
+ */
+extern void worklistattr_setwatermark (worklist_attr *attr,
+                                       long low, long high,
+                                       wl_watermark_cb cb, void* ctx);
+
+/* WL_CHUNKED, WL_OBIM: slot `i` < `n` (the thread bound to it with
+ * `worklist_bindslot`) shares an L3 with the slots of the same `group[i]`
+ * and a socket with those of the same `package[i]`. A thread that runs out
+ * of items steals from its group first, then its package, then anywhere.
+ * The arrays are only read by `worklist_init`.
+ */
+extern void worklistattr_setgroups (worklist_attr *attr, const int* group,
+                                    const int* package, size_t n);
+
+/* Use slot `slot` (modulo the slots of a worklist) for the per-thread state
+ * of the calling thread in every worklist, instead of one derived from the
+ * order threads first touched a worklist.
+ */
+extern void worklist_bindslot (size_t slot);
+
+/* init a new worklist with specified size and attribute
+ * Only WL_FIFO is bounded, the other worklists ignore `size`
+ */
 extern int  worklist_init (worklist_t* wl, size_t size,
                            worklist_attr *attr);
 
@@ -52,13 +165,96 @@ extern void worklist_reset (worklist_t* wl);
 /* destroy worklist, release all resources */
 extern void worklist_destroy (worklist_t* wl);
 
+/* Change how many takers (adders) must wait before the empty (full)
+ * event runs, e.g. as threads come and go. What the attr's concurrency
+ * sized at init keeps its size.
+ */
+extern void worklist_setconcurrency (worklist_t* wl, size_t concurrency);
+
 /* stop all ongoing & future tasks (add/take) on the worklist */
 extern void worklist_stop (worklist_t* wl);
 
+/* fork() support, for `pthread_atfork` handlers. `prepare` takes every lock
+ * of the worklist so no thread is inside it when the process forks, and
+ * `parent` releases them again. `child` releases them in the child and
+ * forgets the threads sleeping in the worklist, which do not exist there;
+ * queued items are kept. A chunk a thread was publishing without a lock
+ * (WL_CHUNKED, WL_OBIM) may be missing in the child.
+ */
+extern void worklist_fork_prepare (worklist_t* wl);
+extern void worklist_fork_parent (worklist_t* wl);
+extern void worklist_fork_child (worklist_t* wl);
+
 /* blocking add/take if the worklist is totally full/empty */
 extern int worklist_add(worklist_t* wl, work_item item);
 extern work_item worklist_take (worklist_t* wl);
 
+/* add `n` items, in order. WL_FIFO takes `mutex_tail` once for the batch
+ * (blocking while full) and wakes the takers once; the other worklists add
+ * one by one. Batch adders do not count towards the full event. Unless
+ * NULL, `added` is set to the number of items added, all of them on
+ * STAT_OK, the ones before the failing item otherwise.
+ */
+extern int worklist_add_batch (worklist_t* wl, const work_item* items,
+                               size_t n, size_t* added);
+
+/* non-blocking take, return STAT_OK or STAT_EMPTY */
+extern int worklist_trytake (worklist_t* wl, work_item* item);
+
+/* blocking take until the absolute CLOCK_MONOTONIC time `abstime`
+ * return: STAT_OK, STAT_EMPTY on timeout or STAT_TERM once stopped
+ */
+extern int worklist_take_timed (worklist_t* wl, work_item* item,
+                                const struct timespec* abstime);
+
+/* Interruptible take: `worklist_kick` wakes every sleeping taker, and a
+ * `worklist_take_intr` passed the `worklist_kicks` read before deciding to
+ * sleep returns STAT_AGAIN once there was a kick since. `abstime` may be
+ * NULL to wait without a timeout.
+ * return: STAT_OK, STAT_EMPTY on timeout, STAT_AGAIN or STAT_TERM
+ */
+extern size_t worklist_kicks (worklist_t* wl);
+extern void worklist_kick (worklist_t* wl);
+extern int worklist_take_intr (worklist_t* wl, work_item* item,
+                               const struct timespec* abstime, size_t kicks);
+
+/* Give memory the worklist holds for items back to the system while it is
+ * empty: the pages of a WL_FIFO ring (unless prefaulted, locked or single
+ * producer/consumer) and the arrays of the heaps. Safe to call at any
+ * time, a worklist that is not empty is left as it is.
+ */
+extern void worklist_trim (worklist_t* wl);
+
+/* whether the worklist is empty, only exact when no thread adds or takes */
+extern int worklist_empty (worklist_t* wl);
+
+/* add an item with an integer priority, lower values are taken first.
+ * WL_OBIM and WL_MULTIQUEUE honour the priority approximately: in WL_OBIM
+ * a thread keeps draining its current bucket until it runs dry or it pushes
+ * to a lower one; WL_MULTIQUEUE pops the better of two random heaps.
+ * Other worklists treat it as `worklist_add`.
+ */
+extern int worklist_add_prio (worklist_t* wl, work_item item, long prio);
+
+/* add an item with an absolute CLOCK_MONOTONIC deadline, WL_EDF takes the
+ * earliest deadline first; items added without one come last.
+ * Other worklists treat it as `worklist_add`.
+ */
+extern int worklist_add_deadline (worklist_t* wl, work_item item,
+                                  const struct timespec* deadline);
+
+/* read the worklist counters */
+extern void worklist_getstats (worklist_t* wl, worklist_stats* stats);
+
+/* add the lock counters of `mutex_head`, `mutex_tail` and of all locks of
+ * the backend (summed) to `head`, `tail` and `backend`. All zero unless
+ * built with -DHTHPOOL_LOCKSTAT.
+ */
+extern void worklist_getlockstats (worklist_t* wl, lockstat* head,
+                                   lockstat* tail, lockstat* backend);
+
 #ifdef __cplusplus
 }
 #endif
+
+#endif